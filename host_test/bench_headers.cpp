@@ -0,0 +1,151 @@
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdio.h>
+
+#include "assets.h"
+#include "gzip_stream.h"
+#include "http_writer.h"
+#include "esp_timer.h"
+#include "test.h"
+
+/* Микробенчмарк заголовков ответа: сколько CPU на запрос уходит на их сборку.
+ * "snprintf" - как было до индекса: тип по цепочке strcasecmp и все строки через snprintf
+ * на каждый запрос. "prerendered" - как сейчас: поиск в индексе, готовый блок из арены и хвост
+ * Content-Length/Connection в http_writer. Чтение файла (раньше fopen/fseek) не учитывается.
+ * Индекс строится из файлов верхнего уровня main/data (на хосте readdir не плоский, как SPIFFS);
+ * заодно проверяем, что оба способа дают одни и те же байты */
+
+#define DATA_DIR "../main/data"
+#define ROUNDS 20000
+
+/* Определение типа из исходного send_file */
+static const char *get_mime_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return "application/octet-stream";
+    ext++;
+    if (strcasecmp(ext, "html") == 0) return "text/html; charset=utf-8";
+    if (strcasecmp(ext, "htm") == 0) return "text/html; charset=utf-8";
+    if (strcasecmp(ext, "css") == 0) return "text/css";
+    if (strcasecmp(ext, "js") == 0) return "application/javascript";
+    if (strcasecmp(ext, "json") == 0) return "application/json";
+    if (strcasecmp(ext, "png") == 0) return "image/png";
+    if (strcasecmp(ext, "jpg") == 0) return "image/jpeg";
+    if (strcasecmp(ext, "jpeg") == 0) return "image/jpeg";
+    if (strcasecmp(ext, "gif") == 0) return "image/gif";
+    if (strcasecmp(ext, "svg") == 0) return "image/svg+xml";
+    if (strcasecmp(ext, "ico") == 0) return "image/x-icon";
+    if (strcasecmp(ext, "txt") == 0) return "text/plain; charset=utf-8";
+    return "application/octet-stream";
+}
+
+/* То же, что has_content_hash в assets.cpp, но на каждый запрос */
+static bool has_content_hash(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *dot = strchr(name, '.');
+    while (dot) {
+        const char *next = strchr(dot + 1, '.');
+        if (!next) break;
+        size_t len = next - dot - 1;
+        if (len >= 16) {
+            bool hex = true;
+            for (const char *c = dot + 1; c < next && hex; c++) hex = isxdigit((unsigned char)*c);
+            if (hex) return true;
+        }
+        dot = next;
+    }
+    return false;
+}
+
+/* Заголовки ответа целиком через snprintf, с типом `mime` */
+static int format_header(const asset_t *asset, asset_encoding_t enc, const char *mime, char *buf, size_t buflen) {
+    const asset_variant_t *v = &asset->variants[enc];
+    bool varies = asset->variants[ASSET_ENC_GZIP].present ||
+                  gzip_stream_eligible(mime, asset->variants[ASSET_ENC_IDENTITY].size);
+    return snprintf(buf, buflen,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: %s\r\n"
+                    "ETag: %s\r\n"
+                    "Cache-Control: %s\r\n"
+                    "%s%s"
+                    "Content-Length: %u\r\n"
+                    "Connection: keep-alive\r\n"
+                    "\r\n",
+                    mime, asset->etag,
+                    has_content_hash(asset->path) ? "public, max-age=31536000, immutable" : "no-cache",
+                    enc == ASSET_ENC_GZIP ? "Content-Encoding: gzip\r\n" : "",
+                    varies ? "Vary: Accept-Encoding\r\n" : "",
+                    (unsigned)v->size);
+}
+
+/* Как сейчас в send_file: поиск в индексе и готовый блок заголовков */
+static size_t prerendered(http_writer_t *w, const char *path, bool gzip) {
+    http_writer_begin(w, true, true);
+    asset_read_begin();
+    const asset_t *asset = asset_lookup(path);
+    CHECK(asset);
+    const asset_variant_t *v = &asset->variants[asset_pick_encoding(asset, gzip)];
+    http_writer_head(w, v->header, v->header_len);
+    http_writer_body(w, HTTP_BODY_FIXED, v->size);
+    asset_read_end();
+    return w->fill;
+}
+
+int main(void) {
+    CHECK_EQ(asset_index_build(DATA_DIR), ESP_OK);
+    int count = asset_count();
+    CHECK(count > 0);
+
+    static char paths[ASSET_MAX][ASSET_PATH_MAX];
+    for (int i = 0; i < count; i++) strcpy(paths[i], asset_at(i)->path);
+
+    static transport_conn_t tc;
+    static uint8_t seg[HTTP_WRITER_BUF_LEN];
+    http_writer_t w;
+    http_writer_init(&w, &tc, seg);
+
+    // Одинаковые байты: готовый блок - это ровно то, что раньше собиралось на каждый запрос
+    char buf[512];
+    for (int i = 0; i < count; i++) {
+        const asset_t *asset = asset_at(i);
+        for (int gzip = 0; gzip < 2; gzip++) {
+            asset_encoding_t enc = asset_pick_encoding(asset, gzip);
+            if (!asset->variants[enc].present) continue;
+            int n = format_header(asset, enc, asset->mime, buf, sizeof(buf));
+            size_t len = prerendered(&w, paths[i], gzip);
+            CHECK_EQ(len, n);
+            CHECK(memcmp(seg, buf, n) == 0);
+        }
+    }
+
+    // Старый способ берет тип цепочкой strcasecmp, как исходный send_file
+    volatile size_t sink = 0;
+    int64_t t0 = esp_timer_get_time();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < count; i++) {
+            const asset_t *asset = asset_at(i);
+            asset_encoding_t enc = asset_pick_encoding(asset, r & 1);
+            if (!asset->variants[enc].present) continue;
+            sink += format_header(asset, enc, get_mime_type(paths[i]), buf, sizeof(buf));
+        }
+    }
+    int64_t old_us = esp_timer_get_time() - t0;
+
+    t0 = esp_timer_get_time();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < count; i++) {
+            const asset_t *asset = asset_at(i);
+            if (!asset->variants[asset_pick_encoding(asset, r & 1)].present) continue;
+            sink += prerendered(&w, paths[i], r & 1);
+        }
+    }
+    int64_t new_us = esp_timer_get_time() - t0;
+
+    double requests = (double)ROUNDS * count;
+    printf("  %d assets, %.0f requests\n", count, requests);
+    printf("  snprintf:    %6.0f ns/request\n", old_us * 1000.0 / requests);
+    printf("  prerendered: %6.0f ns/request (%.1fx)\n", new_us * 1000.0 / requests,
+           new_us ? (double)old_us / new_us : 0.0);
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+/* CRC-32 как в ROM ESP32 и в zlib: crc32_le(0, ...) дает CRC всего буфера, а передавая
+ * результат обратно, продолжаем его на следующем куске */
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
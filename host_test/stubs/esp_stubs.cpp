@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/semphr.h"
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    return code == ESP_OK ? "ESP_OK" : "ESP_ERR";
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+struct esp_timer { int unused; };
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out) {
+    static struct esp_timer timer;
+    *out = &timer;
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    return ESP_OK;
+}
+
+/* Wi-Fi на хосте нет: режим энергосбережения "выставляется" всегда */
+esp_err_t esp_wifi_set_ps(wifi_ps_type_t type) {
+    return ESP_OK;
+}
+
+struct host_semaphore { int taken; };
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return new host_semaphore();
+}
+
+/* Тесты однопоточные: повторный захват на устройстве был бы взаимной блокировкой */
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    if (sem->taken) {
+        fprintf(stderr, "xSemaphoreTake: mutex is already taken\n");
+        abort();
+    }
+    sem->taken = 1;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    sem->taken = 0;
+    return pdTRUE;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <unistd.h>
+
+#include "freertos/FreeRTOS.h"
+
+static inline void vTaskDelay(TickType_t ticks) {
+    usleep(ticks * 1000);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwip/err.h"
+
+/* netconn API lwIP на хосте нет: объявления для сборки transport.cpp. netconn_new возвращает
+ * NULL, так что transport_listen(TRANSPORT_NETCONN) дает ESP_ERR_NO_MEM */
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+
+typedef struct { uint32_t addr; } ip4_addr_t;
+typedef struct { uint32_t addr[4]; } ip6_addr_t;
+typedef struct { ip6_addr_t ip6; uint8_t type; } ip_addr_t;
+
+extern const ip_addr_t ip_addr_any_type;
+#define IP_ANY_TYPE (&ip_addr_any_type)
+#define IP_ADDR_ANY (&ip_addr_any_type)
+#define IP_IS_V6(a) ((a)->type == 6)
+#define ip_2_ip6(a) (&(a)->ip6)
+#define ip6_addr_isipv4mappedipv6(a) 0
+#define unmap_ipv4_mapped_ipv6(v4, v6) do { } while (0)
+char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen);
+char *ipaddr_ntoa_r(const ip_addr_t *addr, char *buf, int buflen);
+
+struct tcp_pcb;
+struct netconn { union { struct tcp_pcb *tcp; } pcb; };
+struct netbuf;
+
+enum netconn_type { NETCONN_TCP, NETCONN_TCP_IPV6 };
+
+#define NETCONN_NOCOPY 0x00
+#define NETCONN_COPY 0x01
+#define NETCONN_MORE 0x02
+#define NETCONN_DONTBLOCK 0x04
+
+struct netconn *netconn_new(enum netconn_type type);
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port);
+err_t netconn_listen_with_backlog(struct netconn *conn, u8_t backlog);
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn);
+err_t netconn_peer(struct netconn *conn, ip_addr_t *addr, u16_t *port);
+err_t netconn_delete(struct netconn *conn);
+err_t netconn_recv(struct netconn *conn, struct netbuf **buf);
+err_t netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *written);
+#define netconn_write(conn, data, size, flags) netconn_write_partly(conn, data, size, flags, NULL)
+void netconn_set_recvtimeout(struct netconn *conn, int ms);
+void netconn_set_sendtimeout(struct netconn *conn, int ms);
+u16_t netbuf_copy_partial(struct netbuf *buf, void *data, u16_t len, u16_t offset);
+u16_t netbuf_len(struct netbuf *buf);
+void netbuf_delete(struct netbuf *buf);
@@ -0,0 +1,5 @@
+#pragma once
+
+struct tcp_pcb;
+
+void tcp_abort(struct tcp_pcb *pcb);
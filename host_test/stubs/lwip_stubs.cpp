@@ -0,0 +1,28 @@
+#include "lwip/api.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcpip_priv.h"
+
+/* netconn на хосте не поднимается: transport.cpp собирается, но работает только через сокеты */
+
+const ip_addr_t ip_addr_any_type = {};
+
+char *ip4addr_ntoa_r(const ip4_addr_t *addr, char *buf, int buflen) { return NULL; }
+char *ipaddr_ntoa_r(const ip_addr_t *addr, char *buf, int buflen) { return NULL; }
+
+struct netconn *netconn_new(enum netconn_type type) { return NULL; }
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, u16_t port) { return ERR_MEM; }
+err_t netconn_listen_with_backlog(struct netconn *conn, u8_t backlog) { return ERR_MEM; }
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn) { return ERR_MEM; }
+err_t netconn_peer(struct netconn *conn, ip_addr_t *addr, u16_t *port) { return ERR_MEM; }
+err_t netconn_delete(struct netconn *conn) { return ERR_OK; }
+err_t netconn_recv(struct netconn *conn, struct netbuf **buf) { return ERR_CLSD; }
+err_t netconn_write_partly(struct netconn *conn, const void *data, size_t size, u8_t flags, size_t *written) {
+    return ERR_MEM;
+}
+void netconn_set_recvtimeout(struct netconn *conn, int ms) {}
+void netconn_set_sendtimeout(struct netconn *conn, int ms) {}
+u16_t netbuf_copy_partial(struct netbuf *buf, void *data, u16_t len, u16_t offset) { return 0; }
+u16_t netbuf_len(struct netbuf *buf) { return 0; }
+void netbuf_delete(struct netbuf *buf) {}
+void tcp_abort(struct tcp_pcb *pcb) {}
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data *call) { return fn(call); }
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+/* SHA-256 на хосте не считается: тестам манифест не нужен, функции ничего не делают */
+typedef struct { int unused; } mbedtls_sha256_context;
+
+static inline void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {}
+static inline int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224) { return 0; }
+static inline int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t len) { return 0; }
+static inline int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32]) { return 0; }
+static inline void mbedtls_sha256_free(mbedtls_sha256_context *ctx) {}
@@ -0,0 +1,5 @@
+#pragma once
+
+/* Конфигурация для сборки на хосте: то, что модули берут из menuconfig */
+#define CONFIG_LWIP_IPV6 1
+#define CONFIG_LWIP_TCP_MSS 1440
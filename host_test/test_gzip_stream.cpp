@@ -0,0 +1,139 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "gzip_stream.h"
+#include "esp_timer.h"
+#include "test.h"
+
+/* Сжатие на лету против настоящего gunzip: поток, собранный из кусков разной длины, должен
+ * распаковываться в исходные данные с верными CRC и размером. Заодно печатаем степень сжатия
+ * и скорость компрессора на хосте */
+
+#define SAMPLE_MAX (300 * 1024)
+
+static gzip_stream_t s_z;
+static uint8_t s_in[SAMPLE_MAX];
+static uint8_t s_gz[SAMPLE_MAX * 2];
+static uint8_t s_back[SAMPLE_MAX + 1];
+
+/* Сжимаем `len` байт кусками, длины которых перебираются по `chunks`. Возвращает длину .gz */
+static size_t compress(const uint8_t *in, size_t len, const size_t *chunks, size_t nchunks) {
+    size_t out = 0;
+    size_t pos = 0;
+    gzip_stream_begin(&s_z);
+    for (size_t i = 0; pos < len; i++) {
+        size_t n = chunks[i % nchunks];
+        if (n > len - pos) n = len - pos;
+        size_t w = gzip_stream_write(&s_z, in + pos, n, s_gz + out);
+        CHECK(w <= GZIP_STREAM_OUT_MAX);
+        out += w;
+        pos += n;
+    }
+    size_t w = gzip_stream_finish(&s_z, s_gz + out);
+    CHECK(w <= GZIP_STREAM_OUT_MAX);
+    return out + w;
+}
+
+/* Распаковываем gunzip'ом через временные файлы. Возвращает длину распакованного */
+static size_t gunzip(const uint8_t *gz, size_t len) {
+    char gz_path[] = "/tmp/gzip_stream_XXXXXX";
+    int fd = mkstemp(gz_path);
+    CHECK(fd >= 0);
+    CHECK_EQ(write(fd, gz, len), len);
+    close(fd);
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "gzip -dc < %s", gz_path);
+    FILE *p = popen(cmd, "r");
+    CHECK(p);
+    size_t n = fread(s_back, 1, sizeof(s_back), p);
+    int status = pclose(p);
+    unlink(gz_path);
+    // gzip проверяет CRC-32 и размер из хвоста: ошибка в них - ненулевой код выхода
+    CHECK_EQ(status, 0);
+    return n;
+}
+
+static void round_trip(const char *name, const uint8_t *in, size_t len) {
+    static const size_t whole[] = { GZIP_STREAM_IN_MAX };
+    static const size_t ragged[] = { 1, 7, GZIP_STREAM_IN_MAX, 300, 2, GZIP_STREAM_IN_MAX - 1, 64 };
+    const size_t *plans[] = { whole, ragged };
+    const size_t plan_len[] = { 1, sizeof(ragged) / sizeof(ragged[0]) };
+
+    for (int p = 0; p < 2; p++) {
+        int64_t t0 = esp_timer_get_time();
+        size_t gz_len = compress(in, len, plans[p], plan_len[p]);
+        int64_t us = esp_timer_get_time() - t0;
+        size_t back = gunzip(s_gz, gz_len);
+        CHECK_EQ(back, len);
+        CHECK(memcmp(s_back, in, len) == 0);
+        if (p == 0) {
+            printf("  %-10s %7zu -> %7zu bytes (%3d%%), %5.1f MB/s\n", name, len, gz_len,
+                   len ? (int)(gz_len * 100 / len) : 0, us ? len / (double)us : 0.0);
+        }
+    }
+}
+
+/* Что-то похожее на разметку и скрипты сайта: много повторов на разных расстояниях */
+static size_t make_text(uint8_t *buf, size_t len) {
+    static const char *const words[] = {
+        "<div class=\"card\">", "</div>\n", "function ", "return ", "const ", "=> {", "});\n",
+        "<span>", "</span>", "color: #333;", "margin: 0 auto;", "data-id=\"", "\"", " ",
+    };
+    size_t pos = 0;
+    unsigned seed = 1;
+    while (pos < len) {
+        seed = seed * 1103515245 + 12345;
+        const char *w = words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+        size_t n = strlen(w);
+        if (n > len - pos) n = len - pos;
+        memcpy(buf + pos, w, n);
+        pos += n;
+        if ((seed >> 8) % 5 == 0 && pos < len) buf[pos++] = '0' + (seed >> 4) % 10;
+    }
+    return len;
+}
+
+int main(void) {
+    round_trip("empty", s_in, 0);
+
+    memcpy(s_in, "a", 1);
+    round_trip("one byte", s_in, 1);
+
+    // Ссылки назад сквозь сдвиги окна и куски разной длины
+    make_text(s_in, 200 * 1024);
+    round_trip("text", s_in, 200 * 1024);
+
+    // Несжимаемое: каждый литерал 8-9 бит, проверяем оценку GZIP_STREAM_OUT_MAX
+    unsigned seed = 7;
+    for (size_t i = 0; i < 64 * 1024; i++) {
+        seed = seed * 1664525 + 1013904223;
+        s_in[i] = seed >> 24;
+    }
+    round_trip("random", s_in, 64 * 1024);
+
+    // Длинные повторы: совпадения максимальной длины и на расстоянии 1
+    memset(s_in, 'x', SAMPLE_MAX);
+    round_trip("run", s_in, SAMPLE_MAX);
+
+    // Все значения байтов: литералы 144-255 кодируются 9 битами
+    for (size_t i = 0; i < 4096; i++) s_in[i] = (uint8_t)(i * 7);
+    round_trip("bytes", s_in, 4096);
+
+    gzip_stream_stats_t st;
+    gzip_stream_get_stats(&st);
+    CHECK(st.streams == 12);
+    CHECK(st.bytes_in > 0 && st.bytes_out > 0);
+
+    CHECK(gzip_stream_eligible("text/html", 4096));
+    CHECK(gzip_stream_eligible("application/javascript", 4096));
+    CHECK(gzip_stream_eligible("image/svg+xml", 4096));
+    CHECK(!gzip_stream_eligible("image/png", 4096));
+    CHECK(!gzip_stream_eligible("text/css", GZIP_STREAM_MIN_SIZE - 1));
+    CHECK(!gzip_stream_eligible("text/css", GZIP_STREAM_MAX_SIZE + 1));
+
+    printf("  ok\n");
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "transport.h"
+#include "test.h"
+
+/* Транспорт на сокетах хоста: двойной стек слушателя, адреса клиентов, прием, отправка,
+ * таймаут приема, закрытие и пробуждение accept. Клиенты подключаются через loopback */
+
+static uint16_t listener_port(const transport_listener_t *l) {
+    struct sockaddr_in6 addr;
+    socklen_t len = sizeof(addr);
+    CHECK(getsockname(l->sock, (struct sockaddr *)&addr, &len) == 0);
+    return ntohs(addr.sin6_port);
+}
+
+/* Подключаемся к слушателю по `addr` семейства `family`. -1 - не удалось */
+static int connect_to(int family, const char *addr, uint16_t port) {
+    int s = socket(family, SOCK_STREAM, 0);
+    CHECK(s >= 0);
+    int r;
+    if (family == AF_INET6) {
+        struct sockaddr_in6 a = {};
+        a.sin6_family = AF_INET6;
+        a.sin6_port = htons(port);
+        inet_pton(AF_INET6, addr, &a.sin6_addr);
+        r = connect(s, (struct sockaddr *)&a, sizeof(a));
+    } else {
+        struct sockaddr_in a = {};
+        a.sin_family = AF_INET;
+        a.sin_port = htons(port);
+        inet_pton(AF_INET, addr, &a.sin_addr);
+        r = connect(s, (struct sockaddr *)&a, sizeof(a));
+    }
+    if (r != 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static void recv_all(int s, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = recv(s, buf + got, len - got, 0);
+        CHECK(r > 0);
+        got += r;
+    }
+}
+
+/* IPv6-клиент на ::1: адрес как есть, запрос доходит, ответ приходит целиком */
+static void test_ipv6_loopback(transport_listener_t *l, uint16_t port) {
+    int client = connect_to(AF_INET6, "::1", port);
+    CHECK(client >= 0);
+    transport_conn_t conn;
+    CHECK_EQ(transport_accept(l, &conn), ESP_OK);
+    CHECK(conn.ipv6);
+    CHECK(strcmp(conn.addr, "::1") == 0);
+
+    static const char request[] = "GET / HTTP/1.1\r\nHost: [::1]\r\n\r\n";
+    CHECK_EQ(send(client, request, sizeof(request) - 1, 0), sizeof(request) - 1);
+    char buf[128];
+    size_t got = 0;
+    while (got < sizeof(request) - 1) {
+        int r = transport_recv(&conn, buf + got, sizeof(buf) - got);
+        CHECK(r > 0);
+        got += r;
+    }
+    CHECK(memcmp(buf, request, got) == 0);
+
+    // Больше буфера одного send: transport_send досылает остаток сам
+    static uint8_t body[256 * 1024], echo[sizeof(body)];
+    for (size_t i = 0; i < sizeof(body); i++) body[i] = (uint8_t)(i * 31 + (i >> 8));
+    CHECK(transport_send(&conn, body, sizeof(body), false, false));
+    recv_all(client, echo, sizeof(echo));
+    CHECK(memcmp(body, echo, sizeof(body)) == 0);
+
+    CHECK(transport_send_nowait(&conn, "ok", 2, false));
+    recv_all(client, echo, 2);
+    CHECK(memcmp(echo, "ok", 2) == 0);
+
+    // Клиент молчит: таймаут, а не ошибка, соединение живо
+    transport_set_recv_timeout(&conn, 50);
+    CHECK_EQ(transport_recv(&conn, buf, sizeof(buf)), TRANSPORT_RECV_TIMEOUT);
+
+    // Клиент закрыл первым: 0, закрываем без reset
+    close(client);
+    CHECK_EQ(transport_recv(&conn, buf, sizeof(buf)), 0);
+    transport_close(&conn, false);
+}
+
+/* IPv4-клиент на том же слушателе приходит как ::ffff:127.0.0.1 и показывается как IPv4 */
+static void test_ipv4_mapped(transport_listener_t *l, uint16_t port) {
+    int client = connect_to(AF_INET, "127.0.0.1", port);
+    if (client < 0) {
+        // net.ipv6.bindv6only=1: сокет IPv6 на хосте не принимает IPv4
+        printf("  skip ipv4 on dual-stack listener: errno %d\n", errno);
+        return;
+    }
+    transport_conn_t conn;
+    CHECK_EQ(transport_accept(l, &conn), ESP_OK);
+    CHECK(!conn.ipv6);
+    CHECK(strcmp(conn.addr, "127.0.0.1") == 0);
+
+    // Закрытие с reset: клиент видит конец соединения
+    CHECK(transport_send(&conn, "bye", 3, false, false));
+    transport_close(&conn, true);
+    char buf[8];
+    ssize_t r;
+    size_t got = 0;
+    while ((r = recv(client, buf + got, sizeof(buf) - got, 0)) > 0) got += r;
+    CHECK(r == 0 || errno == ECONNRESET);
+    close(client);
+}
+
+/* transport_listener_wake будит accept: сервер так пересоздает слушателя после смены адреса */
+static void test_wake(transport_listener_t *l) {
+    transport_listener_wake(l);
+    transport_conn_t conn;
+    CHECK_EQ(transport_accept(l, &conn), ESP_FAIL);
+}
+
+int main(void) {
+    transport_listener_t l;
+    CHECK_EQ(transport_listen(TRANSPORT_SOCKET, 0, &l), ESP_OK);
+    uint16_t port = listener_port(&l);
+    printf("  listening on [::]:%u\n", port);
+
+    test_ipv6_loopback(&l, port);
+    test_ipv4_mapped(&l, port);
+
+    transport_stats_t st;
+    transport_get_stats(TRANSPORT_SOCKET, &st);
+    CHECK(st.connections >= 1);
+    CHECK(st.bytes >= 256 * 1024);
+    CHECK_EQ(st.nocopy_bytes, 0);
+
+    test_wake(&l);
+    transport_listener_close(&l);
+    CHECK_EQ(l.sock, -1);
+
+    // netconn на хосте нет: слушатель не создается, а не падает
+    transport_listener_t nc;
+    CHECK(transport_listen(TRANSPORT_NETCONN, 0, &nc) != ESP_OK);
+
+    printf("  ok\n");
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include <string.h>
+
+#include "wifi_ps.h"
+#include "test.h"
+
+/* Контроллер энергосбережения с поддельными часами и esp_wifi_set_ps: переходы
+ * NONE -> MIN_MODEM -> MAX_MODEM по простою, пробуждение трафиком и учет времени в режимах */
+
+#define MS 1000LL
+#define S (1000 * MS)
+
+static int64_t s_now;
+static wifi_ps_type_t s_set_mode;
+static int s_set_calls;
+static bool s_set_fails;
+
+static esp_err_t fake_set_ps(wifi_ps_type_t type) {
+    s_set_calls++;
+    if (s_set_fails) return ESP_FAIL;
+    s_set_mode = type;
+    return ESP_OK;
+}
+
+static int64_t fake_now_us(void) {
+    return s_now;
+}
+
+static const wifi_ps_ops_t s_fake_ops = {
+    .set_ps = fake_set_ps,
+    .now_us = fake_now_us,
+};
+
+static void at(int64_t t) {
+    CHECK(t >= s_now);
+    s_now = t;
+}
+
+/* Режим контроллера и то, что он выставил в Wi-Fi, совпадают */
+static void check_mode(wifi_ps_type_t mode) {
+    CHECK_EQ(wifi_ps_mode(), mode);
+    CHECK_EQ(s_set_mode, mode);
+}
+
+int main(void) {
+    const int64_t t0 = 1 * S;
+    s_now = t0;
+    s_set_mode = WIFI_PS_MAX_MODEM;
+    CHECK_EQ(wifi_ps_init(&s_fake_ops, WIFI_PS_MAX_MODEM), ESP_OK);
+    check_mode(WIFI_PS_MAX_MODEM);
+    CHECK_EQ(s_set_calls, 0);
+
+    // Без трафика из глубокого сна никуда не уходим
+    at(t0 + 2 * S);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MAX_MODEM);
+    CHECK_EQ(s_set_calls, 0);
+
+    // Трафик будит модем сразу, не дожидаясь таймера
+    wifi_ps_activity();
+    check_mode(WIFI_PS_NONE);
+    CHECK_EQ(s_set_calls, 1);
+    // Пока модем не спит, трафик не трогает Wi-Fi
+    wifi_ps_activity();
+    CHECK_EQ(s_set_calls, 1);
+
+    // NONE -> MIN_MODEM ровно через WIFI_PS_IDLE_MS простоя
+    at(t0 + 2 * S + WIFI_PS_IDLE_MS * MS - 1);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_NONE);
+    at(t0 + 2 * S + WIFI_PS_IDLE_MS * MS);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MIN_MODEM);
+
+    // MIN_MODEM -> MAX_MODEM через WIFI_PS_DEEP_IDLE_MS от последнего трафика
+    at(t0 + 2 * S + WIFI_PS_DEEP_IDLE_MS * MS - 1);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MIN_MODEM);
+    at(t0 + 2 * S + WIFI_PS_DEEP_IDLE_MS * MS);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MAX_MODEM);
+    int64_t deep_at = s_now;
+
+    // Время в режимах: MAX 2 с до трафика, NONE - WIFI_PS_IDLE_MS, остальное до глубокого сна - MIN,
+    // и текущий режим учитывается до момента запроса
+    at(deep_at + 5 * S);
+    wifi_ps_stats_t st;
+    wifi_ps_get_stats(&st);
+    CHECK_EQ(st.mode, WIFI_PS_MAX_MODEM);
+    CHECK_EQ(st.time_in_mode_us[WIFI_PS_NONE], WIFI_PS_IDLE_MS * MS);
+    CHECK_EQ(st.time_in_mode_us[WIFI_PS_MIN_MODEM], (WIFI_PS_DEEP_IDLE_MS - WIFI_PS_IDLE_MS) * MS);
+    CHECK_EQ(st.time_in_mode_us[WIFI_PS_MAX_MODEM], 2 * S + 5 * S);
+    CHECK_EQ(st.switches, 3);
+    CHECK_EQ(st.wakeups, 1);
+
+    // Долгий простой без промежуточного тика: из NONE сразу в глубокий сон
+    wifi_ps_activity();
+    check_mode(WIFI_PS_NONE);
+    at(s_now + WIFI_PS_DEEP_IDLE_MS * MS);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MAX_MODEM);
+
+    // Трафик во время легкого сна тоже будит и откладывает переходы
+    wifi_ps_activity();
+    at(s_now + WIFI_PS_IDLE_MS * MS);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MIN_MODEM);
+    at(s_now + 10 * S);
+    wifi_ps_activity();
+    check_mode(WIFI_PS_NONE);
+    at(s_now + WIFI_PS_DEEP_IDLE_MS * MS - 1);
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MIN_MODEM);
+    wifi_ps_get_stats(&st);
+    CHECK_EQ(st.wakeups, 4);
+
+    // Wi-Fi не принял режим: остаемся в прежнем, время идет ему же
+    s_set_fails = true;
+    wifi_ps_get_stats(&st);
+    uint32_t switches = st.switches;
+    int64_t min_time = st.time_in_mode_us[WIFI_PS_MIN_MODEM];
+    at(s_now + 1);
+    wifi_ps_tick();
+    CHECK_EQ(wifi_ps_mode(), WIFI_PS_MIN_MODEM);
+    wifi_ps_get_stats(&st);
+    CHECK_EQ(st.switches, switches);
+    CHECK_EQ(st.time_in_mode_us[WIFI_PS_MIN_MODEM], min_time + 1);
+    s_set_fails = false;
+    wifi_ps_tick();
+    check_mode(WIFI_PS_MAX_MODEM);
+
+    // Сумма времени в режимах - все время работы контроллера
+    wifi_ps_get_stats(&st);
+    int64_t total = 0;
+    for (int i = 0; i < WIFI_PS_MODE_COUNT; i++) total += st.time_in_mode_us[i];
+    CHECK_EQ(total, s_now - t0);
+
+    // Задержка до первого байта: среднее по режиму на момент accept
+    wifi_ps_note_first_byte(WIFI_PS_NONE, 100);
+    wifi_ps_note_first_byte(WIFI_PS_NONE, 300);
+    wifi_ps_note_first_byte(WIFI_PS_MAX_MODEM, 250000);
+    wifi_ps_get_stats(&st);
+    CHECK_EQ(st.first_byte_samples[WIFI_PS_NONE], 2);
+    CHECK_EQ(st.first_byte_avg_us[WIFI_PS_NONE], 200);
+    CHECK_EQ(st.first_byte_samples[WIFI_PS_MAX_MODEM], 1);
+    CHECK_EQ(st.first_byte_avg_us[WIFI_PS_MAX_MODEM], 250000);
+    CHECK_EQ(st.first_byte_samples[WIFI_PS_MIN_MODEM], 0);
+
+    printf("  ok\n");
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_spiffs.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "asset_image.h"
+#include "assets.h"
+#include "cache.h"
+#include "file_pool.h"
+
+static const char *TAG = "asset_image";
+
+static const char *const s_labels[2] = { ASSET_IMAGE_LABEL_A, ASSET_IMAGE_LABEL_B };
+static volatile int s_active = 0;
+static volatile bool s_updating = false;
+static const char *s_base_path;
+static int s_max_files;
+static asset_image_stats_t s_stats;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_err_t mount(int slot, const char *base_path, int max_files, bool format) {
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = base_path,
+        .partition_label = s_labels[slot],
+        .max_files = (size_t)max_files,
+        .format_if_mount_failed = format
+    };
+    return esp_vfs_spiffs_register(&conf);
+}
+
+static void save_slot(int slot) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(ASSET_IMAGE_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_u8(nvs, ASSET_IMAGE_NVS_KEY, (uint8_t)slot);
+        if (err == ESP_OK) err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    // Раздел уже подменен, после перезагрузки отдастся старый
+    if (err != ESP_OK) ESP_LOGW(TAG, "Unable to save active slot (%s)", esp_err_to_name(err));
+}
+
+esp_err_t asset_image_mount(const char *base_path, int max_files, bool format_if_failed) {
+    s_base_path = base_path;
+    s_max_files = max_files;
+    uint8_t slot = 0;
+    nvs_handle_t nvs;
+    if (nvs_open(ASSET_IMAGE_NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u8(nvs, ASSET_IMAGE_NVS_KEY, &slot);
+        nvs_close(nvs);
+    }
+    if (slot > 1) slot = 0;
+
+    esp_err_t ret = mount(slot, base_path, max_files, false);
+    if (ret == ESP_FAIL) {
+        // Лучше отдать прошлый образ, чем отформатировать раздел
+        ESP_LOGW(TAG, "Unable to mount %s, trying %s", s_labels[slot], s_labels[1 - slot]);
+        if (mount(1 - slot, base_path, max_files, false) == ESP_OK) {
+            slot = 1 - slot;
+            ret = ESP_OK;
+        } else {
+            ret = mount(slot, base_path, max_files, format_if_failed);
+        }
+    }
+    if (ret == ESP_OK) {
+        s_active = slot;
+        ESP_LOGI(TAG, "Serving assets from %s", s_labels[slot]);
+    }
+    return ret;
+}
+
+const char *asset_image_label(void) {
+    return s_labels[s_active];
+}
+
+static bool parse_sha256(const char *hex, uint8_t *out) {
+    if (strlen(hex) != 64) return false;
+    for (int i = 0; i < 32; i++) {
+        unsigned v;
+        if (sscanf(hex + i * 2, "%2x", &v) != 1) return false;
+        out[i] = (uint8_t)v;
+    }
+    return true;
+}
+
+static esp_err_t erase_to(asset_image_t *img, size_t end) {
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = esp_partition_erase_range(img->part, img->erased, end - img->erased);
+    img->erase_us += esp_timer_get_time() - t0;
+    if (err == ESP_OK) img->erased = end;
+    return err;
+}
+
+/* Приемник конвейера: стираем сектор перед тем, как в него писать */
+static esp_err_t image_sink(void *ctx, const uint8_t *data, size_t len) {
+    asset_image_t *img = (asset_image_t *)ctx;
+    size_t end = img->written + len;
+    if (end > img->erased) {
+        esp_err_t err = erase_to(img, (end + ASSET_IMAGE_SECTOR - 1) / ASSET_IMAGE_SECTOR * ASSET_IMAGE_SECTOR);
+        if (err != ESP_OK) return err;
+    }
+    esp_err_t err = esp_partition_write(img->part, img->written, data, len);
+    if (err == ESP_OK) img->written = end;
+    return err;
+}
+
+esp_err_t asset_image_begin(asset_image_t *img, size_t size, const char *sha256_hex, upload_mode_t mode) {
+    if (!parse_sha256(sha256_hex, img->expected)) return ESP_ERR_INVALID_ARG;
+    img->slot = 1 - s_active;
+    img->part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS,
+                                         s_labels[img->slot]);
+    if (!img->part) return ESP_ERR_NOT_FOUND;
+    if (size == 0 || size > img->part->size) return ESP_ERR_INVALID_SIZE;
+    esp_err_t err = upload_stream_begin(&img->up, image_sink, img, size, mode);
+    if (err != ESP_OK) return err;
+
+    img->written = 0;
+    img->erased = 0;
+    img->erase_us = 0;
+    mbedtls_sha256_init(&img->sha);
+    mbedtls_sha256_starts(&img->sha, 0);
+    s_updating = true;
+    ESP_LOGI(TAG, "Writing %u byte image to %s", (unsigned)size, img->part->label);
+    return ESP_OK;
+}
+
+esp_err_t asset_image_write(asset_image_t *img, const void *data, size_t len) {
+    esp_err_t err = upload_write(&img->up, data, len);
+    if (err == ESP_OK) mbedtls_sha256_update(&img->sha, (const unsigned char *)data, len);
+    return err;
+}
+
+/* Перечитываем записанное с flash: хеш тела еще не значит, что так и записалось */
+static esp_err_t verify_flash(asset_image_t *img) {
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    uint8_t buf[512];
+    esp_err_t err = ESP_OK;
+    for (size_t offset = 0; offset < img->written && err == ESP_OK;) {
+        size_t n = MIN(sizeof(buf), img->written - offset);
+        err = esp_partition_read(img->part, offset, buf, n);
+        mbedtls_sha256_update(&sha, buf, n);
+        offset += n;
+    }
+    uint8_t sum[32];
+    mbedtls_sha256_finish(&sha, sum);
+    mbedtls_sha256_free(&sha);
+    if (err == ESP_OK && memcmp(sum, img->expected, sizeof(sum)) != 0) err = ESP_ERR_INVALID_CRC;
+    return err;
+}
+
+/* Образ SPIFFS монтируется: иначе после подмены отдавать было бы нечего */
+static esp_err_t verify_mount(asset_image_t *img) {
+    esp_vfs_spiffs_conf_t conf = {
+        .base_path = ASSET_IMAGE_VERIFY_PATH,
+        .partition_label = img->part->label,
+        .max_files = 1,
+        .format_if_mount_failed = false
+    };
+    esp_err_t err = esp_vfs_spiffs_register(&conf);
+    if (err != ESP_OK) return ESP_ERR_INVALID_STATE;
+    size_t total = 0, used = 0;
+    esp_spiffs_info(img->part->label, &total, &used);
+    esp_vfs_spiffs_unregister(img->part->label);
+    ESP_LOGI(TAG, "Image in %s mounts: %u of %u bytes used", img->part->label, (unsigned)used, (unsigned)total);
+    return ESP_OK;
+}
+
+/* Меняем раздел под индексом, когда никто не читает файлы. Все, кто открывает файлы раздела
+ * (ответы, прогрев, манифест), делают это под чтением индекса, так что до asset_update_end никто
+ * не откроет файл ни на старом разделе, ни на наполовину смонтированном. Уже открытые ответы
+ * дочитывают без индекса: их ждем отдельно */
+static esp_err_t switch_slot(int slot) {
+    int64_t deadline = esp_timer_get_time() + ASSET_IMAGE_SWITCH_WAIT_MS * 1000LL;
+    esp_err_t err = asset_update_begin(ASSET_IMAGE_SWITCH_WAIT_MS);
+    if (err != ESP_OK) return err;
+    // Дескрипторы закрываем, пока старый раздел смонтирован. Открытый файл не дал бы его отмонтировать
+    int busy;
+    while ((busy = file_pool_invalidate(NULL)) > 0 && esp_timer_get_time() < deadline) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    if (busy) {
+        ESP_LOGE(TAG, "%d file handles still in use, keeping %s", busy, s_labels[s_active]);
+        asset_update_end();
+        return ESP_ERR_INVALID_STATE;
+    }
+    cache_invalidate(NULL);
+    esp_vfs_spiffs_unregister(s_labels[s_active]);
+    err = mount(slot, s_base_path, s_max_files, false);
+    if (err == ESP_OK) {
+        s_active = slot;
+        save_slot(slot);
+    } else {
+        ESP_LOGE(TAG, "Unable to mount %s (%s), keeping %s", s_labels[slot], esp_err_to_name(err),
+                 s_labels[s_active]);
+        mount(s_active, s_base_path, s_max_files, false);
+    }
+    // Индекс по тому разделу, что в итоге смонтирован
+    esp_err_t index_err = asset_index_build(s_base_path);
+    asset_update_end();
+    return err != ESP_OK ? err : index_err;
+}
+
+static void finish_stats(asset_image_t *img, esp_err_t err, int64_t verify_us, int64_t switch_us) {
+    uint64_t total_us = esp_timer_get_time() - img->up.started_us;
+    portENTER_CRITICAL(&s_mux);
+    if (err == ESP_OK) {
+        s_stats.updates++;
+        s_stats.last_size = img->written;
+        s_stats.last_ms = total_us / 1000;
+        s_stats.last_kb_per_s = total_us ? (uint32_t)(img->written * 1000000ULL / 1024 / total_us) : 0;
+        s_stats.last_write_ms = img->up.write_us / 1000;
+        s_stats.last_erase_ms = img->erase_us / 1000;
+        s_stats.last_stalls = img->up.stalls;
+        s_stats.last_verify_ms = verify_us / 1000;
+        s_stats.last_switch_ms = switch_us / 1000;
+    } else {
+        s_stats.failed++;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    s_updating = false;
+}
+
+esp_err_t asset_image_finish(asset_image_t *img) {
+    esp_err_t err = upload_flush(&img->up);
+    uint8_t sum[32];
+    mbedtls_sha256_finish(&img->sha, sum);
+    mbedtls_sha256_free(&img->sha);
+    if (err == ESP_OK && memcmp(sum, img->expected, sizeof(sum)) != 0) {
+        ESP_LOGE(TAG, "Image checksum mismatch");
+        err = ESP_ERR_INVALID_CRC;
+    }
+    // Хвост прошлого образа SPIFFS приняла бы за свои страницы
+    if (err == ESP_OK && img->erased < img->part->size) err = erase_to(img, img->part->size);
+
+    int64_t t0 = esp_timer_get_time();
+    if (err == ESP_OK) err = verify_flash(img);
+    if (err == ESP_OK) err = verify_mount(img);
+    int64_t t1 = esp_timer_get_time();
+    // Пока идет подмена, новые загрузки не начинаются: они писали бы в уходящий раздел
+    if (err == ESP_OK) err = switch_slot(img->slot);
+    int64_t t2 = esp_timer_get_time();
+    upload_stream_end(&img->up);
+
+    finish_stats(img, err, t1 - t0, t2 - t1);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Switched to %s: %u bytes, verify %u ms, switch %u ms", s_labels[s_active],
+                 (unsigned)img->written, (unsigned)((t1 - t0) / 1000), (unsigned)((t2 - t1) / 1000));
+    } else {
+        ESP_LOGE(TAG, "Image update failed (%s), serving %s", esp_err_to_name(err), s_labels[s_active]);
+    }
+    return err;
+}
+
+void asset_image_abort(asset_image_t *img) {
+    upload_stream_end(&img->up);
+    mbedtls_sha256_free(&img->sha);
+    finish_stats(img, ESP_FAIL, 0, 0);
+}
+
+bool asset_image_busy(void) {
+    return s_updating;
+}
+
+void asset_image_get_stats(asset_image_stats_t *stats) {
+    portENTER_CRITICAL(&s_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_mux);
+    stats->active = s_labels[s_active];
+    stats->updating = s_updating;
+}
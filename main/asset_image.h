@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+
+#include "upload.h"
+
+/* Файлы сайта лежат в двух разделах SPIFFS (A/B). Отдается активный, новый образ пишется
+ * в неактивный и после проверки подменяет активный без перезагрузки */
+#define ASSET_IMAGE_PATH "/_image"
+#define ASSET_IMAGE_LABEL_A "assets_a"
+#define ASSET_IMAGE_LABEL_B "assets_b"
+/* Активный раздел переживает перезагрузку */
+#define ASSET_IMAGE_NVS_NAMESPACE "assets"
+#define ASSET_IMAGE_NVS_KEY "slot"
+/* Куда новый образ монтируется на пробу перед подменой */
+#define ASSET_IMAGE_VERIFY_PATH "/spiffs_next"
+/* Сколько подмена ждет, пока закончатся идущие ответы */
+#define ASSET_IMAGE_SWITCH_WAIT_MS 5000
+#define ASSET_IMAGE_SECTOR 4096
+
+typedef struct {
+    int slot;
+    const esp_partition_t *part;    // неактивный раздел, куда пишем
+    size_t written;
+    size_t erased;                  // стерто с начала раздела
+    uint64_t erase_us;
+    mbedtls_sha256_context sha;     // по принятому телу
+    uint8_t expected[32];
+    upload_t up;
+} asset_image_t;
+
+typedef struct {
+    const char *active;
+    bool updating;
+    uint32_t updates;           // подмен образа
+    uint32_t failed;
+    // Последняя подмена
+    uint32_t last_size;
+    uint32_t last_ms;           // от первого байта тела до подмены
+    uint32_t last_kb_per_s;
+    uint32_t last_write_ms;     // запись на flash, включая стирание
+    uint32_t last_erase_ms;
+    uint32_t last_stalls;       // прием ждал flash
+    uint32_t last_verify_ms;    // хеш записанного и пробное монтирование
+    uint32_t last_switch_ms;    // подмена раздела и сборка индекса: ответы в это время ждут
+} asset_image_stats_t;
+
+/* Монтируем активный раздел в `base_path`. Если он не монтируется, пробуем второй
+ * и только потом форматируем активный (`format_if_failed`) */
+esp_err_t asset_image_mount(const char *base_path, int max_files, bool format_if_failed);
+
+/* Метка активного раздела, например для esp_spiffs_info */
+const char *asset_image_label(void);
+
+/* Начинаем образ длиной `size` с SHA-256 `sha256_hex` (64 hex-символа). Тело идет через
+ * конвейер загрузки. ESP_ERR_INVALID_ARG - нет хеша, ESP_ERR_INVALID_SIZE - не влезет в раздел,
+ * ESP_ERR_INVALID_STATE - идет другая загрузка */
+esp_err_t asset_image_begin(asset_image_t *img, size_t size, const char *sha256_hex, upload_mode_t mode);
+
+esp_err_t asset_image_write(asset_image_t *img, const void *data, size_t len);
+
+/* Проверяем хеш принятого и записанного, пробуем смонтировать и подменяем активный раздел:
+ * индекс, кеш и пул дескрипторов переходят на новые файлы. ESP_ERR_INVALID_CRC - хеш не совпал */
+esp_err_t asset_image_finish(asset_image_t *img);
+
+void asset_image_abort(asset_image_t *img);
+
+/* Идет запись образа: ответы в это время считаются отдельно */
+bool asset_image_busy(void);
+
+void asset_image_get_stats(asset_image_stats_t *stats);
@@ -0,0 +1,412 @@
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "assets.h"
+#include "mime.h"
+#include "gzip_stream.h"
+
+static const char *TAG = "assets";
+
+static asset_t s_assets[ASSET_MAX];
+static int s_asset_count = 0;
+
+/* Открытая адресация: слот хранит индекс в s_assets или -1 */
+static int16_t s_slots[ASSET_INDEX_SLOTS];
+
+/* Заголовки всех файлов лежат подряд в одном буфере */
+static char s_header_arena[ASSET_HEADER_ARENA];
+static size_t s_header_used = 0;
+static size_t s_base_len = 0;
+
+/* Читатели индекса и обновление: записи меняются, только когда читателей нет */
+static portMUX_TYPE s_rw_mux = portMUX_INITIALIZER_UNLOCKED;
+static int s_readers = 0;
+static bool s_updating = false;
+
+/* Angular кладет хеш контента в имя: main.33987d760438934d.js. Такие файлы
+ * никогда не меняются под тем же именем, и их можно кешировать навсегда */
+static bool has_content_hash(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    const char *dot = strchr(name, '.');
+    while (dot) {
+        const char *next = strchr(dot + 1, '.');
+        if (!next) break;
+        size_t len = next - dot - 1;
+        if (len >= 16) {
+            bool hex = true;
+            for (const char *c = dot + 1; c < next && hex; c++) hex = isxdigit((unsigned char)*c);
+            if (hex) return true;
+        }
+        dot = next;
+    }
+    return false;
+}
+
+static const char *cache_control(const asset_t *asset) {
+    return has_content_hash(asset->path) ? "public, max-age=31536000, immutable" : "no-cache";
+}
+
+/* Ответ зависит от Accept-Encoding: есть .gz или файл сжимается на лету */
+static bool varies(const asset_t *asset) {
+    return asset->variants[ASSET_ENC_GZIP].present ||
+           gzip_stream_eligible(asset->mime, asset->variants[ASSET_ENC_IDENTITY].size);
+}
+
+/* Собираем блок заголовков варианта в арене */
+static bool render_header(asset_t *asset, asset_variant_t *v, bool gzip) {
+    // Распакованное тело не совпадает побайтно с файлом, от которого взят ETag: он слабый
+    bool weak = v == &asset->inflated;
+    char *dst = s_header_arena + s_header_used;
+    size_t room = sizeof(s_header_arena) - s_header_used;
+    int n = snprintf(dst, room,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "ETag: %s%s\r\n"
+                     "Cache-Control: %s\r\n"
+                     "%s%s",
+                     asset->mime, weak ? "W/" : "", asset->etag, cache_control(asset),
+                     gzip ? "Content-Encoding: gzip\r\n" : "",
+                     varies(asset) ? "Vary: Accept-Encoding\r\n" : "");
+    if (n < 0 || (size_t)n >= room) {
+        ESP_LOGW(TAG, "Header arena exhausted");
+        return false;
+    }
+    v->header = dst;
+    v->header_len = n;
+    s_header_used += n;
+    return true;
+}
+
+int asset_render_stream_header(const asset_t *asset, char *buf, size_t buflen) {
+    // Сжатое на лету тело не совпадает побайтно с несжатым: ETag слабый
+    int n = snprintf(buf, buflen,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Encoding: gzip\r\n"
+                     "ETag: W/%s\r\n"
+                     "Cache-Control: %s\r\n"
+                     "Vary: Accept-Encoding\r\n",
+                     asset->mime, asset->etag, cache_control(asset));
+    return n < 0 || (size_t)n >= buflen ? -1 : n;
+}
+
+void asset_variant_path(const asset_t *asset, asset_encoding_t enc, char *buf, size_t buflen) {
+    snprintf(buf, buflen, "%s%s", asset->path, enc == ASSET_ENC_GZIP ? ".gz" : "");
+}
+
+asset_encoding_t asset_pick_encoding(const asset_t *asset, bool accepts_gzip) {
+    if (accepts_gzip && asset->variants[ASSET_ENC_GZIP].present) return ASSET_ENC_GZIP;
+    if (asset->variants[ASSET_ENC_IDENTITY].present) return ASSET_ENC_IDENTITY;
+    return ASSET_ENC_GZIP;
+}
+
+/* FNV-1a по полному пути */
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    while (*path) {
+        h ^= (uint8_t)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Ищем слот с путем `path` или первый пустой слот на его цепочке */
+static int find_slot(const char *path) {
+    uint32_t mask = ASSET_INDEX_SLOTS - 1;
+    uint32_t slot = path_hash(path) & mask;
+    for (int probe = 0; probe < ASSET_INDEX_SLOTS; probe++) {
+        int16_t i = s_slots[slot];
+        if (i < 0 || strcmp(s_assets[i].path, path) == 0) return slot;
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+/* Запись без вариантов осталась от удаленного файла. -1, если таких нет */
+static int empty_record(void) {
+    for (int i = 0; i < s_asset_count; i++) {
+        const asset_t *a = &s_assets[i];
+        if (!a->variants[ASSET_ENC_IDENTITY].present && !a->variants[ASSET_ENC_GZIP].present) return i;
+    }
+    return -1;
+}
+
+/* Заново раскладываем записи по слотам: из открытой адресации старый путь просто так не убрать */
+static void rehash(void) {
+    memset(s_slots, 0xff, sizeof(s_slots));
+    for (int i = 0; i < s_asset_count; i++) {
+        int slot = find_slot(s_assets[i].path);
+        if (slot >= 0) s_slots[slot] = i;
+    }
+}
+
+/* Добавляем вариант файла в индекс, создавая запись при первом варианте */
+static asset_t *index_add(const char *path, size_t base_len, asset_encoding_t enc, const struct stat *st) {
+    int slot = find_slot(path);
+    if (slot < 0) return NULL;
+    asset_t *asset;
+    if (s_slots[slot] >= 0) {
+        asset = &s_assets[s_slots[slot]];
+    } else {
+        // Индекс полон: занимаем запись удаленного файла. Номера остальных записей не меняются
+        bool reuse = s_asset_count >= ASSET_MAX;
+        int i = reuse ? empty_record() : s_asset_count++;
+        if (i < 0) return NULL;
+        asset = &s_assets[i];
+        memset(asset, 0, sizeof(*asset));
+        strcpy(asset->path, path);
+        asset->name = asset->path + base_len + 1;
+        asset->mime = mime_lookup(path);
+        if (reuse) {
+            rehash();
+        } else {
+            s_slots[slot] = i;
+        }
+    }
+    asset->variants[enc].present = true;
+    asset->variants[enc].size = st->st_size;
+    // ETag берем от несжатого варианта, если он есть
+    if (enc == ASSET_ENC_IDENTITY || !asset->variants[ASSET_ENC_IDENTITY].present) {
+        snprintf(asset->etag, sizeof(asset->etag), "\"%x-%lx\"",
+                 (unsigned)st->st_size, (unsigned long)st->st_mtime);
+    }
+    return asset;
+}
+
+/* Размер распакованного .gz из его хвоста (ISIZE, RFC 1952). 0, если прочитать не удалось */
+static size_t gzip_inflated_size(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    uint8_t isize[4];
+    size_t size = 0;
+    if (lseek(fd, -4, SEEK_END) >= 0 && read(fd, isize, sizeof(isize)) == sizeof(isize)) {
+        size = isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((uint32_t)isize[3] << 24);
+    }
+    close(fd);
+    return size;
+}
+
+/* Только .gz: несжатый ответ распаковывается при отправке, его размер - из хвоста .gz */
+static void load_inflated(asset_t *asset) {
+    asset->inflated.present = false;
+    if (!asset->variants[ASSET_ENC_GZIP].present || asset->variants[ASSET_ENC_IDENTITY].present) return;
+    char path[ASSET_PATH_MAX + 4];
+    asset_variant_path(asset, ASSET_ENC_GZIP, path, sizeof(path));
+    asset->inflated.size = gzip_inflated_size(path);
+    asset->inflated.present = asset->inflated.size > 0;
+}
+
+/* Заголовки всех вариантов файла. false - кончилась арена */
+static bool render_asset(asset_t *asset) {
+    for (int enc = 0; enc < ASSET_ENC_COUNT; enc++) {
+        if (asset->variants[enc].present && !render_header(asset, &asset->variants[enc], enc == ASSET_ENC_GZIP)) {
+            return false;
+        }
+    }
+    return !asset->inflated.present || render_header(asset, &asset->inflated, false);
+}
+
+/* Файл без заголовков отдавать нечем: убираем его из выдачи */
+static void drop_asset(asset_t *asset) {
+    ESP_LOGW(TAG, "No room for headers, not served: %s", asset->path);
+    for (int enc = 0; enc < ASSET_ENC_COUNT; enc++) asset->variants[enc].present = false;
+    asset->inflated.present = false;
+}
+
+/* Собираем заголовки всех файлов заново с начала арены */
+static void render_all(void) {
+    s_header_used = 0;
+    for (int i = 0; i < s_asset_count; i++) {
+        if (!render_asset(&s_assets[i])) drop_asset(&s_assets[i]);
+    }
+}
+
+esp_err_t asset_index_build(const char *base_path) {
+    memset(s_slots, 0xff, sizeof(s_slots));
+    s_asset_count = 0;
+    s_base_len = strlen(base_path);
+
+    DIR *dir = opendir(base_path);
+    if (!dir) {
+        ESP_LOGE(TAG, "Unable to open %s", base_path);
+        return ESP_FAIL;
+    }
+
+    // SPIFFS плоская: readdir отдает имена вида "assets/img/logo.svg" без подкаталогов
+    char path[ASSET_PATH_MAX + 4];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Скрытые файлы - служебные, например недописанная загрузка
+        if (entry->d_name[0] == '.') continue;
+        int n = snprintf(path, sizeof(path), "%s/%s", base_path, entry->d_name);
+        if (n < 0 || (size_t)n >= sizeof(path)) {
+            ESP_LOGW(TAG, "Path too long, skipped: %s", entry->d_name);
+            continue;
+        }
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+
+        asset_encoding_t enc = ASSET_ENC_IDENTITY;
+        if (n > 3 && strcmp(path + n - 3, ".gz") == 0) {
+            enc = ASSET_ENC_GZIP;
+            path[n - 3] = 0;
+        }
+        if (strlen(path) >= ASSET_PATH_MAX || !index_add(path, s_base_len, enc, &st)) {
+            ESP_LOGW(TAG, "Asset index full, skipped: %s", path);
+        }
+    }
+    closedir(dir);
+
+    for (int i = 0; i < s_asset_count; i++) load_inflated(&s_assets[i]);
+    render_all();
+
+    ESP_LOGI(TAG, "Asset index built: %d assets, %u bytes of headers", s_asset_count, (unsigned)s_header_used);
+    return ESP_OK;
+}
+
+void asset_read_begin(void) {
+    while (1) {
+        portENTER_CRITICAL(&s_rw_mux);
+        bool ok = !s_updating;
+        if (ok) s_readers++;
+        portEXIT_CRITICAL(&s_rw_mux);
+        if (ok) return;
+        vTaskDelay(1);
+    }
+}
+
+void asset_read_end(void) {
+    portENTER_CRITICAL(&s_rw_mux);
+    s_readers--;
+    portEXIT_CRITICAL(&s_rw_mux);
+}
+
+esp_err_t asset_update_begin(int timeout_ms) {
+    int64_t deadline = esp_timer_get_time() + timeout_ms * 1000LL;
+    // Сначала занимаем обновление: с этого момента новые читатели ждут, и идущие не копятся
+    while (1) {
+        portENTER_CRITICAL(&s_rw_mux);
+        bool mine = !s_updating;
+        if (mine) s_updating = true;
+        portEXIT_CRITICAL(&s_rw_mux);
+        if (mine) break;
+        if (esp_timer_get_time() >= deadline) return ESP_ERR_TIMEOUT;
+        vTaskDelay(1);
+    }
+    while (1) {
+        portENTER_CRITICAL(&s_rw_mux);
+        int readers = s_readers;
+        portEXIT_CRITICAL(&s_rw_mux);
+        if (readers == 0) return ESP_OK;
+        if (esp_timer_get_time() >= deadline) {
+            asset_update_end();
+            return ESP_ERR_TIMEOUT;
+        }
+        vTaskDelay(1);
+    }
+}
+
+void asset_update_end(void) {
+    portENTER_CRITICAL(&s_rw_mux);
+    s_updating = false;
+    portEXIT_CRITICAL(&s_rw_mux);
+}
+
+esp_err_t asset_update(const char *fullpath) {
+    char path[ASSET_PATH_MAX + 4];
+    size_t len = strlen(fullpath);
+    if (len > 3 && strcmp(fullpath + len - 3, ".gz") == 0) len -= 3;
+    if (len >= ASSET_PATH_MAX) return ESP_ERR_INVALID_ARG;
+    memcpy(path, fullpath, len);
+    path[len] = 0;
+
+    // Варианты перечитываем с нуля: какой-то из них мог исчезнуть
+    int slot = find_slot(path);
+    if (slot >= 0 && s_slots[slot] >= 0) {
+        asset_t *asset = &s_assets[s_slots[slot]];
+        memset(asset->variants, 0, sizeof(asset->variants));
+        memset(&asset->inflated, 0, sizeof(asset->inflated));
+        asset->hashed = 0;
+    }
+    asset_t *asset = NULL;
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        asset = index_add(path, s_base_len, ASSET_ENC_IDENTITY, &st);
+        if (!asset) return ESP_ERR_NO_MEM;
+    }
+    char gz_path[ASSET_PATH_MAX + 4];
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+    if (stat(gz_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        asset = index_add(path, s_base_len, ASSET_ENC_GZIP, &st);
+        if (!asset) return ESP_ERR_NO_MEM;
+    }
+    // Ни одного варианта не осталось: запись остается пустой, asset_lookup ее не найдет
+    if (!asset) return ESP_OK;
+
+    load_inflated(asset);
+    // Старые заголовки файла в арене больше не нужны. Мы между asset_update_begin и asset_update_end:
+    // ответы копируют заголовки под чтением индекса, значит, сейчас арену никто не читает,
+    // и когда место кончается, всю арену можно собрать заново
+    if (!render_asset(asset)) render_all();
+    return asset_lookup(path) ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t asset_variant_sha256(const asset_t *asset, asset_encoding_t enc, uint8_t out[32]) {
+    asset_t *a = &s_assets[asset - s_assets];
+    uint8_t bit = 1 << enc;
+    // Два читателя могут посчитать один хеш одновременно: результат у них одинаковый
+    portENTER_CRITICAL(&s_rw_mux);
+    bool hashed = a->hashed & bit;
+    if (hashed) memcpy(out, a->sha256[enc], 32);
+    portEXIT_CRITICAL(&s_rw_mux);
+    if (hashed) return ESP_OK;
+
+    char path[ASSET_PATH_MAX + 4];
+    asset_variant_path(asset, enc, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return ESP_ERR_NOT_FOUND;
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    uint8_t buf[512];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) > 0) mbedtls_sha256_update(&sha, buf, r);
+    close(fd);
+    mbedtls_sha256_finish(&sha, out);
+    mbedtls_sha256_free(&sha);
+    if (r < 0) return ESP_FAIL;
+
+    portENTER_CRITICAL(&s_rw_mux);
+    memcpy(a->sha256[enc], out, 32);
+    a->hashed |= bit;
+    portEXIT_CRITICAL(&s_rw_mux);
+    return ESP_OK;
+}
+
+int asset_count(void) {
+    return s_asset_count;
+}
+
+const asset_t *asset_at(int i) {
+    return (i >= 0 && i < s_asset_count) ? &s_assets[i] : NULL;
+}
+
+const asset_t *asset_lookup(const char *fullpath) {
+    int slot = find_slot(fullpath);
+    if (slot < 0 || s_slots[slot] < 0) return NULL;
+    const asset_t *asset = &s_assets[s_slots[slot]];
+    if (!asset->variants[ASSET_ENC_IDENTITY].present && !asset->variants[ASSET_ENC_GZIP].present) return NULL;
+    return asset;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/* Сколько файлов помещается в индекс, слоты хеш-таблицы (степень двойки)
+ * и место под заголовки всех файлов */
+#define ASSET_MAX 64
+#define ASSET_INDEX_SLOTS 128
+#define ASSET_PATH_MAX 64
+#define ASSET_HEADER_ARENA 12288
+
+/* Варианты кодировки, в которых файл лежит в ФС */
+typedef enum {
+    ASSET_ENC_IDENTITY = 0,
+    ASSET_ENC_GZIP,
+    ASSET_ENC_COUNT
+} asset_encoding_t;
+
+/* Один вариант файла: путь, размер и заранее собранный блок заголовков.
+ * Блок начинается со статусной строки и заканчивается последним заголовком с CRLF.
+ * Длину тела, Connection и пустую строку дописывает http_writer при отправке */
+typedef struct {
+    bool present;
+    size_t size;
+    const char *header;
+    uint16_t header_len;
+} asset_variant_t;
+
+typedef struct {
+    char path[ASSET_PATH_MAX];  // полный путь в ФС без суффикса .gz
+    const char *name;           // тот же путь от корня ФС, например "assets/img/logo.svg"
+    const char *mime;
+    char etag[24];
+    asset_variant_t variants[ASSET_ENC_COUNT];
+    // Есть только .gz: несжатый ответ распаковывается при отправке. Размер - из хвоста .gz
+    asset_variant_t inflated;
+    // SHA-256 вариантов для манифеста, посчитанные при первом запросе. Бит на вариант
+    uint8_t sha256[ASSET_ENC_COUNT][32];
+    uint8_t hashed;
+} asset_t;
+
+/* Обходим ФС один раз и строим индекс путь -> {размер, mime, etag, варианты}
+ * вместе с заготовками заголовков. Вызывать до старта сервера */
+esp_err_t asset_index_build(const char *base_path);
+
+/* Находим файл по полному пути одной пробой хеш-таблицы, без обращения к flash.
+ * NULL, если файла нет ни в одном варианте. Запись читается между asset_read_begin и asset_read_end */
+const asset_t *asset_lookup(const char *fullpath);
+
+/* Читатель индекса: пока он не вызвал asset_read_end, записи не меняются.
+ * Если идет обновление, ждем его конца */
+void asset_read_begin(void);
+void asset_read_end(void);
+
+/* Обновление индекса после изменения ФС. Ждем до `timeout_ms`, пока уйдут читатели,
+ * новые читатели в это время ждут нас. ESP_ERR_TIMEOUT - не дождались */
+esp_err_t asset_update_begin(int timeout_ms);
+void asset_update_end(void);
+
+/* Перечитываем с ФС оба варианта файла `fullpath` (с .gz или без) и пересобираем его заголовки.
+ * Только между asset_update_begin и asset_update_end. ESP_ERR_NO_MEM - не влез в индекс */
+esp_err_t asset_update(const char *fullpath);
+
+/* Перебор индекса: число файлов и файл по порядковому номеру */
+int asset_count(void);
+const asset_t *asset_at(int i);
+
+/* Блок заголовков для несжатого варианта, который сжимается на лету (gzip, тело чанками).
+ * Собирается в `buf` при отправке, в том же формате, что и заготовки. -1, если не влез */
+int asset_render_stream_header(const asset_t *asset, char *buf, size_t buflen);
+
+/* Путь к варианту в ФС (для gzip добавляется .gz) */
+void asset_variant_path(const asset_t *asset, asset_encoding_t enc, char *buf, size_t buflen);
+
+/* SHA-256 содержимого варианта. Файл читается один раз, дальше хеш берется из индекса,
+ * пока файл не изменится. Между asset_read_begin и asset_read_end */
+esp_err_t asset_variant_sha256(const asset_t *asset, asset_encoding_t enc, uint8_t out[32]);
+
+/* Выбираем вариант под клиента: gzip, если он его принимает и вариант есть */
+asset_encoding_t asset_pick_encoding(const asset_t *asset, bool accepts_gzip);
@@ -0,0 +1,79 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+#include "boot.h"
+#include "strbuf.h"
+
+static const char *TAG = "boot";
+
+static const char *const s_phase_names[BOOT_PHASE_COUNT] = {
+    "wifi", "tasks", "listen", "fs", "index", "warm", "first_byte", "firmware",
+};
+
+static EventGroupHandle_t s_events;
+// Для этапов, которые выполняются задачей boot_stage_start, известно и время начала
+static int64_t s_started_us[BOOT_PHASE_COUNT];
+static int64_t s_done_us[BOOT_PHASE_COUNT];
+static bool s_failed[BOOT_PHASE_COUNT];
+
+void boot_init(void) {
+    s_events = xEventGroupCreate();
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) s_started_us[i] = -1;
+}
+
+static void stage_task(void *pv) {
+    const boot_stage_t *stage = (const boot_stage_t *)pv;
+    if (stage->deps) {
+        xEventGroupWaitBits(s_events, stage->deps, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    s_started_us[stage->phase] = esp_timer_get_time();
+    esp_err_t err = stage->run();
+    if (err == ESP_OK) {
+        boot_mark(stage->phase);
+    } else {
+        // Зависимые этапы так и не стартуют, в диагностике это видно по failed
+        s_failed[stage->phase] = true;
+        ESP_LOGE(TAG, "Stage %s failed (%s)", stage->name, esp_err_to_name(err));
+    }
+    vTaskDelete(NULL);
+}
+
+void boot_stage_start(const boot_stage_t *stage) {
+    xTaskCreate(stage_task, stage->name, stage->stack, (void *)stage, stage->priority, NULL);
+}
+
+void boot_mark(boot_phase_t phase) {
+    EventBits_t bit = (EventBits_t)1 << phase;
+    if (xEventGroupGetBits(s_events) & bit) return;
+    s_done_us[phase] = esp_timer_get_time();
+    xEventGroupSetBits(s_events, bit);
+}
+
+bool boot_done(boot_phase_t phase) {
+    return xEventGroupGetBits(s_events) & ((EventBits_t)1 << phase);
+}
+
+bool boot_wait(boot_phase_t phase, uint32_t timeout_ms) {
+    EventBits_t bit = (EventBits_t)1 << phase;
+    TickType_t ticks = timeout_ms == BOOT_WAIT_FOREVER ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+    return xEventGroupWaitBits(s_events, bit, pdFALSE, pdTRUE, ticks) & bit;
+}
+
+void boot_append_json(char *buf, size_t buflen, size_t *pos) {
+    strbuf_appendf(buf, buflen, pos, "{");
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        strbuf_appendf(buf, buflen, pos, "%s\"%s\":{", i ? "," : "", s_phase_names[i]);
+        if (s_started_us[i] >= 0) {
+            strbuf_appendf(buf, buflen, pos, "\"start_ms\":%lld,", (long long)(s_started_us[i] / 1000));
+        }
+        if (boot_done((boot_phase_t)i)) {
+            strbuf_appendf(buf, buflen, pos, "\"done_ms\":%lld}", (long long)(s_done_us[i] / 1000));
+        } else {
+            strbuf_appendf(buf, buflen, pos, "\"done_ms\":null,\"failed\":%s}", s_failed[i] ? "true" : "false");
+        }
+    }
+    strbuf_appendf(buf, buflen, pos, "}");
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/* Этапы старта. Каждый отмечается один раз, время считается от включения */
+typedef enum {
+    BOOT_PHASE_WIFI = 0,    // получен IP
+    BOOT_PHASE_TASKS,       // запущены воркеры и задачи сервера
+    BOOT_PHASE_LISTEN,      // сервер слушает порт
+    BOOT_PHASE_FS,          // SPIFFS смонтирована
+    BOOT_PHASE_INDEX,       // индекс файлов построен, можно отдавать из ФС
+    BOOT_PHASE_WARM,        // кеш прогрет
+    BOOT_PHASE_FIRST_BYTE,  // первый байт ответа ушел клиенту
+    BOOT_PHASE_FIRMWARE,    // прошивка подтвердила себя после обновления
+    BOOT_PHASE_COUNT
+} boot_phase_t;
+
+#define BOOT_DEP(phase) (1u << (phase))
+
+/* Этап старта, выполняемый в своей задаче */
+typedef struct {
+    const char *name;
+    boot_phase_t phase;     // что отметить после успешного выполнения
+    uint32_t deps;          // маска BOOT_DEP(...) этапов, которые нужно дождаться
+    esp_err_t (*run)(void);
+    uint32_t stack;
+    unsigned priority;
+} boot_stage_t;
+
+void boot_init(void);
+
+/* Запускаем этап в отдельной задаче: она дождется зависимостей, выполнит `run`
+ * и отметит этап. `stage` должен жить всё время работы */
+void boot_stage_start(const boot_stage_t *stage);
+
+/* Отмечаем завершение этапа и будим тех, кто его ждет */
+void boot_mark(boot_phase_t phase);
+
+bool boot_done(boot_phase_t phase);
+
+#define BOOT_WAIT_FOREVER UINT32_MAX
+
+/* Ждем завершения этапа. false, если не дождались за `timeout_ms` */
+bool boot_wait(boot_phase_t phase, uint32_t timeout_ms);
+
+/* JSON-объект со временем начала и завершения этапов в мс */
+void boot_append_json(char *buf, size_t buflen, size_t *pos);
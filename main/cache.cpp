@@ -0,0 +1,283 @@
+#include <string.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include "cache.h"
+#include "file_pool.h"
+
+static const char *TAG = "cache";
+
+#ifdef CONFIG_SPIRAM
+#define CACHE_CAPS MALLOC_CAP_SPIRAM
+#else
+#define CACHE_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+typedef enum {
+    ENTRY_FREE = 0,
+    ENTRY_LOADING,
+    ENTRY_READY,
+    ENTRY_FAILED,
+    ENTRY_RETIRED,  // файла больше нет, но буфер еще держат соединения, отдавшие его без копии
+} entry_state_t;
+
+struct cache_entry {
+    char path[CACHE_PATH_MAX];
+    uint8_t *data;
+    size_t size;
+    volatile size_t filled;
+    volatile entry_state_t state;
+    uint32_t refs;
+    uint32_t lenders;   // соединений, которые отдали буфер стеку без копии (cache_lend)
+    bool stale;         // файл на flash изменился: новым запросам запись не выдается
+    bool pinned;
+    TickType_t last_used;
+};
+
+static cache_entry_t s_entries[CACHE_SLOTS];
+static SemaphoreHandle_t s_lock;
+// Бит на каждый слот: загрузчик выставляет его, когда в буфере прибавились данные
+static EventGroupHandle_t s_progress;
+static cache_stats_t s_stats;
+
+/* Порция чтения при прогреве: вне запроса не нужно подстраиваться под отправку */
+#define CACHE_PRELOAD_CHUNK ((size_t)4096)
+
+static_assert(CACHE_SLOTS <= 24, "one event group bit per cache slot");
+
+static EventBits_t slot_bit(cache_entry_t *entry) {
+    return (EventBits_t)1 << (entry - s_entries);
+}
+
+void cache_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    s_progress = xEventGroupCreate();
+}
+
+static void free_data(cache_entry_t *entry) {
+    heap_caps_free(entry->data);
+    entry->data = NULL;
+    entry->state = ENTRY_FREE;
+}
+
+static void free_entry(cache_entry_t *entry) {
+    s_stats.used -= entry->size;
+    if (entry->pinned) s_stats.pinned -= entry->size;
+    entry->pinned = false;
+    entry->path[0] = 0;
+    if (entry->lenders) {
+        // Стек еще ссылается на буфер: слот занят, пока его не вернут все соединения
+        entry->state = ENTRY_RETIRED;
+        s_stats.retired += entry->size;
+        return;
+    }
+    free_data(entry);
+}
+
+/* Освобождаем место под `size` байт, выбрасывая давно не использованные записи. Под s_lock */
+static bool make_room(size_t size) {
+    TickType_t now = xTaskGetTickCount();
+    while (s_stats.used + size > CACHE_BUDGET) {
+        cache_entry_t *victim = NULL;
+        for (int i = 0; i < CACHE_SLOTS; i++) {
+            cache_entry_t *e = &s_entries[i];
+            if (e->state != ENTRY_READY || e->refs || e->pinned) continue;
+            if (!victim || now - e->last_used > now - victim->last_used) victim = e;
+        }
+        if (!victim) return false;
+        free_entry(victim);
+        s_stats.evictions++;
+    }
+    return true;
+}
+
+cache_entry_t *cache_acquire(const char *path, size_t size, bool *loader) {
+    *loader = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (size == 0 || size > CACHE_ENTRY_MAX || strlen(path) >= CACHE_PATH_MAX) {
+        s_stats.bypass++;
+        xSemaphoreGive(s_lock);
+        return NULL;
+    }
+
+    cache_entry_t *free_slot = NULL;
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        cache_entry_t *e = &s_entries[i];
+        if (e->state == ENTRY_FREE) {
+            if (!free_slot) free_slot = e;
+            continue;
+        }
+        if (strcmp(e->path, path) != 0 || e->stale || e->state == ENTRY_FAILED || e->state == ENTRY_RETIRED) {
+            continue;
+        }
+        e->refs++;
+        e->last_used = xTaskGetTickCount();
+        if (e->state == ENTRY_READY) {
+            s_stats.hits++;
+        } else {
+            // Файл уже читает другой запрос: подключаемся к нему вместо второго чтения
+            s_stats.coalesced++;
+            s_stats.coalesced_bytes += e->size;
+        }
+        xSemaphoreGive(s_lock);
+        return e;
+    }
+
+    if (!free_slot || !make_room(size)) {
+        s_stats.bypass++;
+        xSemaphoreGive(s_lock);
+        return NULL;
+    }
+    uint8_t *data = (uint8_t *)heap_caps_malloc(size, CACHE_CAPS);
+    if (!data) {
+        ESP_LOGW(TAG, "No memory for %s (%u bytes)", path, (unsigned)size);
+        s_stats.bypass++;
+        xSemaphoreGive(s_lock);
+        return NULL;
+    }
+
+    cache_entry_t *e = free_slot;
+    strcpy(e->path, path);
+    e->data = data;
+    e->size = size;
+    e->filled = 0;
+    e->state = ENTRY_LOADING;
+    e->refs = 1;
+    e->lenders = 0;
+    e->stale = false;
+    e->pinned = false;
+    e->last_used = xTaskGetTickCount();
+    s_stats.used += size;
+    s_stats.loads++;
+    xEventGroupClearBits(s_progress, slot_bit(e));
+    xSemaphoreGive(s_lock);
+
+    *loader = true;
+    return e;
+}
+
+uint8_t *cache_data(cache_entry_t *entry) {
+    return entry->data;
+}
+
+void cache_commit(cache_entry_t *entry, size_t len) {
+    entry->filled += len;
+    if (entry->filled >= entry->size && entry->state == ENTRY_LOADING) entry->state = ENTRY_READY;
+    xEventGroupSetBits(s_progress, slot_bit(entry));
+    // Бит снимаем сразу: кто успел проснуться, уже увидит новое значение filled,
+    // а опоздавшие подождут следующую порцию или таймаут ожидания
+    xEventGroupClearBits(s_progress, slot_bit(entry));
+}
+
+void cache_abort(cache_entry_t *entry) {
+    entry->state = ENTRY_FAILED;
+    xEventGroupSetBits(s_progress, slot_bit(entry));
+}
+
+ssize_t cache_wait(cache_entry_t *entry, size_t offset) {
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        size_t filled = entry->filled;
+        if (filled > offset) return filled;
+        if (entry->state == ENTRY_FAILED) return -1;
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(CACHE_WAIT_MS)) return -1;
+        // Короткий таймаут страхует от пропущенного сигнала между проверкой и ожиданием
+        xEventGroupWaitBits(s_progress, slot_bit(entry), pdFALSE, pdFALSE, pdMS_TO_TICKS(10));
+    }
+}
+
+void cache_release(cache_entry_t *entry) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    entry->last_used = xTaskGetTickCount();
+    if (--entry->refs == 0 && (entry->state == ENTRY_FAILED || entry->stale)) {
+        free_entry(entry);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+bool cache_is_pinned(cache_entry_t *entry) {
+    return entry->pinned;
+}
+
+void cache_lend(cache_entry_t *entry, uint32_t *lent) {
+    uint32_t bit = slot_bit(entry);
+    if (*lent & bit) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    entry->lenders++;
+    xSemaphoreGive(s_lock);
+    *lent |= bit;
+}
+
+void cache_return(uint32_t *lent) {
+    if (!*lent) return;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        cache_entry_t *e = &s_entries[i];
+        if (!(*lent & slot_bit(e))) continue;
+        if (--e->lenders == 0 && e->state == ENTRY_RETIRED) {
+            s_stats.retired -= e->size;
+            free_data(e);
+        }
+    }
+    xSemaphoreGive(s_lock);
+    *lent = 0;
+}
+
+esp_err_t cache_preload(const char *path, size_t size, bool pin) {
+    bool loader;
+    cache_entry_t *entry = cache_acquire(path, size, &loader);
+    if (!entry) return ESP_ERR_NO_MEM;
+
+    esp_err_t ret = ESP_OK;
+    if (loader) {
+        esp_err_t err;
+        file_handle_t *f = file_pool_acquire(path, &err);
+        size_t offset = 0;
+        while (f && offset < size) {
+            ssize_t r = file_pool_pread(f, entry->data + offset, MIN(CACHE_PRELOAD_CHUNK, size - offset), offset);
+            if (r <= 0) break;
+            cache_commit(entry, r);
+            offset += r;
+        }
+        if (f) file_pool_release(f);
+        if (offset < size) {
+            cache_abort(entry);
+            ret = f ? ESP_FAIL : err;
+        }
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (ret == ESP_OK && pin && !entry->pinned &&
+        s_stats.pinned + s_stats.retired + entry->size <= CACHE_PIN_BUDGET) {
+        entry->pinned = true;
+        s_stats.pinned += entry->size;
+    }
+    xSemaphoreGive(s_lock);
+    cache_release(entry);
+    return ret;
+}
+
+void cache_invalidate(const char *path) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        cache_entry_t *e = &s_entries[i];
+        if (e->state == ENTRY_FREE || e->state == ENTRY_RETIRED || (path && strcmp(e->path, path) != 0)) continue;
+        // Новые запросы запись уже не найдут, а идущие дочитают старое тело: загрузчик держит
+        // дескриптор старого файла и дописывает запись до конца
+        e->stale = true;
+        if (e->refs == 0) free_entry(e);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void cache_get_stats(cache_stats_t *stats) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
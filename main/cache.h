@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "sdkconfig.h"
+#include "esp_err.h"
+
+/* RAM-кеш тел файлов. С PSRAM можно держать весь бандл, без нее только мелочь */
+#ifdef CONFIG_SPIRAM
+#define CACHE_BUDGET (1024 * 1024)
+#define CACHE_ENTRY_MAX (512 * 1024)
+#else
+#define CACHE_BUDGET (64 * 1024)
+#define CACHE_ENTRY_MAX (40 * 1024)
+#endif
+/* Сколько из бюджета можно закрепить за файлами, которые никогда не вытесняются */
+#define CACHE_PIN_BUDGET (CACHE_BUDGET / 2)
+#define CACHE_SLOTS 16
+#define CACHE_PATH_MAX 72
+/* Сколько ждем очередную порцию от загрузчика, прежде чем сдаться */
+#define CACHE_WAIT_MS 5000
+
+typedef struct cache_entry cache_entry_t;
+
+typedef struct {
+    uint32_t hits;            // файл уже целиком в кеше
+    uint32_t loads;           // запрос сам читал файл с flash в кеш
+    uint32_t coalesced;       // запрос присоединился к загрузке, идущей в другом запросе
+    uint32_t coalesced_bytes; // байт, которые благодаря этому не читались с flash повторно
+    uint32_t bypass;          // не влез в кеш, читали мимо него
+    uint32_t evictions;
+    uint32_t used;            // байт занято сейчас
+    uint32_t pinned;          // из них закреплено
+    uint32_t retired;         // тела замененных файлов, которые еще держат соединения netconn
+} cache_stats_t;
+
+void cache_init(void);
+
+/* Берем запись кеша для файла `path` размером `size`.
+ * Если файла в кеше нет, создаем запись, и вызывающий становится загрузчиком
+ * (`*loader` = true): он читает файл и сообщает о прогрессе через cache_commit.
+ * Параллельные запросы того же файла получают ту же запись и читают из нее по мере загрузки.
+ * NULL: файл не помещается в кеш, читать нужно напрямую */
+cache_entry_t *cache_acquire(const char *path, size_t size, bool *loader);
+
+/* Буфер записи. Загрузчик пишет в него, остальные читают до cache_wait */
+uint8_t *cache_data(cache_entry_t *entry);
+
+/* Загрузчик: еще `len` байт записаны в буфер */
+void cache_commit(cache_entry_t *entry, size_t len);
+
+/* Загрузчик: чтение сорвалось, запись выбрасывается */
+void cache_abort(cache_entry_t *entry);
+
+/* Ждем, пока загружено больше `offset` байт. Возвращает, сколько байт доступно,
+ * или -1, если загрузка сорвалась или не дождались */
+ssize_t cache_wait(cache_entry_t *entry, size_t offset);
+
+void cache_release(cache_entry_t *entry);
+
+/* Запись закреплена: не вытесняется, и ее буфер можно отдавать стеку без копии через cache_lend */
+bool cache_is_pinned(cache_entry_t *entry);
+
+/* Соединение отдает буфер закрепленной записи стеку без копии. Стек держит такие сегменты
+ * до подтверждения, поэтому буфер не освобождается, пока соединение не вызовет cache_return.
+ * `*lent` - маска записей, которые соединение уже взяло, изначально 0 */
+void cache_lend(cache_entry_t *entry, uint32_t *lent);
+
+/* Соединение закрыто через RST (его сегменты освобождены вместе с PCB): возвращаем все
+ * записи из `*lent`. Буферы удаленных за это время файлов освобождаются */
+void cache_return(uint32_t *lent);
+
+/* Загружаем файл в кеш целиком вне запроса. `pin`: закрепить запись, если позволяет
+ * CACHE_PIN_BUDGET. ESP_ERR_NO_MEM, если файл не помещается в кеш */
+esp_err_t cache_preload(const char *path, size_t size, bool pin);
+
+/* Файл `path` на flash изменился: запись больше не выдается. Буфер освобождается, когда
+ * ее отпустят читатели и вернут соединения, отдавшие его без копии (до этого байты считаются
+ * в `retired` и в CACHE_PIN_BUDGET). NULL - весь кеш */
+void cache_invalidate(const char *path);
+
+void cache_get_stats(cache_stats_t *stats);
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "diag.h"
+#include "strbuf.h"
+#include "file_pool.h"
+#include "cache.h"
+#include "warmup.h"
+#include "boot.h"
+#include "wifi.h"
+#include "wifi_ps.h"
+#include "http_server.h"
+#include "transport.h"
+#include "mem_pool.h"
+#include "gzip_stream.h"
+#include "inflate_stream.h"
+#include "upload.h"
+#include "asset_image.h"
+#include "firmware.h"
+#include "websocket.h"
+#include "http_writer.h"
+
+static TaskHandle_t s_tasks[DIAG_MAX_TASKS];
+static int s_task_count = 0;
+
+void diag_register_task(TaskHandle_t task) {
+    if (!task || s_task_count >= DIAG_MAX_TASKS) return;
+    s_tasks[s_task_count++] = task;
+}
+
+/* Куча по каждой интересующей нас capability */
+static void append_heap(char *buf, size_t buflen, size_t *pos) {
+    static const struct { const char *name; uint32_t caps; } caps[] = {
+        { "internal", MALLOC_CAP_INTERNAL },
+        { "8bit",     MALLOC_CAP_8BIT },
+        { "dma",      MALLOC_CAP_DMA },
+        { "spiram",   MALLOC_CAP_SPIRAM },
+    };
+    strbuf_appendf(buf, buflen, pos, "\"heap\":{");
+    for (size_t i = 0; i < sizeof(caps) / sizeof(caps[0]); i++) {
+        strbuf_appendf(buf, buflen, pos, "%s\"%s\":{\"free\":%u,\"min_free\":%u,\"largest_block\":%u}",
+               i ? "," : "", caps[i].name,
+               (unsigned)heap_caps_get_free_size(caps[i].caps),
+               (unsigned)heap_caps_get_minimum_free_size(caps[i].caps),
+               (unsigned)heap_caps_get_largest_free_block(caps[i].caps));
+    }
+    strbuf_appendf(buf, buflen, pos, "}");
+}
+
+/* High-water mark стека зарегистрированных задач сервера (в байтах на ESP32) */
+static void append_server_tasks(char *buf, size_t buflen, size_t *pos) {
+    strbuf_appendf(buf, buflen, pos, "\"server_tasks\":[");
+    for (int i = 0; i < s_task_count; i++) {
+        strbuf_appendf(buf, buflen, pos, "%s{\"name\":\"%s\",\"stack_free_min\":%u}",
+               i ? "," : "", pcTaskGetName(s_tasks[i]),
+               (unsigned)uxTaskGetStackHighWaterMark(s_tasks[i]));
+    }
+    strbuf_appendf(buf, buflen, pos, "]");
+}
+
+/* Доли CPU по всем задачам. Это те же данные, что печатает vTaskGetRunTimeStats,
+ * но без его текстовой таблицы неизвестного размера */
+static void append_runtime_stats(char *buf, size_t buflen, size_t *pos) {
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+    UBaseType_t count = uxTaskGetNumberOfTasks();
+    TaskStatus_t *tasks = (TaskStatus_t *)malloc(count * sizeof(TaskStatus_t));
+    if (!tasks) {
+        strbuf_appendf(buf, buflen, pos, "\"tasks\":null");
+        return;
+    }
+    uint32_t total_runtime = 0;
+    count = uxTaskGetSystemState(tasks, count, &total_runtime);
+    // На двух ядрах сумма долей может доходить до 200%
+    uint32_t div = total_runtime / 100;
+    strbuf_appendf(buf, buflen, pos, "\"tasks\":[");
+    for (UBaseType_t i = 0; i < count; i++) {
+        strbuf_appendf(buf, buflen, pos,
+               "%s{\"name\":\"%s\",\"prio\":%u,\"stack_free_min\":%u,\"cpu_pct\":%u}",
+               i ? "," : "", tasks[i].pcTaskName,
+               (unsigned)tasks[i].uxCurrentPriority,
+               (unsigned)tasks[i].usStackHighWaterMark,
+               div ? (unsigned)(tasks[i].ulRunTimeCounter / div) : 0u);
+    }
+    strbuf_appendf(buf, buflen, pos, "]");
+    free(tasks);
+#else
+    // Для долей CPU нужны CONFIG_FREERTOS_USE_TRACE_FACILITY и
+    // CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS (см. sdkconfig.defaults)
+    strbuf_appendf(buf, buflen, pos, "\"tasks\":null");
+#endif
+}
+
+/* Пул общих дескрипторов файлов */
+static void append_file_pool(char *buf, size_t buflen, size_t *pos) {
+    file_pool_stats_t st;
+    file_pool_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+           "\"file_pool\":{\"size\":%d,\"in_use\":%u,\"hits\":%u,\"opens\":%u,"
+           "\"evictions\":%u,\"waits\":%u,\"timeouts\":%u}",
+           FILE_POOL_SIZE, (unsigned)st.in_use, (unsigned)st.hits, (unsigned)st.opens,
+           (unsigned)st.evictions, (unsigned)st.waits, (unsigned)st.timeouts);
+}
+
+/* RAM-кеш и дедупликация одновременных чтений */
+static void append_cache(char *buf, size_t buflen, size_t *pos) {
+    cache_stats_t st;
+    cache_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+           "\"cache\":{\"budget\":%u,\"used\":%u,\"hits\":%u,\"loads\":%u,\"coalesced\":%u,"
+           "\"coalesced_bytes\":%u,\"bypass\":%u,\"evictions\":%u,\"pinned\":%u,\"retired\":%u}",
+           (unsigned)CACHE_BUDGET, (unsigned)st.used, (unsigned)st.hits, (unsigned)st.loads,
+           (unsigned)st.coalesced, (unsigned)st.coalesced_bytes, (unsigned)st.bypass,
+           (unsigned)st.evictions, (unsigned)st.pinned, (unsigned)st.retired);
+}
+
+/* Прогрев кеша после старта */
+static void append_warmup(char *buf, size_t buflen, size_t *pos) {
+    warmup_status_t st;
+    warmup_get_status(&st);
+    strbuf_appendf(buf, buflen, pos,
+           "\"warmup\":{\"ready\":%s,\"assets\":%u,\"failed\":%u,\"bytes\":%u,"
+           "\"started_ms\":%lld,\"duration_ms\":%lld}",
+           st.ready ? "true" : "false", st.assets, st.failed, (unsigned)st.bytes,
+           (long long)(st.started_us / 1000),
+           st.ready ? (long long)((st.finished_us - st.started_us) / 1000) : -1LL);
+}
+
+/* Переподключения Wi-Fi */
+static void append_wifi(char *buf, size_t buflen, size_t *pos) {
+    wifi_stats_t st;
+    wifi_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"wifi\":{\"connected\":%s,\"connect_ms\":%u,\"reconnects\":%u,\"last_reconnect_ms\":%u,"
+                   "\"max_reconnect_ms\":%u,\"total_reconnect_ms\":%u,\"fast_connects\":%u}",
+                   wifi_conection_established ? "true" : "false", (unsigned)st.connect_ms,
+                   (unsigned)st.reconnects, (unsigned)st.last_reconnect_ms, (unsigned)st.max_reconnect_ms,
+                   (unsigned)st.total_reconnect_ms, (unsigned)st.fast_connects);
+
+    esp_ip6_addr_t ip6[4];
+    int n = wifi_get_ip6(ip6, 4);
+    strbuf_appendf(buf, buflen, pos, ",\"ipv6\":[");
+    for (int i = 0; i < n; i++) {
+        strbuf_appendf(buf, buflen, pos, "%s\"" IPV6STR "\"", i ? "," : "", IPV62STR(ip6[i]));
+    }
+    strbuf_appendf(buf, buflen, pos, "]");
+}
+
+/* Сжатие на лету: степень сжатия и скорость компрессора. Окупается, пока компрессор
+ * быстрее канала (kb_per_s у transport) */
+static void append_gzip(char *buf, size_t buflen, size_t *pos) {
+    gzip_stream_stats_t st;
+    gzip_stream_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"gzip_stream\":{\"streams\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,\"ratio_pct\":%u,"
+                   "\"deflate_ms\":%u,\"deflate_kb_per_s\":%u}",
+                   (unsigned)st.streams, (unsigned long long)st.bytes_in, (unsigned long long)st.bytes_out,
+                   st.bytes_in ? (unsigned)(st.bytes_out * 100 / st.bytes_in) : 0, (unsigned)(st.deflate_us / 1000),
+                   st.deflate_us ? (unsigned)(st.bytes_in * 1000000 / 1024 / st.deflate_us) : 0);
+}
+
+/* Распаковка .gz для клиентов без gzip */
+static void append_inflate(char *buf, size_t buflen, size_t *pos) {
+    inflate_stream_stats_t st;
+    inflate_stream_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"inflate\":{\"streams\":%u,\"errors\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,\"inflate_ms\":%u}",
+                   (unsigned)st.streams, (unsigned)st.errors, (unsigned long long)st.bytes_in,
+                   (unsigned long long)st.bytes_out, (unsigned)(st.inflate_us / 1000));
+}
+
+/* Запись ответов: сколько сегментов ушло из буфера и сколько записей мимо него */
+static void append_writer(char *buf, size_t buflen, size_t *pos) {
+    http_writer_stats_t st;
+    http_writer_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"writer\":{\"responses\":%u,\"chunked\":%u,\"until_close\":%u,\"segments\":%u,"
+                   "\"direct\":%u,\"rejected\":%u,\"body_bytes\":%llu}",
+                   (unsigned)st.responses, (unsigned)st.chunked, (unsigned)st.until_close, (unsigned)st.segments,
+                   (unsigned)st.direct, (unsigned)st.rejected, (unsigned long long)st.body_bytes);
+}
+
+/* Загрузки файлов: запись на flash и подмена файла в общем времени загрузки.
+ * Скорость по режимам сравнивает конвейер с последовательной записью */
+static void append_upload(char *buf, size_t buflen, size_t *pos) {
+    upload_stats_t st;
+    upload_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"upload\":{\"files\":%u,\"failed\":%u,\"rejected\":%u,\"deleted\":%u,\"bytes\":%llu,\"ms\":%u,"
+                   "\"write_ms\":%u,\"commit_ms\":%u,\"last_size\":%u,\"last_kb_per_s\":%u,"
+                   "\"stalls\":%u,\"stall_ms\":%u",
+                   (unsigned)st.files, (unsigned)st.failed, (unsigned)st.rejected, (unsigned)st.deleted,
+                   (unsigned long long)st.bytes,
+                   (unsigned)(st.total_us / 1000), (unsigned)(st.write_us / 1000), (unsigned)(st.commit_us / 1000),
+                   (unsigned)st.last_size, (unsigned)st.last_kb_per_s, (unsigned)st.stalls,
+                   (unsigned)(st.stall_us / 1000));
+    for (int i = 0; i < UPLOAD_MODE_COUNT; i++) {
+        const upload_mode_stats_t *m = &st.modes[i];
+        strbuf_appendf(buf, buflen, pos, ",\"%s\":{\"files\":%u,\"bytes\":%llu,\"kb_per_s\":%u}",
+                       upload_mode_name((upload_mode_t)i), (unsigned)m->files, (unsigned long long)m->bytes,
+                       m->total_us ? (unsigned)(m->bytes * 1000000 / 1024 / m->total_us) : 0);
+    }
+    strbuf_appendf(buf, buflen, pos, "}");
+}
+
+/* Образы файлов в разделах A/B: активный раздел и этапы последней подмены */
+static void append_image(char *buf, size_t buflen, size_t *pos) {
+    asset_image_stats_t st;
+    asset_image_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"image\":{\"active\":\"%s\",\"updating\":%s,\"updates\":%u,\"failed\":%u,\"last_size\":%u,"
+                   "\"last_ms\":%u,\"last_kb_per_s\":%u,\"last_write_ms\":%u,\"last_erase_ms\":%u,\"last_stalls\":%u,"
+                   "\"last_verify_ms\":%u,\"last_switch_ms\":%u}",
+                   st.active, st.updating ? "true" : "false", (unsigned)st.updates, (unsigned)st.failed,
+                   (unsigned)st.last_size, (unsigned)st.last_ms, (unsigned)st.last_kb_per_s, (unsigned)st.last_write_ms,
+                   (unsigned)st.last_erase_ms, (unsigned)st.last_stalls, (unsigned)st.last_verify_ms,
+                   (unsigned)st.last_switch_ms);
+}
+
+/* Прошивка: текущий слот, ждет ли подтверждения и скорость последнего обновления */
+static void append_firmware(char *buf, size_t buflen, size_t *pos) {
+    firmware_stats_t st;
+    firmware_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"firmware\":{\"running\":\"%s\",\"version\":\"%s\",\"pending_verify\":%s,\"updating\":%s,"
+                   "\"updates\":%u,\"failed\":%u,\"last_size\":%u,\"last_ms\":%u,\"last_kb_per_s\":%u,"
+                   "\"last_write_ms\":%u,\"last_stalls\":%u,\"last_yields\":%u}",
+                   st.running, st.version, st.pending_verify ? "true" : "false", st.updating ? "true" : "false",
+                   (unsigned)st.updates, (unsigned)st.failed, (unsigned)st.last_size, (unsigned)st.last_ms,
+                   (unsigned)st.last_kb_per_s, (unsigned)st.last_write_ms, (unsigned)st.last_stalls,
+                   (unsigned)st.last_yields);
+}
+
+/* WebSocket: открытые соединения и трафик в обе стороны */
+static void append_websocket(char *buf, size_t buflen, size_t *pos) {
+    websocket_stats_t st;
+    websocket_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"websocket\":{\"clients\":%u,\"max_clients\":%d,\"peak\":%u,\"opened\":%u,\"rejected\":%u,"
+                   "\"closed\":%u,\"client_closes\":%u,\"messages_in\":%u,\"fragments_in\":%u,\"messages_out\":%u,"
+                   "\"bytes_in\":%llu,\"bytes_out\":%llu,\"pings\":%u,\"ping_timeouts\":%u,\"protocol_errors\":%u,"
+                   "\"send_errors\":%u}",
+                   st.clients, WEBSOCKET_MAX_CLIENTS, st.peak, (unsigned)st.opened, (unsigned)st.rejected,
+                   (unsigned)st.closed, (unsigned)st.client_closes, (unsigned)st.messages_in, (unsigned)st.fragments_in,
+                   (unsigned)st.messages_out, (unsigned long long)st.bytes_in, (unsigned long long)st.bytes_out,
+                   (unsigned)st.pings, (unsigned)st.ping_timeouts, (unsigned)st.protocol_errors, (unsigned)st.send_errors);
+}
+
+/* Пулы блоков фиксированного размера */
+static void append_pools(char *buf, size_t buflen, size_t *pos) {
+    strbuf_appendf(buf, buflen, pos, "\"pools\":[");
+    for (int i = 0; i < mem_pool_count(); i++) {
+        mem_pool_stats_t st;
+        mem_pool_get_stats(i, &st);
+        strbuf_appendf(buf, buflen, pos,
+                       "%s{\"name\":\"%s\",\"block\":%u,\"count\":%u,\"in_use\":%u,\"peak\":%u,"
+                       "\"acquires\":%u,\"failures\":%u}",
+                       i ? "," : "", st.name, (unsigned)st.block_size, st.count, st.in_use, st.peak,
+                       (unsigned)st.acquires, (unsigned)st.failures);
+    }
+    strbuf_appendf(buf, buflen, pos, "]");
+}
+
+/* Отправка по транспортам: сравнение сокетов с netconn без копирования */
+static void append_transport(char *buf, size_t buflen, size_t *pos) {
+    strbuf_appendf(buf, buflen, pos, "\"transport\":{");
+    for (int i = 0; i < TRANSPORT_COUNT; i++) {
+        transport_stats_t st;
+        transport_get_stats((transport_kind_t)i, &st);
+        uint32_t kbps = st.send_us ? (uint32_t)(st.bytes * 1000000 / 1024 / st.send_us) : 0;
+        strbuf_appendf(buf, buflen, pos,
+                       "%s\"%s\":{\"connections\":%u,\"bytes\":%llu,\"nocopy_bytes\":%llu,\"send_ms\":%u,\"kb_per_s\":%u}",
+                       i ? "," : "", transport_name((transport_kind_t)i), (unsigned)st.connections,
+                       (unsigned long long)st.bytes, (unsigned long long)st.nocopy_bytes,
+                       (unsigned)(st.send_us / 1000), (unsigned)kbps);
+    }
+    strbuf_appendf(buf, buflen, pos, "}");
+}
+
+static void append_latency(char *buf, size_t buflen, size_t *pos, const char *name, const http_latency_t *l) {
+    strbuf_appendf(buf, buflen, pos, ",\"%s\":{\"samples\":%u,\"avg_us\":%u,\"max_us\":%u}", name,
+                   (unsigned)l->samples, l->samples ? (unsigned)(l->total_us / l->samples) : 0, (unsigned)l->max_us);
+}
+
+/* Клиенты, keep-alive и закрытие соединений. Время ответов отдельно на время записи образа файлов */
+static void append_http(char *buf, size_t buflen, size_t *pos) {
+    http_server_stats_t st;
+    http_server_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos,
+                   "\"http\":{\"ipv4_clients\":%u,\"ipv6_clients\":%u,\"accept_errors\":%u,\"shed\":%u,\"queue_sheds\":%u,\"requests\":%u,"
+                   "\"keepalive_reuses\":%u,\"client_closes\":%u,\"idle_timeouts\":%u,\"idle_yields\":%u,\"drain_timeouts\":%u,"
+                   "\"resets\":%u,\"tcp_active\":%u,\"tcp_time_wait\":%u,\"tcp_pcb_max\":%u",
+                   (unsigned)st.ipv4_clients, (unsigned)st.ipv6_clients, (unsigned)st.accept_errors, (unsigned)st.shed,
+                   (unsigned)st.queue_sheds, (unsigned)st.requests, (unsigned)st.keepalive_reuses, (unsigned)st.client_closes,
+                   (unsigned)st.idle_timeouts, (unsigned)st.idle_yields, (unsigned)st.drain_timeouts, (unsigned)st.resets,
+                   (unsigned)st.tcp_active, (unsigned)st.tcp_time_wait, (unsigned)st.tcp_pcb_max);
+    append_latency(buf, buflen, pos, "latency", &st.latency);
+    append_latency(buf, buflen, pos, "latency_update", &st.latency_update);
+    strbuf_appendf(buf, buflen, pos, "}");
+}
+
+/* Режимы сна модема: сколько времени в каждом и во что это обходится клиентам */
+static void append_power_save(char *buf, size_t buflen, size_t *pos) {
+    static const char *const names[WIFI_PS_MODE_COUNT] = { "none", "min_modem", "max_modem" };
+    wifi_ps_stats_t st;
+    wifi_ps_get_stats(&st);
+    strbuf_appendf(buf, buflen, pos, "\"power_save\":{\"mode\":\"%s\",\"switches\":%u,\"wakeups\":%u,\"modes\":{",
+                   names[st.mode], (unsigned)st.switches, (unsigned)st.wakeups);
+    for (int i = 0; i < WIFI_PS_MODE_COUNT; i++) {
+        strbuf_appendf(buf, buflen, pos, "%s\"%s\":{\"time_ms\":%lld,\"first_byte_avg_us\":%u,\"samples\":%u}",
+                       i ? "," : "", names[i], (long long)(st.time_in_mode_us[i] / 1000),
+                       (unsigned)st.first_byte_avg_us[i], (unsigned)st.first_byte_samples[i]);
+    }
+    strbuf_appendf(buf, buflen, pos, "}}");
+}
+
+size_t diag_render_json(char *buf, size_t buflen) {
+    if (!buf || buflen == 0) return 0;
+    size_t pos = 0;
+    strbuf_appendf(buf, buflen, &pos, "{\"uptime_ms\":%lld,\"boot\":", (long long)(esp_timer_get_time() / 1000));
+    boot_append_json(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_heap(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_server_tasks(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_runtime_stats(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_file_pool(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_cache(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_warmup(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_wifi(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_power_save(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_http(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_transport(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_pools(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_gzip(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_inflate(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_writer(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_upload(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_image(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_firmware(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, ",");
+    append_websocket(buf, buflen, &pos);
+    strbuf_appendf(buf, buflen, &pos, "}");
+    return pos;
+}
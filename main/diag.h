@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/* URL диагностического маршрута */
+#define DIAG_PATH "/_diag"
+
+/* Максимум задач сервера, за стеком которых следим */
+#define DIAG_MAX_TASKS 8
+
+/* Регистрируем задачу сервера, чтобы отдавать её high-water mark стека */
+void diag_register_task(TaskHandle_t task);
+
+/* Формируем JSON с диагностикой в `buf` (buflen bytes). Возвращает длину строки */
+size_t diag_render_json(char *buf, size_t buflen);
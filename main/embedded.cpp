@@ -0,0 +1,38 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "embedded.h"
+#include "mime.h"
+
+/* Символы, которые создает EMBED_FILES в main/CMakeLists.txt */
+extern const uint8_t index_html_start[] asm("_binary_index_html_start");
+extern const uint8_t index_html_end[] asm("_binary_index_html_end");
+
+#define EMBEDDED_HEADER_LEN 160
+
+static embedded_file_t s_files[] = {
+    { "index.html", index_html_start, 0, NULL, 0 },
+};
+static char s_headers[sizeof(s_files) / sizeof(s_files[0])][EMBEDDED_HEADER_LEN];
+
+void embedded_init(void) {
+    s_files[0].size = index_html_end - index_html_start;
+
+    for (size_t i = 0; i < sizeof(s_files) / sizeof(s_files[0]); i++) {
+        // Вшитая копия может отставать от файла в ФС, поэтому браузер должен перепроверять ее
+        int n = snprintf(s_headers[i], sizeof(s_headers[i]),
+                         "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: %s\r\n"
+                         "Cache-Control: no-cache\r\n",
+                         mime_lookup(s_files[i].name));
+        s_files[i].header = s_headers[i];
+        s_files[i].header_len = n;
+    }
+}
+
+const embedded_file_t *embedded_lookup(const char *name) {
+    for (size_t i = 0; i < sizeof(s_files) / sizeof(s_files[0]); i++) {
+        if (strcmp(s_files[i].name, name) == 0) return &s_files[i];
+    }
+    return NULL;
+}
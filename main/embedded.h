@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Файл, вшитый в прошивку через EMBED_FILES. Отдается, пока SPIFFS еще не готова */
+typedef struct {
+    const char *name;       // путь от корня ФС
+    const uint8_t *data;
+    size_t size;
+    const char *header;     // заготовка заголовков, как у asset_variant_t
+    uint16_t header_len;
+} embedded_file_t;
+
+/* Собираем заголовки вшитых файлов */
+void embedded_init(void);
+
+/* Вшитый файл по пути от корня ФС или NULL */
+const embedded_file_t *embedded_lookup(const char *name);
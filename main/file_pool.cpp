@@ -0,0 +1,182 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "file_pool.h"
+
+static const char *TAG = "file_pool";
+
+struct file_pool_handle {
+    char path[FILE_POOL_PATH_MAX];
+    int fd;
+    uint32_t refs;
+    TickType_t last_used;
+    // Файл на flash заменен или удален: новым читателям дескриптор не выдается
+    bool stale;
+    // Удаленный файл, который до последнего читателя лежит под этим скрытым именем
+    char retired[FILE_POOL_PATH_MAX];
+    // lseek + read должны идти парой: SPIFFS через VFS не умеет pread
+    SemaphoreHandle_t io_lock;
+};
+
+static file_handle_t s_handles[FILE_POOL_SIZE];
+static SemaphoreHandle_t s_lock;
+// Сигнал о том, что какой-то дескриптор освободился
+static SemaphoreHandle_t s_released;
+static file_pool_stats_t s_stats;
+
+esp_err_t file_pool_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    s_released = xSemaphoreCreateBinary();
+    if (!s_lock || !s_released) return ESP_ERR_NO_MEM;
+    for (int i = 0; i < FILE_POOL_SIZE; i++) {
+        s_handles[i].fd = -1;
+        s_handles[i].io_lock = xSemaphoreCreateMutex();
+        if (!s_handles[i].io_lock) return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/* Свободный слот или слот, дольше всех простаивающий без читателей. Под s_lock */
+static file_handle_t *pick_victim(void) {
+    file_handle_t *victim = NULL;
+    TickType_t now = xTaskGetTickCount();
+    for (int i = 0; i < FILE_POOL_SIZE; i++) {
+        file_handle_t *h = &s_handles[i];
+        if (h->fd < 0) return h;
+        if (h->refs == 0 && (!victim || now - h->last_used > now - victim->last_used)) {
+            victim = h;
+        }
+    }
+    return victim;
+}
+
+file_handle_t *file_pool_acquire(const char *path, esp_err_t *err) {
+    if (strlen(path) >= FILE_POOL_PATH_MAX) {
+        if (err) *err = ESP_ERR_INVALID_ARG;
+        return NULL;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    bool waited = false;
+    while (1) {
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        for (int i = 0; i < FILE_POOL_SIZE; i++) {
+            file_handle_t *h = &s_handles[i];
+            if (h->fd >= 0 && !h->stale && strcmp(h->path, path) == 0) {
+                if (h->refs++ == 0) s_stats.in_use++;
+                s_stats.hits++;
+                xSemaphoreGive(s_lock);
+                return h;
+            }
+        }
+
+        file_handle_t *h = pick_victim();
+        if (h) {
+            if (h->fd >= 0) {
+                close(h->fd);
+                s_stats.evictions++;
+            }
+            h->fd = open(path, O_RDONLY);
+            if (h->fd < 0) {
+                xSemaphoreGive(s_lock);
+                ESP_LOGW(TAG, "Unable to open %s: errno %d", path, errno);
+                if (err) *err = ESP_ERR_NOT_FOUND;
+                return NULL;
+            }
+            strcpy(h->path, path);
+            h->stale = false;
+            h->refs = 1;
+            s_stats.in_use++;
+            s_stats.opens++;
+            xSemaphoreGive(s_lock);
+            return h;
+        }
+
+        // Все дескрипторы читаются прямо сейчас: ждем, пока кто-то освободит.
+        // Счетчики меняем, пока держим s_lock: ждущих может быть несколько
+        if (!waited) {
+            waited = true;
+            s_stats.waits++;
+        }
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        bool timed_out = elapsed >= pdMS_TO_TICKS(FILE_POOL_WAIT_MS);
+        if (timed_out) s_stats.timeouts++;
+        xSemaphoreGive(s_lock);
+        if (timed_out) {
+            if (err) *err = ESP_ERR_TIMEOUT;
+            return NULL;
+        }
+        xSemaphoreTake(s_released, pdMS_TO_TICKS(FILE_POOL_WAIT_MS) - elapsed);
+    }
+}
+
+ssize_t file_pool_pread(file_handle_t *handle, void *buf, size_t len, size_t offset) {
+    xSemaphoreTake(handle->io_lock, portMAX_DELAY);
+    ssize_t r = -1;
+    if (lseek(handle->fd, offset, SEEK_SET) == (off_t)offset) {
+        r = read(handle->fd, buf, len);
+    }
+    xSemaphoreGive(handle->io_lock);
+    return r;
+}
+
+void file_pool_release(file_handle_t *handle) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    handle->last_used = xTaskGetTickCount();
+    if (--handle->refs == 0) {
+        s_stats.in_use--;
+        // Устаревший дескриптор больше никому не нужен, а спрятанный файл можно удалить
+        if (handle->stale) {
+            close(handle->fd);
+            handle->fd = -1;
+            if (handle->retired[0]) unlink(handle->retired);
+            handle->retired[0] = 0;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    xSemaphoreGive(s_released);
+}
+
+int file_pool_invalidate(const char *path) {
+    int busy = 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < FILE_POOL_SIZE; i++) {
+        file_handle_t *h = &s_handles[i];
+        if (h->fd < 0 || (path && strcmp(h->path, path) != 0)) continue;
+        if (h->refs == 0) {
+            close(h->fd);
+            h->fd = -1;
+        } else {
+            // Занятый читатель дочитает, закроется он при освобождении
+            h->stale = true;
+            busy++;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return busy;
+}
+
+bool file_pool_retire(const char *path, const char *retired) {
+    bool held = false;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < FILE_POOL_SIZE; i++) {
+        file_handle_t *h = &s_handles[i];
+        if (h->fd < 0 || !h->stale || h->retired[0] || strcmp(h->path, path) != 0) continue;
+        strcpy(h->retired, retired);
+        held = true;
+    }
+    xSemaphoreGive(s_lock);
+    return held;
+}
+
+void file_pool_get_stats(file_pool_stats_t *stats) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    xSemaphoreGive(s_lock);
+}
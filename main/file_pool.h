@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+
+/* Сколько дескрипторов держит пул. Должно быть меньше SPIFFS_MAX_FILES,
+ * чтобы остался запас для открытия файлов в обход пула */
+#define FILE_POOL_SIZE 4
+#define FILE_POOL_PATH_MAX 72
+/* Сколько ждем освобождения дескриптора, если все заняты */
+#define FILE_POOL_WAIT_MS 3000
+
+typedef struct file_pool_handle file_handle_t;
+
+typedef struct {
+    uint32_t hits;       // файл уже был открыт, дескриптор разделен
+    uint32_t opens;      // пришлось открыть файл
+    uint32_t evictions;  // закрыли простаивающий дескриптор ради другого файла
+    uint32_t waits;      // все дескрипторы были заняты, ждали
+    uint32_t timeouts;   // так и не дождались
+    uint32_t in_use;     // дескрипторов с активными читателями сейчас
+} file_pool_stats_t;
+
+esp_err_t file_pool_init(void);
+
+/* Берем общий дескриптор файла. Одновременные читатели одного файла делят один
+ * дескриптор. Если свободных нет, ждем до FILE_POOL_WAIT_MS.
+ * NULL: файл не открылся (err = ESP_ERR_NOT_FOUND) или не дождались (err = ESP_ERR_TIMEOUT) */
+file_handle_t *file_pool_acquire(const char *path, esp_err_t *err);
+
+/* Позиционное чтение: каждый читатель ведет свое смещение */
+ssize_t file_pool_pread(file_handle_t *handle, void *buf, size_t len, size_t offset);
+
+/* Отпускаем дескриптор. Он остается открытым, пока не понадобится другому файлу */
+void file_pool_release(file_handle_t *handle);
+
+/* Файл `path` на flash заменен или удален: простаивающий дескриптор закрываем, занятый
+ * больше не выдаем новым читателям и закрываем, когда его отпустят. NULL - все файлы.
+ * Возвращает, сколько занятых осталось открытыми */
+int file_pool_invalidate(const char *path);
+
+/* SPIFFS закрывает дескрипторы удаленного файла. Поэтому файл, который после file_pool_invalidate
+ * еще читают, вызывающий переименовывает в `retired`, а удаляет его последний читатель.
+ * false - читателей уже нет, удалить `retired` должен вызывающий */
+bool file_pool_retire(const char *path, const char *retired);
+
+void file_pool_get_stats(file_pool_stats_t *stats);
@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "firmware.h"
+#include "http_server.h"
+
+static const char *TAG = "firmware";
+
+static char s_version[32];
+static volatile bool s_updating = false;
+static esp_timer_handle_t s_restart_timer;
+static firmware_stats_t s_stats;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void restart_cb(void *arg) {
+    esp_restart();
+}
+
+void firmware_init(void) {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    esp_app_desc_t desc;
+    if (esp_ota_get_partition_description(running, &desc) == ESP_OK) {
+        strncpy(s_version, desc.version, sizeof(s_version) - 1);
+    }
+    ESP_LOGI(TAG, "Running %s from %s%s", s_version, running->label,
+             firmware_pending_verify() ? ", pending verify" : "");
+    const esp_timer_create_args_t timer_args = {
+        .callback = &restart_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "fw_restart",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_restart_timer));
+}
+
+static void schedule_restart(void) {
+    esp_timer_start_once(s_restart_timer, FIRMWARE_RESTART_DELAY_MS * 1000ULL);
+}
+
+/* Приемник конвейера. Слот стирается посекторно внутри esp_ota_write */
+static esp_err_t firmware_sink(void *ctx, const uint8_t *data, size_t len) {
+    firmware_t *fw = (firmware_t *)ctx;
+    esp_err_t err = esp_ota_write(fw->handle, data, len);
+    // Пока идут ответы, уступаем им flash: прием в это время заполняет кольцо
+    if (err == ESP_OK && http_server_active_responses() > 0) {
+        vTaskDelay(pdMS_TO_TICKS(FIRMWARE_YIELD_MS));
+        fw->yields++;
+    }
+    return err == ESP_ERR_OTA_VALIDATE_FAILED ? ESP_ERR_INVALID_CRC : err;
+}
+
+esp_err_t firmware_begin(firmware_t *fw, size_t size, upload_mode_t mode) {
+    fw->part = esp_ota_get_next_update_partition(NULL);
+    if (!fw->part) return ESP_ERR_NOT_FOUND;
+    if (size == 0 || size > fw->part->size) return ESP_ERR_INVALID_SIZE;
+    esp_err_t err = upload_stream_begin(&fw->up, firmware_sink, fw, size, mode);
+    if (err != ESP_OK) return err;
+    // Без предварительного стирания всего слота: сектор стирается перед записью в него
+    err = esp_ota_begin(fw->part, OTA_WITH_SEQUENTIAL_WRITES, &fw->handle);
+    if (err != ESP_OK) {
+        upload_stream_end(&fw->up);
+        return err;
+    }
+    fw->yields = 0;
+    s_updating = true;
+    ESP_LOGI(TAG, "Writing %u byte firmware to %s", (unsigned)size, fw->part->label);
+    return ESP_OK;
+}
+
+esp_err_t firmware_write(firmware_t *fw, const void *data, size_t len) {
+    return upload_write(&fw->up, data, len);
+}
+
+static void finish_stats(firmware_t *fw, esp_err_t err) {
+    uint64_t total_us = esp_timer_get_time() - fw->up.started_us;
+    portENTER_CRITICAL(&s_mux);
+    if (err == ESP_OK) {
+        s_stats.updates++;
+        s_stats.last_size = fw->up.size;
+        s_stats.last_ms = total_us / 1000;
+        s_stats.last_kb_per_s = total_us ? (uint32_t)(fw->up.size * 1000000ULL / 1024 / total_us) : 0;
+        s_stats.last_write_ms = fw->up.write_us / 1000;
+        s_stats.last_stalls = fw->up.stalls;
+        s_stats.last_yields = fw->yields;
+    } else {
+        s_stats.failed++;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    s_updating = false;
+}
+
+esp_err_t firmware_finish(firmware_t *fw) {
+    esp_err_t err = upload_stream_end(&fw->up);
+    if (err != ESP_OK) {
+        esp_ota_abort(fw->handle);
+    } else {
+        // Проверка образа: заголовок, контрольная сумма и SHA-256 в конце образа
+        err = esp_ota_end(fw->handle);
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) err = ESP_ERR_INVALID_CRC;
+    }
+    if (err == ESP_OK) err = esp_ota_set_boot_partition(fw->part);
+    finish_stats(fw, err);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Firmware update failed (%s)", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Firmware written to %s, restarting", fw->part->label);
+    schedule_restart();
+    return ESP_OK;
+}
+
+void firmware_abort(firmware_t *fw) {
+    upload_stream_end(&fw->up);
+    esp_ota_abort(fw->handle);
+    finish_stats(fw, ESP_FAIL);
+}
+
+bool firmware_busy(void) {
+    return s_updating;
+}
+
+bool firmware_pending_verify(void) {
+    esp_ota_img_states_t state;
+    return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+           state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+esp_err_t firmware_confirm(void) {
+    if (!firmware_pending_verify()) return ESP_OK;
+    ESP_LOGI(TAG, "Firmware %s confirmed", s_version);
+    return esp_ota_mark_app_valid_cancel_rollback();
+}
+
+void firmware_reject(void) {
+    ESP_LOGE(TAG, "Firmware %s did not come up, rolling back", s_version);
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+esp_err_t firmware_rollback(void) {
+    if (s_updating) return ESP_ERR_INVALID_STATE;
+    const esp_partition_t *other = esp_ota_get_next_update_partition(NULL);
+    esp_ota_img_states_t state;
+    if (!other || (esp_ota_get_state_partition(other, &state) == ESP_OK &&
+                   (state == ESP_OTA_IMG_INVALID || state == ESP_OTA_IMG_ABORTED))) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    // Загрузочным слот станет, только если в нем цельный образ
+    if (esp_ota_set_boot_partition(other) != ESP_OK) return ESP_ERR_NOT_FOUND;
+    ESP_LOGW(TAG, "Rolling back to %s", other->label);
+    schedule_restart();
+    return ESP_OK;
+}
+
+void firmware_get_stats(firmware_stats_t *stats) {
+    portENTER_CRITICAL(&s_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_mux);
+    stats->running = esp_ota_get_running_partition()->label;
+    stats->version = s_version;
+    stats->pending_verify = firmware_pending_verify();
+    stats->updating = s_updating;
+}
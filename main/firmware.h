@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "esp_ota_ops.h"
+
+#include "upload.h"
+
+/* Обновление прошивки по HTTP: образ пишется в неактивный слот ota_0/ota_1 по мере приема,
+ * после проверки слот становится загрузочным. Новая прошивка откатывается, если не подтвердит
+ * себя после старта (CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE) */
+#define FIRMWARE_PATH "/_firmware"
+/* Сколько новая прошивка ждет, пока сервер заработает, прежде чем откатиться */
+#define FIRMWARE_CONFIRM_MS 60000
+/* Пауза записи, пока отдаются файлы: стирание и запись flash останавливают кеш обоих ядер */
+#define FIRMWARE_YIELD_MS 10
+/* Перезагрузка после записи: ответ успевает уйти клиенту */
+#define FIRMWARE_RESTART_DELAY_MS 1000
+
+typedef struct {
+    const esp_partition_t *part;
+    esp_ota_handle_t handle;
+    uint32_t yields;
+    upload_t up;
+} firmware_t;
+
+typedef struct {
+    const char *running;        // раздел текущей прошивки
+    const char *version;
+    bool pending_verify;        // прошивка еще не подтвердила себя
+    bool updating;
+    uint32_t updates;
+    uint32_t failed;
+    // Последняя запись
+    uint32_t last_size;
+    uint32_t last_ms;           // от первого байта тела до проверки образа
+    uint32_t last_kb_per_s;
+    uint32_t last_write_ms;     // в esp_ota_write, включая стирание
+    uint32_t last_stalls;       // прием ждал flash
+    uint32_t last_yields;       // запись уступала flash отдаче файлов
+} firmware_stats_t;
+
+void firmware_init(void);
+
+/* Начинаем образ длиной `size` в неактивный слот. Тело идет через конвейер загрузки.
+ * ESP_ERR_INVALID_SIZE - не влезет в слот, ESP_ERR_INVALID_STATE - идет другая загрузка */
+esp_err_t firmware_begin(firmware_t *fw, size_t size, upload_mode_t mode);
+
+esp_err_t firmware_write(firmware_t *fw, const void *data, size_t len);
+
+/* Проверяем образ и делаем слот загрузочным. Перезагрузка через FIRMWARE_RESTART_DELAY_MS.
+ * ESP_ERR_INVALID_CRC - образ поврежден или это не прошивка */
+esp_err_t firmware_finish(firmware_t *fw);
+
+void firmware_abort(firmware_t *fw);
+
+/* Идет запись прошивки */
+bool firmware_busy(void);
+
+/* Прошивка запущена впервые после обновления и ждет подтверждения */
+bool firmware_pending_verify(void);
+
+/* Прошивка работает: отменяем откат */
+esp_err_t firmware_confirm(void);
+
+/* Прошивка не заработала: помечаем ее негодной и перезагружаемся в прошлую */
+void firmware_reject(void);
+
+/* Загружаемся в прошивку из другого слота (перезагрузка через FIRMWARE_RESTART_DELAY_MS).
+ * ESP_ERR_NOT_FOUND - в другом слоте нет рабочей прошивки, ESP_ERR_INVALID_STATE - он сейчас пишется */
+esp_err_t firmware_rollback(void);
+
+void firmware_get_stats(firmware_stats_t *stats);
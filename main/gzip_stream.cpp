@@ -0,0 +1,230 @@
+#include <string.h>
+
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+
+#include "gzip_stream.h"
+
+/* Максимальная длина совпадения в deflate */
+#define MATCH_MAX 258
+#define MATCH_MIN 3
+#define SYM_EOB 256
+
+static_assert(GZIP_STREAM_IN_MAX <= GZIP_STREAM_WINDOW, "input must fit next to the history");
+static_assert(2 * GZIP_STREAM_WINDOW <= 0xffff, "window positions are 16-bit");
+
+static gzip_stream_stats_t s_stats;
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+namespace {
+
+/* Коды Хаффмана в deflate пишутся старшим битом вперед, а поток битов - младшим.
+ * Поэтому в таблицах коды уже развернуты */
+constexpr uint16_t reverse_bits(uint16_t code, int len) {
+    uint16_t r = 0;
+    for (int i = 0; i < len; i++) {
+        r = (uint16_t)((r << 1) | (code & 1));
+        code >>= 1;
+    }
+    return r;
+}
+
+constexpr uint16_t k_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+constexpr uint8_t k_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+/* Фиксированный код литералов/длин (RFC 1951, 3.2.6) и код длины по (длина - 3) */
+struct fixed_tables {
+    uint16_t lit_code[288];
+    uint8_t lit_len[288];
+    uint8_t len_sym[MATCH_MAX - MATCH_MIN + 1];  // индекс в k_len_base
+    uint8_t dist_code[32];                       // развернутые 5-битные коды расстояний
+};
+
+constexpr fixed_tables build_tables() {
+    fixed_tables t = {};
+    for (int v = 0; v < 288; v++) {
+        uint16_t code = 0;
+        int len = 0;
+        if (v < 144) {
+            code = 0x30 + v;
+            len = 8;
+        } else if (v < 256) {
+            code = 0x190 + (v - 144);
+            len = 9;
+        } else if (v < 280) {
+            code = v - 256;
+            len = 7;
+        } else {
+            code = 0xc0 + (v - 280);
+            len = 8;
+        }
+        t.lit_code[v] = reverse_bits(code, len);
+        t.lit_len[v] = (uint8_t)len;
+    }
+    for (int l = MATCH_MIN; l <= MATCH_MAX; l++) {
+        int sym = 28;
+        while (k_len_base[sym] > l) sym--;
+        t.len_sym[l - MATCH_MIN] = (uint8_t)sym;
+    }
+    for (int d = 0; d < 32; d++) t.dist_code[d] = (uint8_t)reverse_bits(d, 5);
+    return t;
+}
+
+constexpr fixed_tables k_tables = build_tables();
+
+} // namespace
+
+static void put_bits(gzip_stream_t *z, uint32_t value, int n, uint8_t **out) {
+    z->bits |= value << z->bit_count;
+    z->bit_count += n;
+    while (z->bit_count >= 8) {
+        *(*out)++ = (uint8_t)z->bits;
+        z->bits >>= 8;
+        z->bit_count -= 8;
+    }
+}
+
+static void put_literal(gzip_stream_t *z, int sym, uint8_t **out) {
+    put_bits(z, k_tables.lit_code[sym], k_tables.lit_len[sym], out);
+}
+
+static void put_match(gzip_stream_t *z, int len, int dist, uint8_t **out) {
+    int ls = k_tables.len_sym[len - MATCH_MIN];
+    put_literal(z, 257 + ls, out);
+    if (k_len_extra[ls]) put_bits(z, len - k_len_base[ls], k_len_extra[ls], out);
+
+    // Код расстояния: 0..3 для 1..4, дальше по два кода на каждую степень двойки
+    uint32_t d = dist - 1;
+    if (d < 4) {
+        put_bits(z, k_tables.dist_code[d], 5, out);
+        return;
+    }
+    int n = 31 - __builtin_clz(d);
+    int code = 2 * n + ((d >> (n - 1)) & 1);
+    put_bits(z, k_tables.dist_code[code], 5, out);
+    put_bits(z, d & ((1u << (n - 1)) - 1), n - 1, out);
+}
+
+static inline uint32_t hash3(const uint8_t *p) {
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - GZIP_STREAM_HASH_BITS);
+}
+
+/* Сдвигаем окно, оставляя последние GZIP_STREAM_WINDOW байт истории */
+static void slide(gzip_stream_t *z) {
+    uint16_t shift = z->pos - GZIP_STREAM_WINDOW;
+    memmove(z->window, z->window + shift, GZIP_STREAM_WINDOW);
+    for (size_t i = 0; i < sizeof(z->head) / sizeof(z->head[0]); i++) {
+        z->head[i] = z->head[i] > shift ? z->head[i] - shift : 0;
+    }
+    z->pos = GZIP_STREAM_WINDOW;
+}
+
+/* Заголовок gzip и единственного блока deflate с фиксированным кодом. Блок сразу последний (BFINAL):
+ * он тянется до конца потока */
+static void start(gzip_stream_t *z, uint8_t **out) {
+    static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+    memcpy(*out, header, sizeof(header));
+    *out += sizeof(header);
+    put_bits(z, 1 | (1 << 1), 3, out);
+    z->started = true;
+}
+
+void gzip_stream_begin(gzip_stream_t *z) {
+    memset(z->head, 0, sizeof(z->head));
+    z->pos = 0;
+    z->bits = 0;
+    z->bit_count = 0;
+    z->started = false;
+    z->crc = 0;
+    z->size = 0;
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.streams++;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
+
+size_t gzip_stream_write(gzip_stream_t *z, const uint8_t *in, size_t len, uint8_t *out) {
+    int64_t t0 = esp_timer_get_time();
+    uint8_t *o = out;
+    if (!z->started) start(z, &o);
+
+    if (z->pos + len > sizeof(z->window)) slide(z);
+    memcpy(z->window + z->pos, in, len);
+    z->crc = esp_rom_crc32_le(z->crc, in, len);
+    z->size += len;
+
+    // Жадный поиск с одним кандидатом на хеш: сжатие хуже zlib -6, зато без цепочек
+    size_t end = z->pos + len;
+    size_t i = z->pos;
+    while (i < end) {
+        size_t best = 0;
+        size_t dist = 0;
+        if (i + MATCH_MIN <= end) {
+            uint32_t h = hash3(z->window + i);
+            uint16_t cand = z->head[h];
+            z->head[h] = (uint16_t)(i + 1);
+            if (cand && i - (cand - 1) <= GZIP_STREAM_WINDOW) {
+                const uint8_t *a = z->window + cand - 1;
+                const uint8_t *b = z->window + i;
+                size_t max = end - i < MATCH_MAX ? end - i : MATCH_MAX;
+                while (best < max && a[best] == b[best]) best++;
+                dist = i - (cand - 1);
+            }
+        }
+        if (best >= MATCH_MIN) {
+            put_match(z, best, dist, &o);
+            for (size_t k = 1; k < best && i + k + MATCH_MIN <= end; k++) {
+                z->head[hash3(z->window + i + k)] = (uint16_t)(i + k + 1);
+            }
+            i += best;
+        } else {
+            put_literal(z, z->window[i], &o);
+            i++;
+        }
+    }
+    z->pos = end;
+
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.bytes_in += len;
+    s_stats.bytes_out += o - out;
+    s_stats.deflate_us += esp_timer_get_time() - t0;
+    portEXIT_CRITICAL(&s_stats_mux);
+    return o - out;
+}
+
+size_t gzip_stream_finish(gzip_stream_t *z, uint8_t *out) {
+    uint8_t *o = out;
+    if (!z->started) start(z, &o);
+    put_literal(z, SYM_EOB, &o);
+    if (z->bit_count) put_bits(z, 0, 8 - z->bit_count, &o);
+    for (int i = 0; i < 4; i++) *o++ = (uint8_t)(z->crc >> (8 * i));
+    for (int i = 0; i < 4; i++) *o++ = (uint8_t)(z->size >> (8 * i));
+
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.bytes_out += o - out;
+    portEXIT_CRITICAL(&s_stats_mux);
+    return o - out;
+}
+
+bool gzip_stream_eligible(const char *mime, size_t size) {
+    if (size < GZIP_STREAM_MIN_SIZE || size > GZIP_STREAM_MAX_SIZE) return false;
+    // Картинки, шрифты woff2 и прочее уже сжато
+    static const char *const compressible[] = { "text/", "javascript", "json", "xml", "svg", "wasm" };
+    for (size_t i = 0; i < sizeof(compressible) / sizeof(compressible[0]); i++) {
+        if (strstr(mime, compressible[i])) return true;
+    }
+    return false;
+}
+
+void gzip_stream_get_stats(gzip_stream_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Сжатие gzip на лету для файлов без заранее сжатого варианта .gz.
+ * LZ77 в маленьком окне и фиксированный Хаффман: памяти ~6 КБ на поток, CPU как у zlib -1 */
+#define GZIP_STREAM_WINDOW_BITS 11
+#define GZIP_STREAM_WINDOW (1 << GZIP_STREAM_WINDOW_BITS)
+#define GZIP_STREAM_HASH_BITS 10
+/* Сколько входа принимает один вызов gzip_stream_write и сколько он может выдать в худшем случае
+ * (литерал фиксированным кодом - 9 бит) вместе с заголовком и хвостом gzip */
+#define GZIP_STREAM_IN_MAX 1024
+#define GZIP_STREAM_OUT_MAX (GZIP_STREAM_IN_MAX + GZIP_STREAM_IN_MAX / 8 + 32)
+/* Меньше этого выигрыш не окупает чанки, больше - слишком долго держим CPU */
+#define GZIP_STREAM_MIN_SIZE 1024
+#define GZIP_STREAM_MAX_SIZE (256 * 1024)
+
+typedef struct {
+    uint8_t window[2 * GZIP_STREAM_WINDOW];  // история для ссылок назад и новый вход
+    uint16_t head[1 << GZIP_STREAM_HASH_BITS]; // последняя позиция в window + 1 для хеша трех байт
+    uint16_t pos;                            // сколько байт занято в window
+    uint32_t bits;
+    uint8_t bit_count;
+    bool started;
+    uint32_t crc;
+    uint32_t size;
+} gzip_stream_t;
+
+typedef struct {
+    uint32_t streams;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t deflate_us;  // время внутри компрессора
+} gzip_stream_stats_t;
+
+/* Сжимать ли на лету тело типа `mime` размером `size` */
+bool gzip_stream_eligible(const char *mime, size_t size);
+
+void gzip_stream_begin(gzip_stream_t *z);
+
+/* Сжимаем до GZIP_STREAM_IN_MAX байт. Вывод (не больше GZIP_STREAM_OUT_MAX) пишется в `out`,
+ * возвращается его длина; может быть 0, пока биты копятся */
+size_t gzip_stream_write(gzip_stream_t *z, const uint8_t *in, size_t len, uint8_t *out);
+
+/* Закрываем поток: остаток битов и хвост gzip (CRC и размер) */
+size_t gzip_stream_finish(gzip_stream_t *z, uint8_t *out);
+
+void gzip_stream_get_stats(gzip_stream_stats_t *stats);
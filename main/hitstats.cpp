@@ -0,0 +1,255 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "hitstats.h"
+#include "strbuf.h"
+
+static const char *TAG = "hitstats";
+
+/* Так запись хранится и в RAM, и в blob в NVS. Файл опознаем по хешу пути от корня ФС */
+typedef struct {
+    uint32_t key;
+    uint32_t hits;
+    uint32_t bytes;
+} hit_record_t;
+
+static hit_record_t s_records[HITSTATS_SLOTS];
+static int s_record_count = 0;
+static uint32_t s_unsaved_hits = 0;
+static uint32_t s_saves = 0;
+static int64_t s_last_save_us = 0;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* FNV-1a, 0 зарезервирован под пустой слот */
+static uint32_t name_key(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h ? h : 1;
+}
+
+/* Слот с ключом `key` или пустой слот на его цепочке. Под s_mux */
+static hit_record_t *find_record(uint32_t key, bool create) {
+    uint32_t slot = key & (HITSTATS_SLOTS - 1);
+    for (int probe = 0; probe < HITSTATS_SLOTS; probe++) {
+        hit_record_t *r = &s_records[slot];
+        if (r->key == key) return r;
+        if (r->key == 0) {
+            if (!create || s_record_count >= HITSTATS_MAX) return NULL;
+            r->key = key;
+            s_record_count++;
+            return r;
+        }
+        slot = (slot + 1) & (HITSTATS_SLOTS - 1);
+    }
+    return NULL;
+}
+
+/* Убираем запись, сдвигая назад следующие за ней записи цепочки, чтобы поиск их не потерял. Под s_mux */
+static void remove_record(hit_record_t *r) {
+    uint32_t hole = r - s_records;
+    uint32_t slot = hole;
+    while (1) {
+        slot = (slot + 1) & (HITSTATS_SLOTS - 1);
+        hit_record_t *next = &s_records[slot];
+        if (!next->key) break;
+        // Запись можно перенести в дыру, только если дыра лежит между ее домашним слотом и текущим
+        uint32_t home = next->key & (HITSTATS_SLOTS - 1);
+        if (((slot - home) & (HITSTATS_SLOTS - 1)) >= ((slot - hole) & (HITSTATS_SLOTS - 1))) {
+            s_records[hole] = *next;
+            hole = slot;
+        }
+    }
+    memset(&s_records[hole], 0, sizeof(s_records[hole]));
+    s_record_count--;
+}
+
+/* Забываем файлы, которых больше нет в индексе (удалены, переименованы, сменился образ ФС).
+ * Иначе их записи навсегда занимают таблицу и blob, а новым файлам места не остается.
+ * Берет asset_read_begin: вызывать, не держа индекс и не под s_mux */
+static void prune(void) {
+    uint32_t keys[HITSTATS_MAX];
+    uint32_t live[ASSET_MAX];
+    // Сначала снимок ключей: файл, добавленный в индекс после него, не примем за удаленный
+    int key_count = 0;
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < HITSTATS_SLOTS && key_count < HITSTATS_MAX; i++) {
+        if (s_records[i].key) keys[key_count++] = s_records[i].key;
+    }
+    portEXIT_CRITICAL(&s_mux);
+
+    int live_count = 0;
+    asset_read_begin();
+    for (int i = 0; i < asset_count() && live_count < ASSET_MAX; i++) {
+        live[live_count++] = name_key(asset_at(i)->name);
+    }
+    asset_read_end();
+
+    // Сравниваем вне критической секции, под ней только удаляем
+    int n = 0;
+    for (int i = 0; i < key_count; i++) {
+        bool found = false;
+        for (int j = 0; j < live_count && !found; j++) found = live[j] == keys[i];
+        if (!found) keys[n++] = keys[i];
+    }
+    if (!n) return;
+
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < n; i++) {
+        hit_record_t *r = find_record(keys[i], false);
+        if (r) remove_record(r);
+    }
+    portEXIT_CRITICAL(&s_mux);
+    ESP_LOGI(TAG, "Pruned stats for %d removed assets", n);
+}
+
+static void load(void) {
+    nvs_handle_t nvs;
+    if (nvs_open(HITSTATS_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return;
+
+    static hit_record_t saved[HITSTATS_MAX];
+    size_t len = sizeof(saved);
+    esp_err_t err = nvs_get_blob(nvs, HITSTATS_NVS_KEY, saved, &len);
+    nvs_close(nvs);
+    if (err != ESP_OK) return;
+
+    // Статистика по файлам прошлых сборок не нужна: оставляем только то, что есть в индексе.
+    // Индекс меняется загрузками, поэтому обходим его под чтением
+    asset_read_begin();
+    for (int i = 0; i < asset_count(); i++) {
+        uint32_t key = name_key(asset_at(i)->name);
+        for (size_t j = 0; j < len / sizeof(hit_record_t); j++) {
+            if (saved[j].key != key) continue;
+            hit_record_t *r = find_record(key, true);
+            if (r) *r = saved[j];
+            break;
+        }
+    }
+    asset_read_end();
+    ESP_LOGI(TAG, "Loaded stats for %d assets", s_record_count);
+}
+
+static void save(void) {
+    static hit_record_t snapshot[HITSTATS_MAX];
+    size_t count = 0;
+    prune();
+    portENTER_CRITICAL(&s_mux);
+    for (int i = 0; i < HITSTATS_SLOTS && count < HITSTATS_MAX; i++) {
+        if (s_records[i].key) snapshot[count++] = s_records[i];
+    }
+    s_unsaved_hits = 0;
+    portEXIT_CRITICAL(&s_mux);
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(HITSTATS_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, HITSTATS_NVS_KEY, snapshot, count * sizeof(hit_record_t));
+        if (err == ESP_OK) err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to save stats (%s)", esp_err_to_name(err));
+        return;
+    }
+    s_saves++;
+    s_last_save_us = esp_timer_get_time();
+}
+
+static void persist_task(void *pv) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(HITSTATS_PERSIST_INTERVAL_S * 1000));
+        if (s_unsaved_hits >= HITSTATS_PERSIST_MIN_HITS) save();
+    }
+}
+
+void hitstats_init(void) {
+    load();
+    xTaskCreate(persist_task, "hitstats", HITSTATS_TASK_STACK, NULL, 1, NULL);
+}
+
+/* Прибавляем обращение. false - для файла нет места в таблице */
+static bool add_hit(uint32_t key, size_t bytes) {
+    portENTER_CRITICAL(&s_mux);
+    hit_record_t *r = find_record(key, true);
+    if (r) {
+        r->hits++;
+        r->bytes += bytes;
+        s_unsaved_hits++;
+    }
+    portEXIT_CRITICAL(&s_mux);
+    return r != NULL;
+}
+
+void hitstats_record(const asset_t *asset, size_t bytes) {
+    uint32_t key = name_key(asset->name);
+    if (add_hit(key, bytes)) return;
+    // В индексе не больше HITSTATS_MAX файлов: таблица полна, только если в ней остались удаленные
+    prune();
+    add_hit(key, bytes);
+}
+
+/* Обращения к файлу (0, если не обращались) */
+static uint32_t asset_hits(const asset_t *asset) {
+    uint32_t hits = 0;
+    portENTER_CRITICAL(&s_mux);
+    hit_record_t *r = find_record(name_key(asset->name), false);
+    if (r) hits = r->hits;
+    portEXIT_CRITICAL(&s_mux);
+    return hits;
+}
+
+int hitstats_ranked(const asset_t **out, int max) {
+    static uint32_t ranked_hits[HITSTATS_MAX];
+    if (max > HITSTATS_MAX) max = HITSTATS_MAX;
+    int n = 0;
+    // Вставкой: файлов немного, а вызывается это раз при старте
+    asset_read_begin();
+    for (int i = 0; i < asset_count(); i++) {
+        const asset_t *asset = asset_at(i);
+        uint32_t hits = asset_hits(asset);
+        if (!hits || (n == max && ranked_hits[n - 1] >= hits)) continue;
+        int j = n < max ? n++ : n - 1;
+        while (j > 0 && ranked_hits[j - 1] < hits) {
+            out[j] = out[j - 1];
+            ranked_hits[j] = ranked_hits[j - 1];
+            j--;
+        }
+        out[j] = asset;
+        ranked_hits[j] = hits;
+    }
+    asset_read_end();
+    return n;
+}
+
+size_t hitstats_render_json(char *buf, size_t buflen) {
+    if (!buf || buflen == 0) return 0;
+    size_t pos = 0;
+    strbuf_appendf(buf, buflen, &pos, "{\"saves\":%u,\"last_save_ms\":%lld,\"unsaved_hits\":%u,\"assets\":[",
+           (unsigned)s_saves, (long long)(s_last_save_us / 1000), (unsigned)s_unsaved_hits);
+    bool first = true;
+    asset_read_begin();
+    for (int i = 0; i < asset_count(); i++) {
+        const asset_t *asset = asset_at(i);
+        hit_record_t rec = {};
+        portENTER_CRITICAL(&s_mux);
+        hit_record_t *r = find_record(name_key(asset->name), false);
+        if (r) rec = *r;
+        portEXIT_CRITICAL(&s_mux);
+        if (!rec.hits) continue;
+        strbuf_appendf(buf, buflen, &pos, "%s{\"path\":\"/", first ? "" : ",");
+        strbuf_append_json(buf, buflen, &pos, asset->name);
+        strbuf_appendf(buf, buflen, &pos, "\",\"hits\":%u,\"bytes\":%u}", (unsigned)rec.hits, (unsigned)rec.bytes);
+        first = false;
+    }
+    asset_read_end();
+    strbuf_appendf(buf, buflen, &pos, "]}");
+    return pos;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "assets.h"
+
+/* URL статистики обращений */
+#define HITSTATS_PATH "/_stats"
+
+#define HITSTATS_NVS_NAMESPACE "hitstats"
+#define HITSTATS_NVS_KEY "hits"
+/* Слоты хеш-таблицы (степень двойки) и сколько файлов в ней помним. Записи удаленных файлов
+ * убираются перед сохранением, так что хватает по записи на файл индекса (ASSET_MAX) */
+#define HITSTATS_SLOTS 128
+#define HITSTATS_MAX 64
+/* Пишем в NVS не чаще раза в интервал и только если набралось достаточно новых обращений:
+ * один blob за раз, чтобы не изнашивать flash */
+#define HITSTATS_PERSIST_INTERVAL_S 600
+#define HITSTATS_PERSIST_MIN_HITS 20
+#define HITSTATS_TASK_STACK 3072
+
+/* Загружаем статистику из NVS, отбрасываем файлы, которых больше нет в индексе,
+ * и запускаем периодическое сохранение. Индекс файлов должен быть уже построен */
+void hitstats_init(void);
+
+/* Учитываем отданный файл. Если таблица заполнена, сначала забываем файлы, которых нет в индексе
+ * (берет asset_read_begin): вызывать, не держа индекс */
+void hitstats_record(const asset_t *asset, size_t bytes);
+
+/* До `max` файлов индекса в порядке убывания обращений, без файлов, к которым не обращались.
+ * Индекс обходится под asset_read_begin: вызывать, не держа его */
+int hitstats_ranked(const asset_t **out, int max);
+
+/* JSON со статистикой по файлам. Возвращает длину строки */
+size_t hitstats_render_json(char *buf, size_t buflen);
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Время ответа: от разобранного запроса до последнего байта */
+typedef struct {
+    uint32_t samples;
+    uint64_t total_us;
+    uint32_t max_us;
+} http_latency_t;
+
+typedef struct {
+    uint32_t ipv4_clients;      // принятые соединения по IPv4 (в том числе через двойной стек)
+    uint32_t ipv6_clients;
+    uint32_t accept_errors;
+    uint32_t shed;              // получили 503 сразу после accept: не хватило контекстов соединений
+    uint32_t queue_sheds;       // получили 503, прождав воркера дольше HTTP_QUEUE_DEADLINE_MS
+    uint32_t requests;
+    uint32_t keepalive_reuses;  // запросы по уже открытому соединению
+    uint32_t client_closes;     // клиент закрыл первым, TIME_WAIT у него
+    uint32_t idle_timeouts;     // keep-alive соединение простаивало слишком долго
+    uint32_t idle_yields;       // простаивающее keep-alive соединение закрыто ради клиента в очереди
+    uint32_t drain_timeouts;    // после "Connection: close" клиент так и не закрыл
+    uint32_t resets;            // закрыто через tcp_abort без TIME_WAIT (только netconn)
+    // Ответы на чтение (без загрузок): обычные и пока пишется образ файлов или прошивка
+    http_latency_t latency;
+    http_latency_t latency_update;
+    // Состояние стека lwIP на момент запроса
+    uint16_t tcp_active;
+    uint16_t tcp_time_wait;
+    uint16_t tcp_pcb_max;       // MEMP_NUM_TCP_PCB
+} http_server_stats_t;
+
+void http_server_get_stats(http_server_stats_t *stats);
+
+/* Сколько ответов на чтение (все запросы, кроме PUT и POST) отправляется прямо сейчас */
+uint32_t http_server_active_responses(void);
@@ -0,0 +1,215 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "http_writer.h"
+
+static_assert(HTTP_WRITER_SEGMENT <= 0xffffff, "chunk size must fit the prefix");
+
+static http_writer_stats_t s_stats;
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+#define STAT_ADD(field, n) do { portENTER_CRITICAL(&s_stats_mux); s_stats.field += (n); portEXIT_CRITICAL(&s_stats_mux); } while (0)
+
+static const char s_crlf[] = "\r\n";
+static const char s_last_chunk[] = "0\r\n\r\n";
+
+static esp_err_t fail(http_writer_t *w) {
+    w->state = HTTP_WRITER_FAILED;
+    w->keep_alive = false;
+    return ESP_FAIL;
+}
+
+/* Отправляем накопленное. Открытый чанк закрываем: префикс с его длиной встает в
+ * зарезервированное место, заголовки перед ним сдвигаются к префиксу. `last` - ответ
+ * на этом заканчивается, для chunked следом идет последний чанк */
+static bool flush(http_writer_t *w, bool last) {
+    size_t start = 0;
+    size_t end = w->fill;
+    if (w->chunk >= 0) {
+        size_t len = w->fill - w->chunk - HTTP_WRITER_CHUNK_PREFIX;
+        if (len == 0) {
+            // Пустой чанк означал бы конец тела
+            end = w->chunk;
+        } else {
+            char prefix[HTTP_WRITER_CHUNK_PREFIX + 1];
+            int n = snprintf(prefix, sizeof(prefix), "%x\r\n", (unsigned)len);
+            start = HTTP_WRITER_CHUNK_PREFIX - n;
+            memmove(w->seg + start, w->seg, w->chunk);
+            memcpy(w->seg + w->chunk + start, prefix, n);
+            memcpy(w->seg + end, s_crlf, 2);
+            end += 2;
+        }
+        w->chunk = -1;
+    }
+    if (last && w->mode == HTTP_BODY_CHUNKED) {
+        memcpy(w->seg + end, s_last_chunk, sizeof(s_last_chunk) - 1);
+        end += sizeof(s_last_chunk) - 1;
+    }
+    w->fill = 0;
+    if (end == start) return true;
+    STAT_ADD(segments, 1);
+    return transport_send(w->tc, w->seg + start, end - start, false, !last);
+}
+
+/* Кусок тела мимо буфера, в chunked - отдельным чанком */
+static bool send_direct(http_writer_t *w, const void *data, size_t len, bool stable) {
+    STAT_ADD(direct, 1);
+    bool more = w->mode != HTTP_BODY_FIXED || w->remaining > 0;
+    if (w->mode != HTTP_BODY_CHUNKED) return transport_send(w->tc, data, len, stable, more);
+    char prefix[16];
+    int n = snprintf(prefix, sizeof(prefix), "%x\r\n", (unsigned)len);
+    return transport_send(w->tc, prefix, n, false, true) && transport_send(w->tc, data, len, stable, true) &&
+           transport_send(w->tc, s_crlf, 2, true, true);
+}
+
+/* Сколько тела еще влезает в сегмент. В chunked место под префикс резервируется
+ * при первой записи в чанк; 0 - сегмент пора отправить */
+static size_t body_room(http_writer_t *w) {
+    if (w->mode == HTTP_BODY_CHUNKED && w->chunk < 0) {
+        if (w->fill + HTTP_WRITER_CHUNK_PREFIX >= HTTP_WRITER_SEGMENT) return 0;
+        w->chunk = w->fill;
+        w->fill += HTTP_WRITER_CHUNK_PREFIX;
+    }
+    return HTTP_WRITER_SEGMENT - w->fill;
+}
+
+void http_writer_init(http_writer_t *w, transport_conn_t *tc, uint8_t *seg) {
+    memset(w, 0, sizeof(*w));
+    w->tc = tc;
+    w->seg = seg;
+    w->chunk = -1;
+    w->state = HTTP_WRITER_DONE;
+}
+
+void http_writer_begin(http_writer_t *w, bool keep_alive, bool chunked_ok) {
+    w->fill = 0;
+    w->chunk = -1;
+    w->state = HTTP_WRITER_HEAD;
+    w->mode = HTTP_BODY_NONE;
+    w->remaining = 0;
+    w->keep_alive = keep_alive;
+    w->chunked_ok = chunked_ok;
+}
+
+esp_err_t http_writer_head(http_writer_t *w, const char *data, size_t len) {
+    if (w->state != HTTP_WRITER_HEAD) {
+        if (w->state == HTTP_WRITER_BODY) STAT_ADD(rejected, 1);
+        return ESP_ERR_INVALID_STATE;
+    }
+    // Заголовки ждут в сегменте начала тела, чтобы уйти с ним одним пакетом
+    if (w->seg && w->fill + len > HTTP_WRITER_SEGMENT && !flush(w, false)) return fail(w);
+    if (w->seg && len <= HTTP_WRITER_SEGMENT) {
+        memcpy(w->seg + w->fill, data, len);
+        w->fill += len;
+        return ESP_OK;
+    }
+    return transport_send(w->tc, data, len, false, true) ? ESP_OK : fail(w);
+}
+
+esp_err_t http_writer_headerf(http_writer_t *w, const char *fmt, ...) {
+    char line[192];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= sizeof(line)) return ESP_ERR_INVALID_SIZE;
+    return http_writer_head(w, line, n);
+}
+
+esp_err_t http_writer_body(http_writer_t *w, http_body_mode_t mode, size_t length) {
+    if (w->state != HTTP_WRITER_HEAD) return ESP_ERR_INVALID_STATE;
+    if (mode == HTTP_BODY_CHUNKED && !w->chunked_ok) mode = HTTP_BODY_UNTIL_CLOSE;
+    if (mode == HTTP_BODY_UNTIL_CLOSE) w->keep_alive = false;
+
+    const char *connection = w->keep_alive ? "keep-alive" : "close";
+    esp_err_t err;
+    if (mode == HTTP_BODY_FIXED) {
+        err = http_writer_headerf(w, "Content-Length: %u\r\nConnection: %s\r\n\r\n", (unsigned)length, connection);
+    } else if (mode == HTTP_BODY_CHUNKED) {
+        err = http_writer_headerf(w, "Transfer-Encoding: chunked\r\nConnection: %s\r\n\r\n", connection);
+    } else {
+        err = http_writer_headerf(w, "Connection: %s\r\n\r\n", connection);
+    }
+    if (err != ESP_OK) return err;
+
+    w->state = HTTP_WRITER_BODY;
+    w->mode = mode;
+    w->remaining = mode == HTTP_BODY_FIXED ? length : 0;
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.responses++;
+    if (mode == HTTP_BODY_CHUNKED) s_stats.chunked++;
+    if (mode == HTTP_BODY_UNTIL_CLOSE) s_stats.until_close++;
+    portEXIT_CRITICAL(&s_stats_mux);
+    return ESP_OK;
+}
+
+esp_err_t http_writer_write(http_writer_t *w, const void *data, size_t len, bool stable) {
+    if (w->state != HTTP_WRITER_BODY) return w->state == HTTP_WRITER_FAILED ? ESP_FAIL : ESP_ERR_INVALID_STATE;
+    if (len == 0) return ESP_OK;
+    if (w->mode == HTTP_BODY_NONE) return ESP_ERR_INVALID_SIZE;
+    if (w->mode == HTTP_BODY_FIXED) {
+        if (len > w->remaining) {
+            // Лишние байты клиент принял бы за начало следующего ответа
+            STAT_ADD(rejected, 1);
+            fail(w);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        w->remaining -= len;
+    }
+    STAT_ADD(body_bytes, len);
+
+    const uint8_t *p = (const uint8_t *)data;
+    if (!w->seg) return send_direct(w, p, len, stable) ? ESP_OK : fail(w);
+    // Стабильный буфер отдаем стеку как есть, накопленное уходит перед ним
+    if (stable && len >= HTTP_WRITER_NOCOPY_MIN && transport_zero_copy(w->tc)) {
+        return flush(w, false) && send_direct(w, p, len, true) ? ESP_OK : fail(w);
+    }
+    while (len) {
+        // Сегмент пуст, а кусок не меньше сегмента: копировать его незачем
+        if (w->fill == 0 && len >= HTTP_WRITER_SEGMENT) return send_direct(w, p, len, stable) ? ESP_OK : fail(w);
+        size_t room = body_room(w);
+        if (room == 0) {
+            if (!flush(w, false)) return fail(w);
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(w->seg + w->fill, p, n);
+        w->fill += n;
+        p += n;
+        len -= n;
+    }
+    return ESP_OK;
+}
+
+esp_err_t http_writer_finish(http_writer_t *w) {
+    if (w->state != HTTP_WRITER_BODY) return w->state == HTTP_WRITER_FAILED ? ESP_FAIL : ESP_ERR_INVALID_STATE;
+    if (w->mode == HTTP_BODY_FIXED && w->remaining) {
+        // Клиент ждал бы недостающие байты до таймаута
+        http_writer_abort(w);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    bool ok;
+    if (w->seg) {
+        ok = flush(w, true);
+    } else {
+        ok = w->mode != HTTP_BODY_CHUNKED || transport_send(w->tc, s_last_chunk, sizeof(s_last_chunk) - 1, true, false);
+    }
+    if (!ok) return fail(w);
+    w->state = HTTP_WRITER_DONE;
+    return ESP_OK;
+}
+
+void http_writer_abort(http_writer_t *w) {
+    w->fill = 0;
+    w->chunk = -1;
+    w->state = HTTP_WRITER_FAILED;
+    w->keep_alive = false;
+}
+
+void http_writer_get_stats(http_writer_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
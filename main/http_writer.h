@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#include "transport.h"
+
+/* Запись HTTP-ответа: заголовки и тело фиксированной длины или чанками.
+ * Мелкие записи копятся в буфере и уходят сегментами размером с TCP MSS */
+#define HTTP_WRITER_SEGMENT CONFIG_LWIP_TCP_MSS
+/* Место под префикс чанка "<hex>\r\n" перед данными сегмента */
+#define HTTP_WRITER_CHUNK_PREFIX 8
+/* Буфер сегмента: данные и хвост "\r\n" чанка вместе с последним чанком "0\r\n\r\n" */
+#define HTTP_WRITER_BUF_LEN (HTTP_WRITER_SEGMENT + 7)
+/* Стабильные буферы (см. transport_send) от этого размера уходят без копии в сегмент */
+#define HTTP_WRITER_NOCOPY_MIN 256
+
+typedef enum {
+    HTTP_BODY_NONE,         // тела нет: 304
+    HTTP_BODY_FIXED,        // Content-Length
+    HTTP_BODY_CHUNKED,      // Transfer-Encoding: chunked, длина заранее неизвестна
+    HTTP_BODY_UNTIL_CLOSE,  // клиент HTTP/1.0 без chunked: тело до закрытия соединения
+} http_body_mode_t;
+
+typedef enum {
+    HTTP_WRITER_HEAD,
+    HTTP_WRITER_BODY,
+    HTTP_WRITER_DONE,
+    HTTP_WRITER_FAILED,
+} http_writer_state_t;
+
+typedef struct {
+    transport_conn_t *tc;
+    uint8_t *seg;           // HTTP_WRITER_BUF_LEN байт или NULL: тогда каждая запись уходит сразу
+    size_t fill;
+    int chunk;              // смещение префикса открытого чанка в seg, -1 - чанка нет
+    http_writer_state_t state;
+    http_body_mode_t mode;
+    size_t remaining;       // HTTP_BODY_FIXED: сколько байт тела еще должно прийти
+    bool keep_alive;        // после ответа соединение годится для следующего запроса
+    bool chunked_ok;        // HTTP/1.1: клиент понимает chunked
+} http_writer_t;
+
+typedef struct {
+    uint32_t responses;
+    uint32_t chunked;       // из них чанками
+    uint32_t until_close;   // из них до закрытия соединения
+    uint32_t segments;      // отправлено сегментов из буфера
+    uint32_t direct;        // записей, ушедших мимо буфера
+    uint32_t rejected;      // заголовки после начала тела и тело длиннее Content-Length
+    uint64_t body_bytes;
+} http_writer_stats_t;
+
+/* Один раз на соединение. `seg` - буфер сегмента на все ответы соединения */
+void http_writer_init(http_writer_t *w, transport_conn_t *tc, uint8_t *seg);
+
+/* Новый ответ на запрос */
+void http_writer_begin(http_writer_t *w, bool keep_alive, bool chunked_ok);
+
+/* Строки заголовков с CRLF, первой - статусная строка. Заголовок после начала тела был бы
+ * trailer: их мы не отправляем (клиент о них не просил), ответ не портится, ESP_ERR_INVALID_STATE */
+esp_err_t http_writer_head(http_writer_t *w, const char *data, size_t len);
+esp_err_t http_writer_headerf(http_writer_t *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Заканчиваем заголовки: длина тела (Content-Length или chunked), Connection и пустая строка.
+ * Клиенту без chunked тело неизвестной длины уходит до закрытия соединения */
+esp_err_t http_writer_body(http_writer_t *w, http_body_mode_t mode, size_t length);
+
+/* Кусок тела. `stable` - см. transport_send. Больше объявленной длины - ESP_ERR_INVALID_SIZE */
+esp_err_t http_writer_write(http_writer_t *w, const void *data, size_t len, bool stable);
+
+/* Отправляем остаток и последний чанк. Тело короче Content-Length - ESP_ERR_INVALID_SIZE */
+esp_err_t http_writer_finish(http_writer_t *w);
+
+/* Тело дописать не получится: накопленное выбрасываем, соединение закрывается после ответа */
+void http_writer_abort(http_writer_t *w);
+
+void http_writer_get_stats(http_writer_stats_t *stats);
@@ -0,0 +1,113 @@
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+#include "inflate_stream.h"
+
+/* Флаги заголовка gzip (RFC 1952) */
+#define GZ_FHCRC    0x02
+#define GZ_FEXTRA   0x04
+#define GZ_FNAME    0x08
+#define GZ_FCOMMENT 0x10
+
+static inflate_stream_stats_t s_stats;
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Длина заголовка gzip в начале `in` или 0, если он не gzip или не уместился */
+static size_t gzip_header_len(const uint8_t *in, size_t len) {
+    if (len < 10 || in[0] != 0x1f || in[1] != 0x8b || in[2] != 8) return 0;
+    uint8_t flags = in[3];
+    size_t pos = 10;
+    if (flags & GZ_FEXTRA) {
+        if (pos + 2 > len) return 0;
+        pos += 2 + (in[pos] | (in[pos + 1] << 8));
+    }
+    if (flags & GZ_FNAME) {
+        const uint8_t *end = pos < len ? (const uint8_t *)memchr(in + pos, 0, len - pos) : NULL;
+        if (!end) return 0;
+        pos = end - in + 1;
+    }
+    if (flags & GZ_FCOMMENT) {
+        const uint8_t *end = pos < len ? (const uint8_t *)memchr(in + pos, 0, len - pos) : NULL;
+        if (!end) return 0;
+        pos = end - in + 1;
+    }
+    if (flags & GZ_FHCRC) pos += 2;
+    return pos <= len ? pos : 0;
+}
+
+void inflate_stream_begin(inflate_stream_t *z) {
+    tinfl_init(&z->decomp);
+    z->dict_ofs = 0;
+    z->header_done = false;
+    z->done = false;
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.streams++;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
+
+/* Разворачиваем `len` байт deflate, вывод отдаем в `emit`. В `*produced` - сколько отдали */
+static esp_err_t inflate_chunk(inflate_stream_t *z, const uint8_t *in, size_t len,
+                               inflate_emit_t emit, void *arg, size_t *produced) {
+    // Окно кольцевое: tinfl пишет в dict с dict_ofs до конца, отдаем и продолжаем с начала
+    while (!z->done) {
+        size_t in_bytes = len;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - z->dict_ofs;
+        tinfl_status status = tinfl_decompress(&z->decomp, in, &in_bytes, z->dict, z->dict + z->dict_ofs,
+                                               &out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+        in += in_bytes;
+        len -= in_bytes;
+        if (out_bytes) {
+            *produced += out_bytes;
+            if (!emit(arg, z->dict + z->dict_ofs, out_bytes)) return ESP_FAIL;
+            z->dict_ofs = (z->dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+        if (status == TINFL_STATUS_DONE) {
+            // Остаток входа - CRC и размер из хвоста gzip
+            z->done = true;
+        } else if (status < 0) {
+            return ESP_ERR_INVALID_RESPONSE;
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+            break;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t inflate_stream_write(inflate_stream_t *z, const uint8_t *in, size_t len, inflate_emit_t emit, void *arg) {
+    int64_t t0 = esp_timer_get_time();
+    size_t in_len = len;
+    size_t produced = 0;
+    esp_err_t ret = ESP_OK;
+
+    if (!z->header_done) {
+        size_t header = gzip_header_len(in, len);
+        if (header) {
+            in += header;
+            len -= header;
+            z->header_done = true;
+        } else {
+            ret = ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    if (ret == ESP_OK) ret = inflate_chunk(z, in, len, emit, arg, &produced);
+
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.bytes_in += in_len;
+    s_stats.bytes_out += produced;
+    s_stats.inflate_us += esp_timer_get_time() - t0;
+    if (ret == ESP_ERR_INVALID_RESPONSE) s_stats.errors++;
+    portEXIT_CRITICAL(&s_stats_mux);
+    return ret;
+}
+
+bool inflate_stream_done(const inflate_stream_t *z) {
+    return z->done;
+}
+
+void inflate_stream_get_stats(inflate_stream_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
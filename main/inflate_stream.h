@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+#include "rom/miniz.h"
+
+/* Распаковка .gz на лету для клиентов без Accept-Encoding: gzip. Декодер tinfl из ROM,
+ * окно фиксированное - 32 КБ, как у gzip. Вместе с состоянием декодера ~43 КБ на поток */
+
+/* Куда уходят распакованные данные. false - прервать распаковку */
+typedef bool (*inflate_emit_t)(void *arg, const uint8_t *data, size_t len);
+
+typedef struct {
+    tinfl_decompressor decomp;
+    uint8_t dict[TINFL_LZ_DICT_SIZE];   // окно и одновременно буфер вывода
+    size_t dict_ofs;
+    bool header_done;
+    bool done;                          // дошли до конца deflate, дальше только хвост gzip
+} inflate_stream_t;
+
+typedef struct {
+    uint32_t streams;
+    uint32_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t inflate_us;
+} inflate_stream_stats_t;
+
+void inflate_stream_begin(inflate_stream_t *z);
+
+/* Подаем очередной кусок файла .gz. Заголовок gzip должен целиком прийти в первом куске.
+ * ESP_ERR_INVALID_RESPONSE - файл поврежден или это не gzip, ESP_FAIL - emit прервал распаковку */
+esp_err_t inflate_stream_write(inflate_stream_t *z, const uint8_t *in, size_t len, inflate_emit_t emit, void *arg);
+
+/* Поток дошел до конца данных deflate */
+bool inflate_stream_done(const inflate_stream_t *z);
+
+void inflate_stream_get_stats(inflate_stream_stats_t *stats);
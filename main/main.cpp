@@ -1,4 +1,5 @@
 #include <string.h>
+#include <stdlib.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -11,45 +12,168 @@
 #include "esp_system.h"
 #include "esp_vfs.h"
 #include "esp_spiffs.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "lwip/priv/tcpip_priv.h"
+#include "lwip/priv/tcp_priv.h"
 
 #include "wifi.h"
+#include "diag.h"
+#include "assets.h"
+#include "file_pool.h"
+#include "cache.h"
+#include "warmup.h"
+#include "hitstats.h"
+#include "boot.h"
+#include "embedded.h"
+#include "wifi_ps.h"
+#include "http_server.h"
+#include "transport.h"
+#include "mem_pool.h"
+#include "gzip_stream.h"
+#include "inflate_stream.h"
+#include "http_writer.h"
+#include "upload.h"
+#include "multipart.h"
+#include "asset_image.h"
+#include "firmware.h"
+#include "websocket.h"
+#include "strbuf.h"
 
 static const char *TAG = "http_server";
 
+/* Принятое соединение */
+typedef struct {
+    transport_conn_t conn;
+    int64_t accepted_us;
+    wifi_ps_type_t ps_mode;  // режим сна модема на момент accept
+} client_t;
+
+/* Сжатие тела на лету: компрессор и буфер под один его вывод. В чанки вывод собирает http_writer */
+typedef struct {
+    gzip_stream_t z;
+    uint8_t out[GZIP_STREAM_OUT_MAX];
+} gzip_ctx_t;
+
+/* Соединение, на которое отвечает воркер */
+typedef struct {
+    transport_conn_t *tc;
+    http_writer_t w;    // ответ на текущий запрос; w.keep_alive - ждем ли следующий
+    bool accepts_gzip;  // Accept-Encoding текущего запроса
+    gzip_ctx_t *gz;     // тело ответа идет через компрессор
+    inflate_stream_t *inflate;  // тело ответа - файл .gz, который распаковывается
+    bool detached;      // соединение забрал WebSocket: не закрываем
+    uint32_t lent;      // записи кеша, отданные стеку без копии (cache_lend)
+} http_conn_t;
+
+/* Принятые соединения (client_t *), ожидающие свободного воркера */
+static QueueHandle_t s_client_queue;
+
+/* Все, что нужно соединению, берется из пулов, выделенных при старте */
+static mem_pool_t s_conn_pool;
+static mem_pool_t s_recv_pool;
+static mem_pool_t s_chunk_pool;
+static mem_pool_t s_segment_pool;
+static mem_pool_t s_json_pool;
+static mem_pool_t s_gzip_pool;
+static mem_pool_t s_inflate_pool;
+
+static http_server_stats_t s_stats;
+/* Счетчики пишут все воркеры */
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+#define STAT_INC(field) do { portENTER_CRITICAL(&s_stats_mux); s_stats.field++; portEXIT_CRITICAL(&s_stats_mux); } while (0)
+/* Ответов на чтение, которые воркеры отправляют прямо сейчас. Под s_stats_mux */
+static uint32_t s_active_responses = 0;
+
+/* Слушатель на своем порту и транспорте и запрос на его пересоздание после смены IP */
+typedef struct {
+    transport_kind_t kind;
+    uint16_t port;
+    transport_listener_t listener;
+    volatile bool ready;
+    volatile bool rebind;
+} http_listener_t;
+
 /* Настройки SPIFFS */
 #define SPIFFS_BASE_PATH "/spiffs"
 #define FALLBACK_PATH "/spiffs/index.html"
-#define SPIFFS_PART_LABEL NULL
 #define SPIFFS_MAX_FILES 5
 #define SPIFFS_FORMAT_IF_MOUNT_FAILED true
 
 /* HTTP */
 #define SERVER_PORT 80
+/* Транспорт основного порта */
+#define HTTP_TRANSPORT TRANSPORT_SOCKET
+/* На этом порту тот же сервер работает через второй транспорт, для сравнения
+ * пропускной способности в /_diag. Задается в menuconfig, по умолчанию 0 - не поднимать */
+#ifdef CONFIG_HTTP_COMPARE_PORT
+#define HTTP_COMPARE_PORT CONFIG_HTTP_COMPARE_PORT
+#else
+#define HTTP_COMPARE_PORT 0
+#endif
 #define RECV_BUF_LEN 1024
 #define SEND_BUF_LEN 1024
 #define FILE_CHUNK 1024
-
-/* Возвращаем mime по расширению */
-static const char * get_mime_type(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return "application/octet-stream";
-    ext++; // skip '.'
-    if (strcasecmp(ext, "html") == 0) return "text/html; charset=utf-8";
-    if (strcasecmp(ext, "htm") == 0) return "text/html; charset=utf-8";
-    if (strcasecmp(ext, "css") == 0) return "text/css";
-    if (strcasecmp(ext, "js") == 0) return "application/javascript";
-    if (strcasecmp(ext, "json") == 0) return "application/json";
-    if (strcasecmp(ext, "png") == 0) return "image/png";
-    if (strcasecmp(ext, "jpg") == 0) return "image/jpeg";
-    if (strcasecmp(ext, "jpeg") == 0) return "image/jpeg";
-    if (strcasecmp(ext, "gif") == 0) return "image/gif";
-    if (strcasecmp(ext, "svg") == 0) return "image/svg+xml";
-    if (strcasecmp(ext, "ico") == 0) return "image/x-icon";
-    if (strcasecmp(ext, "txt") == 0) return "text/plain; charset=utf-8";
-    return "application/octet-stream";
-}
+#define DIAG_BUF_LEN 7168
+/* Сколько запрос ждет монтирования SPIFFS, прежде чем получить 503 */
+#define FS_WAIT_MS 10000
+#define SERVER_TASK_STACK 4096
+#define WORKER_TASK_STACK 8192
+#define BOOT_STAGE_STACK 4096
+#define HTTP_WORKER_COUNT 4
+/* Размеры пулов. Контекст соединения маленький, поэтому их столько же, сколько сокетов:
+ * браузер открывает до 6 соединений, и несколько клиентов сразу не должны получать 503.
+ * Все принятые соединения помещаются в очередь. Буферы нужны только воркерам */
+#define CONN_POOL_SIZE CONFIG_LWIP_MAX_SOCKETS
+#define CLIENT_QUEUE_LEN CONN_POOL_SIZE
+/* Соединение ждало воркера дольше: сервер действительно перегружен, отвечаем 503 */
+#define HTTP_QUEUE_DEADLINE_MS 3000
+#define RECV_POOL_SIZE HTTP_WORKER_COUNT
+#define CHUNK_POOL_SIZE HTTP_WORKER_COUNT
+#define SEGMENT_POOL_SIZE HTTP_WORKER_COUNT
+#define JSON_POOL_SIZE 1
+/* Сжатие на лету тяжелое по CPU и памяти: один поток за раз, остальные отдаются как есть */
+#define GZIP_POOL_SIZE 1
+/* Распаковка нужна редким клиентам без gzip, но окно 32 КБ: один поток, по возможности в PSRAM */
+#define INFLATE_POOL_SIZE 1
+#ifdef CONFIG_SPIRAM
+#define INFLATE_POOL_CAPS MALLOC_CAP_SPIRAM
+#else
+#define INFLATE_POOL_CAPS POOL_CAPS
+#endif
+#define POOL_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+/* Закрытие соединений. Кто первым закрывает TCP, тот держит TIME_WAIT, а в lwIP
+ * это занятый PCB из MEMP_NUM_TCP_PCB. Поэтому первым закрывать должен клиент */
+#define HTTP_KEEPALIVE_MS 5000   // сколько держим простаивающее keep-alive соединение
+#define HTTP_IDLE_SLICE_MS 100   // отрезок ожидания, после которого проверяем очередь клиентов
+#define HTTP_KEEPALIVE_MAX 32    // запросов на одно соединение
+#define HTTP_DRAIN_MS 2000       // сколько после "Connection: close" ждем FIN от клиента
+#define HTTP_DISCARD_MAX 8192    // тело запроса без обработчика: столько дочитываем и выбрасываем
+/* Не дождались клиента: закрываем через RST, TIME_WAIT не остается. netconn делает
+ * tcp_abort всегда, сокеты (SO_LINGER 0, нужен CONFIG_LWIP_SO_LINGER) - только если
+ * клиент не дочитал ответ. Поэтому на сокетах простаивающее соединение (таймаут keep-alive
+ * или уступка воркера) закрывается с FIN и оставляет TIME_WAIT у нас. С 0 - так всегда */
+#define HTTP_LINGER_RESET 1
+/* Загрузка файлов через PUT и multipart POST, удаление и образ раздела. Включается в menuconfig,
+ * запросы проверяются по токену CONFIG_HTTP_UPLOAD_TOKEN (см. Kconfig.projbuild) */
+#if CONFIG_HTTP_UPLOAD
+#define HTTP_UPLOAD 1
+#define HTTP_UPLOAD_TOKEN CONFIG_HTTP_UPLOAD_TOKEN
+#else
+#define HTTP_UPLOAD 0
+#endif
+/* PUT и DELETE /_firmware: отдельный выключатель поверх HTTP_UPLOAD, с тем же токеном.
+ * Выключен - по этому пути 404 */
+#if CONFIG_HTTP_FIRMWARE_UPDATE
+#define HTTP_FIRMWARE_UPDATE 1
+#else
+#define HTTP_FIRMWARE_UPDATE 0
+#endif
+/* Путь -> SHA-256 всех файлов, по нему tools/asset_sync.py выбирает, что загружать */
+#define MANIFEST_PATH "/_manifest"
 
 /* Убираем возможные `../` в пути и возвращаем безопасный путь в `buf` (buflen bytes) */
 static void sanitize_path(const char *req_path, char *buf, size_t buflen) {
@@ -92,183 +216,1310 @@ static void sanitize_path(const char *req_path, char *buf, size_t buflen) {
     snprintf(buf, buflen, "%s/%s", SPIFFS_BASE_PATH, tmp[0] ? tmp : "index.html");
 }
 
-/* Извлекаем path в pathbuf */
-static void parse_request_path(const char *req, char *pathbuf, size_t pathbuflen) {
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Раскодируем %XX на месте: клиенты (и tools/asset_sync.py) кодируют пробелы и не-ASCII в именах.
+ * false - испорченная последовательность или %00, который обрезал бы путь */
+static bool percent_decode(char *path) {
+    char *out = path;
+    for (const char *p = path; *p; p++) {
+        if (*p != '%') {
+            *out++ = *p;
+            continue;
+        }
+        int hi = hex_digit(p[1]);
+        int lo = hi < 0 ? -1 : hex_digit(p[2]);
+        if (lo < 0 || (hi | lo) == 0) return false;
+        *out++ = (char)(hi << 4 | lo);
+        p += 2;
+    }
+    *out = 0;
+    return true;
+}
+
+/* Извлекаем path в pathbuf, уже раскодированный: `..` и `/` в виде %XX ловит sanitize_path.
+ * false - путь не раскодировался */
+static bool parse_request_path(const char *req, char *pathbuf, size_t pathbuflen) {
     // Ожидаем что первая строка: "GET /some/path HTTP/1.1"
     const char *sp1 = strchr(req, ' ');
-    if (!sp1) { strncpy(pathbuf, "/", pathbuflen); return; }
+    if (!sp1) { strncpy(pathbuf, "/", pathbuflen); return true; }
     const char *sp2 = strchr(sp1 + 1, ' ');
-    if (!sp2) { strncpy(pathbuf, "/", pathbuflen); return; }
+    if (!sp2) { strncpy(pathbuf, "/", pathbuflen); return true; }
     size_t len = sp2 - (sp1 + 1);
     if (len >= pathbuflen) len = pathbuflen - 1;
     memcpy(pathbuf, sp1 + 1, len);
     pathbuf[len] = 0;
+    return percent_decode(pathbuf);
+}
+
+/* Тело через компрессор */
+static bool send_gzip(http_conn_t *conn, const void *data, size_t len) {
+    gzip_ctx_t *gz = conn->gz;
+    const uint8_t *p = (const uint8_t *)data;
+    while (len) {
+        size_t n = MIN(len, (size_t)GZIP_STREAM_IN_MAX);
+        size_t out = gzip_stream_write(&gz->z, p, n, gz->out);
+        if (out && http_writer_write(&conn->w, gz->out, out, false) != ESP_OK) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Контекст сжатия из пула. NULL, если занят: тогда ответ идет несжатым */
+static gzip_ctx_t *gzip_acquire(void) {
+    gzip_ctx_t *gz = (gzip_ctx_t *)mem_pool_acquire(&s_gzip_pool);
+    if (!gz) return NULL;
+    gzip_stream_begin(&gz->z);
+    return gz;
+}
+
+/* Закрываем сжатое тело: хвост gzip. `ok` - тело отправлено без ошибок */
+static bool gzip_end(http_conn_t *conn, bool ok) {
+    gzip_ctx_t *gz = conn->gz;
+    if (ok) {
+        size_t out = gzip_stream_finish(&gz->z, gz->out);
+        ok = http_writer_write(&conn->w, gz->out, out, false) == ESP_OK;
+    }
+    conn->gz = NULL;
+    mem_pool_release(&s_gzip_pool, gz);
+    return ok;
+}
+
+static bool emit_inflated(void *arg, const uint8_t *data, size_t len) {
+    http_conn_t *conn = (http_conn_t *)arg;
+    return http_writer_write(&conn->w, data, len, false) == ESP_OK;
+}
+
+/* Закрываем распакованное тело. Весь deflate должен был закончиться вместе с файлом */
+static bool inflate_end(http_conn_t *conn, bool ok) {
+    ok = ok && inflate_stream_done(conn->inflate);
+    mem_pool_release(&s_inflate_pool, conn->inflate);
+    conn->inflate = NULL;
+    return ok;
+}
+
+/* Заголовки собраны: объявляем длину тела. Дальше - send_all и end_body */
+static bool start_body(http_conn_t *conn, http_body_mode_t mode, size_t length) {
+    // Для замера времени от включения до первого ответа
+    if (!boot_done(BOOT_PHASE_FIRST_BYTE)) boot_mark(BOOT_PHASE_FIRST_BYTE);
+    return http_writer_body(&conn->w, mode, length) == ESP_OK;
+}
+
+/* Кусок тела. `stable` - см. transport_send. Если тело сжимается или распаковывается,
+ * данные идут через компрессор или декодер */
+static bool send_all(http_conn_t *conn, const void *data, size_t len, bool stable = false) {
+    // Пока идут данные, модем не должен засыпать
+    wifi_ps_activity();
+    if (conn->gz) return send_gzip(conn, data, len);
+    if (conn->inflate) return inflate_stream_write(conn->inflate, (const uint8_t *)data, len, emit_inflated, conn) == ESP_OK;
+    return http_writer_write(&conn->w, data, len, stable) == ESP_OK;
+}
+
+/* Заканчиваем тело. `ok` - все куски отправлены; иначе ответ оборван и соединение закроется */
+static bool end_body(http_conn_t *conn, bool ok) {
+    if (conn->gz) ok = gzip_end(conn, ok);
+    if (conn->inflate) ok = inflate_end(conn, ok);
+    if (ok) return http_writer_finish(&conn->w) == ESP_OK;
+    http_writer_abort(&conn->w);
+    return false;
+}
+
+/* Отправка ответа с телом из памяти */
+static void send_response(http_conn_t *conn, const char *status, const char *mime, const char *body, size_t body_len) {
+    http_writer_headerf(&conn->w, "HTTP/1.1 %s\r\nContent-Type: %s\r\n", status, mime);
+    // Большой JSON сжимаем на лету
+    gzip_ctx_t *gz = NULL;
+    if (conn->accepts_gzip && conn->w.chunked_ok && gzip_stream_eligible(mime, body_len)) gz = gzip_acquire();
+    bool ok;
+    if (gz) {
+        http_writer_headerf(&conn->w, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+        ok = start_body(conn, HTTP_BODY_CHUNKED, 0);
+        conn->gz = gz;
+    } else {
+        ok = start_body(conn, HTTP_BODY_FIXED, body_len);
+    }
+    end_body(conn, ok && send_all(conn, body, body_len));
 }
 
 /* Отправка error страницы */
-static void send_404(int sock) {
-    const char *body = "<html><body><h1>404 Not Found</h1></body></html>";
-    char header[256];
-    int body_len = strlen(body);
-    int n = snprintf(header, sizeof(header),
-                     "HTTP/1.1 404 Not Found\r\n"
-                     "Content-Type: text/html; charset=utf-8\r\n"
-                     "Content-Length: %d\r\n"
-                     "Connection: close\r\n"
-                     "\r\n", body_len);
-    send(sock, header, n, 0);
-    send(sock, body, body_len, 0);
+static void send_error(http_conn_t *conn, const char *status) {
+    char body[96];
+    int n = snprintf(body, sizeof(body), "<html><body><h1>%s</h1></body></html>", status);
+    send_response(conn, status, "text/html; charset=utf-8", body, n);
+}
+
+static void send_404(http_conn_t *conn) {
+    send_error(conn, "404 Not Found");
+}
+
+/* Сервер перегружен, клиенту стоит повторить запрос */
+static void send_503(http_conn_t *conn) {
+    send_error(conn, "503 Service Unavailable");
+}
+
+/* Отправка JSON, который собирает `render`. Буфер берем из пула, а не со стека, чтобы
+ * не раздувать стек задачи, которую диагностика и измеряет */
+static void send_json(http_conn_t *conn, size_t (*render)(char *buf, size_t buflen)) {
+    char *buf = (char *)mem_pool_acquire(&s_json_pool);
+    if (!buf) {
+        send_503(conn);
+        return;
+    }
+    size_t len = render(buf, DIAG_BUF_LEN);
+    send_response(conn, "200 OK", "application/json", buf, len);
+    mem_pool_release(&s_json_pool, buf);
+}
+
+/* Ищем значение заголовка `name` в запросе и копируем его в `buf`. false, если заголовка нет */
+static bool get_header_value(const char *req, const char *name, char *buf, size_t buflen) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(req, "\r\n");
+    while (line && line[2] != '\r' && line[2] != 0) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *v = line + name_len + 1;
+            while (*v == ' ') v++;
+            const char *end = strstr(v, "\r\n");
+            size_t len = end ? (size_t)(end - v) : strlen(v);
+            if (len >= buflen) len = buflen - 1;
+            memcpy(buf, v, len);
+            buf[len] = 0;
+            return true;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return false;
+}
+
+/* Тело с flash в обход кеша, через буфер `buf` */
+static bool send_from_flash(http_conn_t *conn, file_handle_t *f, size_t size, uint8_t *buf, size_t bufsize) {
+    /* Смещение в файле */
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t r = file_pool_pread(f, buf, MIN(bufsize, size - offset), offset);
+        if (r <= 0) return false;
+        offset += r;
+        if (!send_all(conn, buf, r)) return false;
+    }
+    return true;
+}
+
+/* Загрузчик читает файл в запись кеша целиком, прежде чем отправлять: запросы, которые ждут
+ * ту же запись, не должны зависеть от того, как быстро читает его клиент */
+static bool load_cached(cache_entry_t *entry, file_handle_t *f, size_t size) {
+    uint8_t *data = cache_data(entry);
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t r = file_pool_pread(f, data + offset, MIN((size_t)FILE_CHUNK, size - offset), offset);
+        if (r <= 0) {
+            cache_abort(entry);
+            return false;
+        }
+        // Ждущие запросы отдают каждую порцию, не дожидаясь конца файла
+        cache_commit(entry, r);
+        offset += r;
+    }
+    return true;
+}
+
+/* Тело из кеша по мере того, как его загружает загрузчик записи */
+static bool send_cached(http_conn_t *conn, cache_entry_t *entry, size_t size) {
+    uint8_t *data = cache_data(entry);
+    // Закрепленную запись можно отдавать без копии: буфер проживет, пока соединение его не вернет
+    bool stable = cache_is_pinned(entry) && transport_zero_copy(conn->tc);
+    if (stable) cache_lend(entry, &conn->lent);
+    size_t offset = 0;
+    while (offset < size) {
+        ssize_t avail = cache_wait(entry, offset);
+        if (avail < 0 || !send_all(conn, data + offset, avail - offset, stable)) return false;
+        offset = avail;
+    }
+    return true;
+}
+
+/* Отдаем файл, вшитый в прошивку */
+static void send_embedded(http_conn_t *conn, const embedded_file_t *file) {
+    http_writer_head(&conn->w, file->header, file->header_len);
+    bool ok = start_body(conn, HTTP_BODY_FIXED, file->size);
+    // Вшитые файлы лежат во flash, отображенной в память, и никуда не денутся
+    end_body(conn, ok && send_all(conn, file->data, file->size, true));
+}
+
+/* Ответ на файл, собранный под чтением индекса. Заголовки скопированы, а тело держат запись кеша
+ * или дескриптор пула: подмена файла их не трогает, поэтому отправляется ответ уже без индекса */
+typedef struct {
+    asset_t asset;                  // копия записи, для hitstats
+    char path[ASSET_PATH_MAX + 4];  // вариант в ФС
+    size_t size;                    // его размер
+    char head[256];
+    int head_len;
+    http_body_mode_t mode;
+    size_t length;                  // длина тела для HTTP_BODY_FIXED
+    cache_entry_t *entry;
+    file_handle_t *f;
+    uint8_t *buf;
+    gzip_ctx_t *gz;
+    inflate_stream_t *inflate;
+} file_response_t;
+
+typedef enum {
+    FILE_SEND,          // тело готово к отправке
+    FILE_NOT_MODIFIED,  // у клиента актуальная версия, в head - ее ETag
+    FILE_NOT_FOUND,
+    FILE_BUSY,          // кончились дескрипторы или буферы
+} file_result_t;
+
+/* Готовим ответ на файл из индекса. Вызывается под asset_read_begin и в соединение не пишет:
+ * медленный клиент не должен держать индекс */
+static file_result_t open_asset(http_conn_t *conn, const asset_t *asset, const char *req, file_response_t *resp) {
+    // Клиент уже держит актуальную версию. Слабый ETag он получил со сжатым на лету телом
+    char value[64];
+    if (get_header_value(req, "If-None-Match", value, sizeof(value)) &&
+        strcmp(strncmp(value, "W/", 2) == 0 ? value + 2 : value, asset->etag) == 0) {
+        snprintf(resp->head, sizeof(resp->head), "%s", asset->etag);
+        return FILE_NOT_MODIFIED;
+    }
+
+    resp->asset = *asset;
+    resp->asset.name = resp->asset.path + (asset->name - asset->path);
+    asset_encoding_t enc = asset_pick_encoding(asset, conn->accepts_gzip);
+    const asset_variant_t *variant = &asset->variants[enc];
+    resp->size = variant->size;
+    asset_variant_path(asset, enc, resp->path, sizeof(resp->path));
+
+    // Есть только .gz, а клиент gzip не принимает: распаковываем при отправке
+    const asset_variant_t *head = variant;
+    resp->inflate = NULL;
+    if (enc == ASSET_ENC_GZIP && !conn->accepts_gzip) {
+        resp->inflate = asset->inflated.present ? (inflate_stream_t *)mem_pool_acquire(&s_inflate_pool) : NULL;
+        if (!resp->inflate) return FILE_BUSY;
+        inflate_stream_begin(resp->inflate);
+        head = &asset->inflated;
+    }
+
+    // Файл читает с flash либо загрузчик записи кеша, либо запрос в обход кеша
+    bool loader = false;
+    resp->entry = cache_acquire(resp->path, variant->size, &loader);
+    resp->f = NULL;
+    if (!resp->entry || loader) {
+        esp_err_t err;
+        resp->f = file_pool_acquire(resp->path, &err);
+        if (!resp->f) {
+            ESP_LOGW(TAG, "Unable to open: %s (%s)", resp->path, esp_err_to_name(err));
+            if (resp->entry) {
+                cache_abort(resp->entry);
+                cache_release(resp->entry);
+            }
+            // Файл есть в индексе, значит кончились дескрипторы: просим повторить, а не отдаем fallback
+            mem_pool_release(&s_inflate_pool, resp->inflate);
+            return FILE_BUSY;
+        }
+    }
+    // В обход кеша файл читается через буфер
+    resp->buf = NULL;
+    if (!resp->entry) {
+        resp->buf = (uint8_t *)mem_pool_acquire(&s_chunk_pool);
+        if (!resp->buf) {
+            file_pool_release(resp->f);
+            mem_pool_release(&s_inflate_pool, resp->inflate);
+            return FILE_BUSY;
+        }
+    }
+
+    // Заранее сжатого варианта нет, а клиент принимает gzip: сжимаем сами
+    resp->gz = NULL;
+    if (enc == ASSET_ENC_IDENTITY && conn->accepts_gzip && conn->w.chunked_ok &&
+        !asset->variants[ASSET_ENC_GZIP].present && gzip_stream_eligible(asset->mime, variant->size)) {
+        resp->gz = gzip_acquire();
+    }
+
+    // Заголовки копируем: после asset_read_end арену может пересобрать обновление
+    int stream_len = resp->gz ? asset_render_stream_header(asset, resp->head, sizeof(resp->head)) : -1;
+    if (stream_len >= 0) {
+        resp->head_len = stream_len;
+        resp->mode = HTTP_BODY_CHUNKED;
+        resp->length = 0;
+    } else {
+        if (resp->gz) mem_pool_release(&s_gzip_pool, resp->gz);
+        resp->gz = NULL;
+        resp->head_len = MIN((size_t)head->header_len, sizeof(resp->head));
+        memcpy(resp->head, head->header, resp->head_len);
+        resp->mode = HTTP_BODY_FIXED;
+        resp->length = head->size;
+    }
+    return FILE_SEND;
+}
+
+/* Отправляем подготовленный ответ и отпускаем все, что он держал */
+static void send_asset(http_conn_t *conn, file_response_t *resp) {
+    // Заголовки ждут в сегменте http_writer и уходят вместе с началом тела
+    http_writer_head(&conn->w, resp->head, resp->head_len);
+    bool ok = start_body(conn, resp->mode, resp->length);
+    conn->gz = resp->gz;
+    conn->inflate = resp->inflate;
+
+    if (resp->entry) {
+        // Загрузчик читает файл в кеш, даже если клиенту отправить уже не удалось, и сразу
+        // отпускает дескриптор: дальше тело идет из памяти
+        bool loaded = !resp->f || load_cached(resp->entry, resp->f, resp->size);
+        if (resp->f) file_pool_release(resp->f);
+        resp->f = NULL;
+        ok = ok && loaded && send_cached(conn, resp->entry, resp->size);
+        cache_release(resp->entry);
+    } else {
+        ok = ok && send_from_flash(conn, resp->f, resp->size, resp->buf, FILE_CHUNK);
+    }
+    ok = end_body(conn, ok);
+    mem_pool_release(&s_chunk_pool, resp->buf);
+    if (resp->f) file_pool_release(resp->f);
+    if (ok) {
+        hitstats_record(&resp->asset, resp->size);
+    } else {
+        // Ответ оборван на середине тела: http_writer уже не оставит соединение открытым
+        ESP_LOGW(TAG, "Transfer interrupted: %s", resp->path);
+    }
 }
 
 /* Отправляем файл по пути (полный путь в файловой системе) */
-static void send_file(int sock, const char *fullpath, bool isFallback = false) {
-    FILE *f = fopen(fullpath, "rb");
-    if (!f) {
+static void send_file(http_conn_t *conn, const char *fullpath, const char *req) {
+    // Индекс читаем, только пока готовим ответ: обновление файла не ждет медленного клиента
+    file_response_t resp;
+    file_result_t result = FILE_NOT_FOUND;
+    asset_read_begin();
+    const asset_t *asset = asset_lookup(fullpath);
+    if (!asset) {
         ESP_LOGW(TAG, "File not found: %s", fullpath);
         // Если файл не найден, реализуем fallback до корневого файла. Нужно, когда серверуем SPA приложения
-        if (!isFallback) {
-            send_file(sock, FALLBACK_PATH, true);
-            return;
-        } else {
-            send_404(sock);
-            return;
+        asset = asset_lookup(FALLBACK_PATH);
+    }
+    if (asset) result = open_asset(conn, asset, req, &resp);
+    asset_read_end();
+
+    switch (result) {
+    case FILE_SEND:
+        send_asset(conn, &resp);
+        break;
+    case FILE_NOT_MODIFIED:
+        http_writer_headerf(&conn->w, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n", resp.head);
+        end_body(conn, start_body(conn, HTTP_BODY_NONE, 0));
+        break;
+    case FILE_NOT_FOUND:
+        send_404(conn);
+        break;
+    case FILE_BUSY:
+        send_503(conn);
+        break;
+    }
+}
+
+/* Считаем PCB в потоке tcpip: списки lwIP трогать можно только оттуда */
+typedef struct {
+    struct tcpip_api_call_data call;
+    uint16_t active;
+    uint16_t time_wait;
+} pcb_count_t;
+
+static err_t count_pcbs(struct tcpip_api_call_data *call) {
+    pcb_count_t *c = (pcb_count_t *)call;
+    for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb; pcb = pcb->next) c->active++;
+    for (struct tcp_pcb *pcb = tcp_tw_pcbs; pcb; pcb = pcb->next) c->time_wait++;
+    return ERR_OK;
+}
+
+void http_server_get_stats(http_server_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_mux);
+
+    pcb_count_t count = {};
+    tcpip_api_call(count_pcbs, &count.call);
+    stats->tcp_active = count.active;
+    stats->tcp_time_wait = count.time_wait;
+    stats->tcp_pcb_max = MEMP_NUM_TCP_PCB;
+}
+
+uint32_t http_server_active_responses(void) {
+    portENTER_CRITICAL(&s_stats_mux);
+    uint32_t active = s_active_responses;
+    portEXIT_CRITICAL(&s_stats_mux);
+    return active;
+}
+
+static void count_response(bool begin) {
+    portENTER_CRITICAL(&s_stats_mux);
+    if (begin) {
+        s_active_responses++;
+    } else {
+        s_active_responses--;
+    }
+    portEXIT_CRITICAL(&s_stats_mux);
+}
+
+#if HTTP_UPLOAD
+/* Открытым страницам по WebSocket: что-то обновилось, можно перечитать вместо опроса */
+static void notify_clients(const char *event, const char *path) {
+    char msg[300];
+    size_t pos = 0;
+    strbuf_appendf(msg, sizeof(msg), &pos, "{\"event\":\"%s\",\"path\":\"", event);
+    // Путь пришел от клиента раскодированным и может содержать кавычки
+    strbuf_append_json(msg, sizeof(msg), &pos, path);
+    strbuf_appendf(msg, sizeof(msg), &pos, "\"}");
+    // Обрезанное сообщение уже не JSON
+    if (pos >= sizeof(msg) - 1) return;
+    websocket_broadcast(msg, pos, true);
+}
+
+/* Статус ответа на ошибку загрузки */
+static const char *upload_status(esp_err_t err) {
+    switch (err) {
+    case ESP_ERR_INVALID_SIZE: return "413 Payload Too Large";
+    case ESP_ERR_NO_MEM: return "507 Insufficient Storage";
+    case ESP_ERR_INVALID_STATE:
+    case ESP_ERR_TIMEOUT: return "503 Service Unavailable";
+    case ESP_ERR_INVALID_ARG:
+    case ESP_ERR_INVALID_RESPONSE: return "400 Bad Request";
+    case ESP_ERR_INVALID_CRC: return "422 Unprocessable Entity";
+    case ESP_ERR_NOT_FOUND: return "404 Not Found";
+    default: return "500 Internal Server Error";
+    }
+}
+
+/* Файлы из формы: каждая часть с именем файла ложится в `dir` */
+typedef struct {
+    char dir[256];      // путь запроса, заканчивается на '/', или полный путь одного файла
+    upload_t up;
+    upload_mode_t mode;
+    bool open;
+    bool created;
+    int files;
+    size_t bytes;
+} form_upload_t;
+
+static esp_err_t form_part_begin(void *arg, const char *name, const char *filename) {
+    form_upload_t *form = (form_upload_t *)arg;
+    // Обычные поля формы пропускаем
+    if (!filename[0]) return ESP_OK;
+    // Из имени файла берем только последний сегмент: каталог задает путь запроса
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    const char *slash = strrchr(base, '\\');
+    if (slash) base = slash + 1;
+    char req_path[sizeof(form->dir) + MULTIPART_FILENAME_MAX];
+    size_t dir_len = strlen(form->dir);
+    snprintf(req_path, sizeof(req_path), "%s%s", form->dir, dir_len && form->dir[dir_len - 1] == '/' ? base : "");
+    char fullpath[256];
+    sanitize_path(req_path, fullpath, sizeof(fullpath));
+    esp_err_t err = upload_begin(&form->up, fullpath, form->mode);
+    form->open = err == ESP_OK;
+    return err;
+}
+
+static esp_err_t form_part_data(void *arg, const uint8_t *data, size_t len) {
+    form_upload_t *form = (form_upload_t *)arg;
+    return form->open ? upload_write(&form->up, data, len) : ESP_OK;
+}
+
+static esp_err_t form_part_end(void *arg) {
+    form_upload_t *form = (form_upload_t *)arg;
+    if (!form->open) return ESP_OK;
+    form->open = false;
+    bool created;
+    esp_err_t err = upload_commit(&form->up, &created);
+    if (err == ESP_OK) {
+        form->files++;
+        form->bytes += form->up.size;
+        form->created = form->created || created;
+    }
+    return err;
+}
+
+/* Отказ до чтения тела: оно осталось в соединении, поэтому после ответа закрываем */
+static void upload_reject(http_conn_t *conn, const char *status) {
+    conn->w.keep_alive = false;
+    send_error(conn, status);
+}
+
+/* Сравнение за время, которое не зависит от того, сколько символов совпало */
+static bool token_equal(const char *given, const char *token, size_t token_len) {
+    size_t len = strlen(given);
+    uint8_t diff = len != token_len;
+    for (size_t i = 0; i < token_len; i++) diff |= (uint8_t)((i < len ? given[i] : 0) ^ token[i]);
+    return diff == 0;
+}
+
+/* Запрос на изменение несет "Authorization: Bearer <токен>". Без заголовка - 401, с чужим токеном
+ * или если токен не задан в конфигурации - 403. Тело не читаем, соединение после ответа закрываем */
+static bool upload_authorized(http_conn_t *conn, const char *req) {
+    static const char token[] = HTTP_UPLOAD_TOKEN;
+    char value[128];
+    if (!get_header_value(req, "Authorization", value, sizeof(value)) || strncasecmp(value, "Bearer ", 7) != 0) {
+        conn->w.keep_alive = false;
+        http_writer_headerf(&conn->w, "HTTP/1.1 401 Unauthorized\r\nWWW-Authenticate: Bearer\r\n");
+        end_body(conn, start_body(conn, HTTP_BODY_FIXED, 0));
+        return false;
+    }
+    // Обрезанный буфером токен не совпадет ни с чем
+    bool truncated = strlen(value) == sizeof(value) - 1;
+    if (sizeof(token) > 1 && !truncated && token_equal(value + 7, token, sizeof(token) - 1)) return true;
+    ESP_LOGW(TAG, "Rejected write request: %s", sizeof(token) > 1 ? "wrong token" : "no token configured");
+    upload_reject(conn, "403 Forbidden");
+    return false;
+}
+
+/* Начало тела. Без Content-Length отвечаем отказом и возвращаем NULL.
+ * Тело чанками не принимаем: место на разделе нужно проверить заранее */
+static const uint8_t *body_start(http_conn_t *conn, const char *req, size_t *length) {
+    // Заголовки serve_requests принял целиком
+    const char *head_end = strstr(req, "\r\n\r\n");
+    char value[32];
+    if (!get_header_value(req, "Content-Length", value, sizeof(value))) {
+        upload_reject(conn, "411 Length Required");
+        return NULL;
+    }
+    *length = strtoul(value, NULL, 10);
+    return (const uint8_t *)head_end + 4;
+}
+
+/* Последовательная запись для сравнения с конвейером: "X-Upload-Mode: serial" */
+static upload_mode_t upload_mode(const char *req) {
+    char value[16];
+    bool serial = get_header_value(req, "X-Upload-Mode", value, sizeof(value)) && strcasecmp(value, "serial") == 0;
+    return serial ? UPLOAD_SERIAL : UPLOAD_DEFAULT_MODE;
+}
+
+typedef esp_err_t (*body_feed_t)(void *arg, const uint8_t *data, size_t len);
+
+/* Тело длиной `length` кусками приемного буфера `req` в `feed`. Начало могло прийти вместе
+ * с заголовками. `*remaining` - сколько осталось в соединении, ESP_FAIL - клиент оборвал */
+static esp_err_t recv_body(http_conn_t *conn, char *req, size_t req_len, const uint8_t *data, size_t length,
+                           body_feed_t feed, void *arg, size_t *remaining) {
+    // Клиент ждет разрешения, прежде чем слать тело
+    char value[16];
+    if (get_header_value(req, "Expect", value, sizeof(value)) && strcasecmp(value, "100-continue") == 0) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        transport_send(conn->tc, cont, sizeof(cont) - 1, true, false);
+    }
+    size_t n = MIN((size_t)(req + req_len - (const char *)data), length);
+    *remaining = length;
+    while (1) {
+        if (n) {
+            esp_err_t err = feed(arg, data, n);
+            *remaining -= n;
+            if (err != ESP_OK) return err;
         }
+        if (*remaining == 0) return ESP_OK;
+        int r = transport_recv(conn->tc, req, MIN((size_t)RECV_BUF_LEN, *remaining));
+        if (r <= 0) return ESP_FAIL;
+        wifi_ps_activity();
+        data = (const uint8_t *)req;
+        n = r;
+    }
+}
+
+/* Ответ на неудачную загрузку. Недочитанное тело осталось в соединении: после ответа закрываем.
+ * Если клиент оборвал соединение сам, отвечать некому */
+static void upload_failed(http_conn_t *conn, const char *req_path, esp_err_t err, size_t remaining) {
+    ESP_LOGW(TAG, "Upload to %s failed (%s)", req_path, esp_err_to_name(err));
+    if (remaining) conn->w.keep_alive = false;
+    if (err != ESP_FAIL || remaining == 0) send_error(conn, upload_status(err));
+}
+
+static esp_err_t feed_file(void *arg, const uint8_t *data, size_t len) {
+    return upload_write(&((form_upload_t *)arg)->up, data, len);
+}
+
+static esp_err_t feed_form(void *arg, const uint8_t *data, size_t len) {
+    return multipart_feed((multipart_t *)arg, data, len);
+}
+
+/* PUT /path - тело запроса и есть файл. POST с multipart/form-data - файлы из формы.
+ * Тело читается кусками в приемный буфер `req` и сразу уходит на flash */
+static void handle_upload(http_conn_t *conn, char *req, size_t req_len, const char *req_path, bool put) {
+    size_t length;
+    const uint8_t *body = body_start(conn, req, &length);
+    if (!body) return;
+    esp_err_t err = upload_check_space(length);
+    if (err != ESP_OK) {
+        upload_reject(conn, upload_status(err));
+        return;
     }
 
-    // Определим размер файла
-    fseek(f, 0, SEEK_END);
-    long filesize = ftell(f);
-    // Возвращаем указатель на место
-    fseek(f, 0, SEEK_SET);
-
-    const char *mime = get_mime_type(fullpath);
-    char header[256];
-    int header_len = snprintf(header, sizeof(header),
-                              "HTTP/1.1 200 OK\r\n"
-                              "Content-Type: %s\r\n"
-                              "Content-Length: %ld\r\n"
-                              "Connection: close\r\n"
-                              "\r\n", mime, filesize);
-    send(sock, header, header_len, 0);
-
-    // Отправляем тело чанками
-    uint8_t buf[FILE_CHUNK];
-
-    /* Счетчик прочитанных байтов */
-    size_t r;
-    while ((r = fread(buf, 1, sizeof(buf), f)) > 0) {
-        /* Счетчик отправленных байтов */
-        size_t sent = 0;
-        // Отправляем данные в сокет, пока чанк не кончится
-        while (sent < r) {
-            ssize_t s = send(sock, buf + sent, r - sent, 0);
-            if (s < 0) {
-                ESP_LOGW(TAG, "send error");
-                fclose(f);
-                return;
+    form_upload_t form = {};
+    form.mode = upload_mode(req);
+    multipart_t mp;
+    if (put) {
+        char fullpath[256];
+        sanitize_path(req_path, fullpath, sizeof(fullpath));
+        err = upload_begin(&form.up, fullpath, form.mode);
+        form.open = err == ESP_OK;
+    } else {
+        static const multipart_handler_t handler = { form_part_begin, form_part_data, form_part_end, NULL };
+        multipart_handler_t h = handler;
+        h.arg = &form;
+        snprintf(form.dir, sizeof(form.dir), "%s", req_path);
+        char value[128];
+        if (!get_header_value(req, "Content-Type", value, sizeof(value))) value[0] = 0;
+        err = multipart_begin(&mp, value, &h);
+    }
+    if (err != ESP_OK) {
+        upload_reject(conn, upload_status(err));
+        return;
+    }
+
+    size_t remaining;
+    int64_t started = esp_timer_get_time();
+    err = put ? recv_body(conn, req, req_len, body, length, feed_file, &form, &remaining)
+              : recv_body(conn, req, req_len, body, length, feed_form, &mp, &remaining);
+    if (err == ESP_OK && put) {
+        form.open = false;
+        err = upload_commit(&form.up, &form.created);
+        form.files = 1;
+        form.bytes = form.up.size;
+    } else if (err == ESP_OK && !multipart_done(&mp)) {
+        err = ESP_ERR_INVALID_RESPONSE;
+    }
+    if (form.open) upload_abort(&form.up);
+    if (err != ESP_OK) {
+        upload_failed(conn, req_path, err, remaining);
+        return;
+    }
+
+    int64_t us = esp_timer_get_time() - started;
+    char json[128];
+    int len = snprintf(json, sizeof(json), "{\"files\":%d,\"bytes\":%u,\"ms\":%u,\"kb_per_s\":%u,\"mode\":\"%s\"}",
+                       form.files, (unsigned)form.bytes, (unsigned)(us / 1000),
+                       us ? (unsigned)(form.bytes * 1000000ULL / 1024 / us) : 0, upload_mode_name(form.up.mode));
+    send_response(conn, form.created ? "201 Created" : "200 OK", "application/json", json, len);
+    notify_clients("assets", req_path);
+}
+
+/* DELETE /path - файл и его .gz */
+static void handle_delete(http_conn_t *conn, const char *req_path) {
+    char fullpath[256];
+    sanitize_path(req_path, fullpath, sizeof(fullpath));
+    int removed;
+    esp_err_t err = upload_delete(fullpath, &removed);
+    if (err != ESP_OK) {
+        send_error(conn, upload_status(err));
+        return;
+    }
+    char json[32];
+    int len = snprintf(json, sizeof(json), "{\"files\":%d}", removed);
+    send_response(conn, "200 OK", "application/json", json, len);
+    notify_clients("assets", req_path);
+}
+
+/* Манифест: {"имя файла в ФС": "sha256", ...}, .gz отдельными файлами. Тело чанками:
+ * файлов может быть больше, чем влезает в буфер JSON. Индекс читаем по одной записи и отпускаем
+ * на время отправки: медленный клиент не держит загрузки */
+static void send_manifest(http_conn_t *conn) {
+    http_writer_headerf(&conn->w, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nCache-Control: no-store\r\n");
+    bool ok = start_body(conn, HTTP_BODY_CHUNKED, 0) && send_all(conn, "{", 1);
+    bool first = true;
+    for (int i = 0; ok; i++) {
+        // Строки обоих вариантов записи собираем под чтением индекса
+        char lines[ASSET_ENC_COUNT * (2 * ASSET_PATH_MAX + 80)];
+        size_t n = 0;
+        asset_read_begin();
+        const asset_t *asset = asset_at(i);
+        for (int enc = 0; asset && enc < ASSET_ENC_COUNT; enc++) {
+            uint8_t sha[32];
+            if (!asset->variants[enc].present ||
+                asset_variant_sha256(asset, (asset_encoding_t)enc, sha) != ESP_OK) {
+                continue;
             }
-            sent += s;
+            strbuf_appendf(lines, sizeof(lines), &n, "%s\"", first ? "" : ",");
+            strbuf_append_json(lines, sizeof(lines), &n, asset->name);
+            strbuf_appendf(lines, sizeof(lines), &n, "%s\":\"", enc == ASSET_ENC_GZIP ? ".gz" : "");
+            for (int b = 0; b < 32; b++) strbuf_appendf(lines, sizeof(lines), &n, "%02x", sha[b]);
+            strbuf_appendf(lines, sizeof(lines), &n, "\"");
+            first = false;
         }
+        asset_read_end();
+        if (!asset) break;
+        if (n) ok = send_all(conn, lines, n);
     }
-    fclose(f);
+    end_body(conn, ok && send_all(conn, "}", 1));
 }
 
-/* Обработка одного соединения */
-static void handle_client(int client_sock) {
-    char recv_buf[RECV_BUF_LEN + 1];
-    memset(recv_buf, 0, sizeof(recv_buf));
-    int r = recv(client_sock, recv_buf, RECV_BUF_LEN, 0);
-
-    // Поскольку мы реализуем сервер, который просто отдает статичные файлы,
-    // нам достаточно читать первые 1024 байта, чтобы вытянуть оттуда адрес.
-    // Если бы предполагалась обработка POST запросов, то нужно было бы
-    // Читать буфер через while на манер того, как это реализовано в функции
-    // send_file
-    if (r <= 0) {
-        close(client_sock);
+static esp_err_t feed_image(void *arg, const uint8_t *data, size_t len) {
+    return asset_image_write((asset_image_t *)arg, data, len);
+}
+
+/* PUT /_image - образ SPIFFS целиком в неактивный раздел. Хеш образа в X-Image-SHA256.
+ * Пока образ пишется и проверяется, файлы отдаются из активного раздела */
+static void handle_image(http_conn_t *conn, char *req, size_t req_len) {
+    size_t length;
+    const uint8_t *body = body_start(conn, req, &length);
+    if (!body) return;
+    char sha[72];
+    if (!get_header_value(req, "X-Image-SHA256", sha, sizeof(sha))) sha[0] = 0;
+    asset_image_t img;
+    esp_err_t err = asset_image_begin(&img, length, sha, upload_mode(req));
+    if (err != ESP_OK) {
+        upload_reject(conn, upload_status(err));
+        return;
+    }
+
+    size_t remaining;
+    err = recv_body(conn, req, req_len, body, length, feed_image, &img, &remaining);
+    if (err != ESP_OK) {
+        asset_image_abort(&img);
+        upload_failed(conn, ASSET_IMAGE_PATH, err, remaining);
+        return;
+    }
+    err = asset_image_finish(&img);
+    if (err != ESP_OK) {
+        upload_failed(conn, ASSET_IMAGE_PATH, err, 0);
+        return;
+    }
+
+    asset_image_stats_t st;
+    asset_image_get_stats(&st);
+    char json[160];
+    int len = snprintf(json, sizeof(json), "{\"slot\":\"%s\",\"bytes\":%u,\"ms\":%u,\"kb_per_s\":%u,\"mode\":\"%s\"}",
+                       asset_image_label(), (unsigned)st.last_size, (unsigned)st.last_ms,
+                       (unsigned)st.last_kb_per_s, upload_mode_name(img.up.mode));
+    send_response(conn, "200 OK", "application/json", json, len);
+    notify_clients("assets", "/");
+}
+
+static esp_err_t feed_firmware(void *arg, const uint8_t *data, size_t len) {
+    return firmware_write((firmware_t *)arg, data, len);
+}
+
+/* PUT /_firmware - образ приложения в неактивный слот OTA. После ответа устройство
+ * перезагружается в новую прошивку */
+static void handle_firmware(http_conn_t *conn, char *req, size_t req_len) {
+    size_t length;
+    const uint8_t *body = body_start(conn, req, &length);
+    if (!body) return;
+    firmware_t fw;
+    esp_err_t err = firmware_begin(&fw, length, upload_mode(req));
+    if (err != ESP_OK) {
+        upload_reject(conn, upload_status(err));
+        return;
+    }
+
+    size_t remaining;
+    err = recv_body(conn, req, req_len, body, length, feed_firmware, &fw, &remaining);
+    if (err != ESP_OK) {
+        firmware_abort(&fw);
+        upload_failed(conn, FIRMWARE_PATH, err, remaining);
+        return;
+    }
+    err = firmware_finish(&fw);
+    if (err != ESP_OK) {
+        upload_failed(conn, FIRMWARE_PATH, err, 0);
+        return;
+    }
+
+    firmware_stats_t st;
+    firmware_get_stats(&st);
+    char json[192];
+    int len = snprintf(json, sizeof(json),
+                       "{\"partition\":\"%s\",\"bytes\":%u,\"ms\":%u,\"kb_per_s\":%u,\"mode\":\"%s\",\"restart_ms\":%u}",
+                       fw.part->label, (unsigned)st.last_size, (unsigned)st.last_ms,
+                       (unsigned)st.last_kb_per_s, upload_mode_name(fw.up.mode), FIRMWARE_RESTART_DELAY_MS);
+    // Соединение закрываем: устройство сейчас перезагрузится
+    conn->w.keep_alive = false;
+    send_response(conn, "200 OK", "application/json", json, len);
+    notify_clients("firmware", FIRMWARE_PATH);
+}
+
+/* DELETE /_firmware - возврат к прошивке из другого слота */
+static void handle_rollback(http_conn_t *conn) {
+    esp_err_t err = firmware_rollback();
+    if (err != ESP_OK) {
+        send_error(conn, upload_status(err));
         return;
     }
-    recv_buf[r] = 0;
+    char json[64];
+    int len = snprintf(json, sizeof(json), "{\"restart_ms\":%u}", FIRMWARE_RESTART_DELAY_MS);
+    conn->w.keep_alive = false;
+    send_response(conn, "200 OK", "application/json", json, len);
+}
+#endif
 
-    char req_path[256];
-    parse_request_path(recv_buf, req_path, sizeof(req_path));
-    ESP_LOGI(TAG, "Requested: %s", req_path);
+/* GET /_ws с "Upgrade: websocket". После 101 соединение живет в задаче websocket, воркер свободен */
+static void handle_websocket(http_conn_t *conn, const char *req) {
+    char value[32], key[32], version[8];
+    if (!get_header_value(req, "Upgrade", value, sizeof(value)) || strcasecmp(value, "websocket") != 0) {
+        send_error(conn, "400 Bad Request");
+        return;
+    }
+    if (!get_header_value(req, "Sec-WebSocket-Key", key, sizeof(key))) key[0] = 0;
+    if (!get_header_value(req, "Sec-WebSocket-Version", version, sizeof(version))) version[0] = 0;
+    esp_err_t err = websocket_accept(conn->tc, key, version);
+    switch (err) {
+    case ESP_OK:
+        conn->detached = true;
+        break;
+    case ESP_ERR_INVALID_VERSION:
+        // Клиенту сообщаем, какую версию мы понимаем
+        http_writer_headerf(&conn->w, "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\n");
+        end_body(conn, start_body(conn, HTTP_BODY_FIXED, 0));
+        break;
+    case ESP_ERR_INVALID_ARG:
+        send_error(conn, "400 Bad Request");
+        break;
+    case ESP_ERR_NOT_SUPPORTED:
+        // Транспорт без select: WebSocket только на основном порту
+        send_error(conn, "501 Not Implemented");
+        break;
+    case ESP_ERR_NO_MEM:
+        send_503(conn);
+        break;
+    default:
+        // 101 не ушел: отвечать некому
+        conn->w.keep_alive = false;
+        break;
+    }
+}
+
+/* Служебные маршруты с JSON, которые отдаются не из ФС */
+static const struct {
+    const char *path;
+    size_t (*render)(char *buf, size_t buflen);
+} s_json_routes[] = {
+    { DIAG_PATH, diag_render_json },
+    { HITSTATS_PATH, hitstats_render_json },
+};
+
+/* Отвечаем на разобранный запрос */
+static void route_request(http_conn_t *conn, char *req, size_t req_len, const char *req_path) {
+#if HTTP_UPLOAD
+    bool put = strncmp(req, "PUT ", 4) == 0;
+    bool post = strncmp(req, "POST ", 5) == 0;
+    bool del = strncmp(req, "DELETE ", 7) == 0;
+    if ((put || post || del) && !upload_authorized(conn, req)) return;
+    if (put || post) {
+        // Обновлять можно только готовый индекс
+        if (!boot_wait(BOOT_PHASE_INDEX, FS_WAIT_MS)) {
+            upload_reject(conn, "503 Service Unavailable");
+            return;
+        }
+        if (put && strcmp(req_path, ASSET_IMAGE_PATH) == 0) {
+            handle_image(conn, req, req_len);
+        } else if (put && strcmp(req_path, FIRMWARE_PATH) == 0) {
+            if (HTTP_FIRMWARE_UPDATE) {
+                handle_firmware(conn, req, req_len);
+            } else {
+                upload_reject(conn, "404 Not Found");
+            }
+        } else {
+            handle_upload(conn, req, req_len, req_path, put);
+        }
+        return;
+    }
+    if (del || strcmp(req_path, MANIFEST_PATH) == 0) {
+        if (del && strcmp(req_path, FIRMWARE_PATH) == 0) {
+            if (HTTP_FIRMWARE_UPDATE) {
+                handle_rollback(conn);
+            } else {
+                send_404(conn);
+            }
+        } else if (!boot_wait(BOOT_PHASE_INDEX, FS_WAIT_MS)) {
+            send_503(conn);
+        } else if (del) {
+            handle_delete(conn, req_path);
+        } else {
+            send_manifest(conn);
+        }
+        return;
+    }
+#endif
+    if (strcmp(req_path, WEBSOCKET_PATH) == 0) {
+        handle_websocket(conn, req);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(s_json_routes) / sizeof(s_json_routes[0]); i++) {
+        if (strcmp(req_path, s_json_routes[i].path) == 0) {
+            send_json(conn, s_json_routes[i].render);
+            return;
+        }
+    }
 
     char safe_path[256];
     sanitize_path(req_path, safe_path, sizeof(safe_path));
     ESP_LOGI(TAG, "Serving file: %s", safe_path);
 
-    send_file(client_sock, safe_path);
+    // ФС еще монтируется: то, что вшито в прошивку, отдаем сразу, остальное ждет
+    if (!boot_done(BOOT_PHASE_INDEX)) {
+        const embedded_file_t *embedded = embedded_lookup(safe_path + strlen(SPIFFS_BASE_PATH) + 1);
+        if (embedded) {
+            send_embedded(conn, embedded);
+            return;
+        }
+        if (!boot_wait(BOOT_PHASE_INDEX, FS_WAIT_MS)) {
+            send_503(conn);
+            return;
+        }
+    }
+
+    send_file(conn, safe_path, req);
+}
 
-    shutdown(client_sock, SHUT_RDWR);
-    close(client_sock);
+/* Первая строка запроса заканчивается на HTTP/1.0 */
+static bool is_http10(const char *req) {
+    const char *eol = strstr(req, "\r\n");
+    return eol && eol - req >= 8 && strncmp(eol - 8, "HTTP/1.0", 8) == 0;
 }
 
-/* Серверная задача */
-static void http_server_task(void *pv) {
-    struct sockaddr_in server_addr;
-    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+/* Клиент хочет оставить соединение открытым: HTTP/1.1 по умолчанию, HTTP/1.0 только явно */
+static bool wants_keep_alive(const char *req) {
+    char value[32];
+    bool has_header = get_header_value(req, "Connection", value, sizeof(value));
+    if (is_http10(req)) return has_header && strcasecmp(value, "keep-alive") == 0;
+    return !has_header || strcasecmp(value, "close") != 0;
+}
 
-    // Не удалось создать сервер - удаляем задачу, чтобы не тратить на задачу ресурсы
-    if (listen_sock < 0) {
-        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-        vTaskDelete(NULL);
-        return;
+static void record_latency(bool update, int64_t us) {
+    portENTER_CRITICAL(&s_stats_mux);
+    http_latency_t *l = update ? &s_stats.latency_update : &s_stats.latency;
+    l->samples++;
+    l->total_us += us;
+    if (us > l->max_us) l->max_us = us;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
+
+/* Ждем FIN от клиента, выбрасывая все, что он еще пришлет. true, если клиент закрыл сам */
+static bool wait_client_fin(transport_conn_t *tc) {
+    char buf[64];
+    int64_t deadline = esp_timer_get_time() + HTTP_DRAIN_MS * 1000LL;
+    transport_set_recv_timeout(tc, HTTP_DRAIN_MS);
+    while (esp_timer_get_time() < deadline) {
+        int r = transport_recv(tc, buf, sizeof(buf));
+        if (r == 0) return true;
+        if (r < 0) return false;
     }
+    return false;
+}
 
-    int opt = 1;
-    // Разрешаем переиспользование адреса
-    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* Закрываем соединение, которое клиент сам не закрыл. После "Connection: close"
+ * (`wait_fin`) браузер закрывает первым, даем ему на это HTTP_DRAIN_MS */
+static void close_client(transport_conn_t *tc, bool wait_fin, bool lent = false) {
+    if (wait_fin) {
+        if (wait_client_fin(tc)) {
+            STAT_INC(client_closes);
+            transport_close(tc, lent);
+            return;
+        }
+        STAT_INC(drain_timeouts);
+    }
+    bool reset = HTTP_LINGER_RESET || lent;
+    // Считаем только настоящие RST: сокет с пустой очередью все равно закроется с FIN
+    if (reset && transport_aborts(tc)) STAT_INC(resets);
+    transport_close(tc, reset);
+}
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(SERVER_PORT);
+/* Закрываем соединение воркера. Сегменты, отданные стеку без копии, lwIP держит до подтверждения,
+ * а после обычного закрытия и дольше: такое соединение закрываем через RST, тогда они освобождаются
+ * вместе с PCB, и кеш получает свои буферы обратно */
+static void close_conn(http_conn_t *conn, bool wait_fin) {
+    close_client(conn->tc, wait_fin, conn->lent != 0);
+    cache_return(&conn->lent);
+}
 
-    // Привязываем сокет к адресу сервера
-    if (bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
-        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
-        close(listen_sock);
-        vTaskDelete(NULL);
-        return;
+/* Ждем следующий запрос keep-alive соединения. Простаивающее соединение держит воркер, поэтому
+ * ждем отрезками по HTTP_IDLE_SLICE_MS и отпускаем его, как только своей очереди ждет новый клиент
+ * (`*yielded`). Возвращает то же, что transport_recv */
+static int recv_next_request(transport_conn_t *tc, char *buf, bool *yielded) {
+    *yielded = false;
+    int64_t deadline = esp_timer_get_time() + HTTP_KEEPALIVE_MS * 1000LL;
+    transport_set_recv_timeout(tc, HTTP_IDLE_SLICE_MS);
+    int r;
+    while ((r = transport_recv(tc, buf, RECV_BUF_LEN)) == TRANSPORT_RECV_TIMEOUT) {
+        if (uxQueueMessagesWaiting(s_client_queue) > 0) {
+            *yielded = true;
+            break;
+        }
+        if (esp_timer_get_time() >= deadline) break;
     }
+    // Тело загрузки дочитывается с обычным таймаутом
+    transport_set_recv_timeout(tc, HTTP_KEEPALIVE_MS);
+    return r;
+}
 
-    // Начинаем слушать сокет
-    if (listen(listen_sock, 5) != 0) {
-        ESP_LOGE(TAG, "Error during listen: errno %d", errno);
-        close(listen_sock);
+/* Принимаем заголовки запроса целиком, до пустой строки. В `buf` уже может лежать `*have` байт:
+ * начало запроса, которое клиент прислал вместе с прошлым. Пустой буфер keep-alive соединения
+ * (`idle`) ждем через recv_next_request. Возвращает длину заголовков вместе с пустой строкой
+ * или, если они не пришли, то же, что transport_recv. `*overflow` - заголовки не влезли в RECV_BUF_LEN */
+static int recv_request_head(transport_conn_t *tc, char *buf, size_t *have, bool idle, bool *yielded,
+                             bool *overflow) {
+    *yielded = false;
+    *overflow = false;
+    while (1) {
+        buf[*have] = 0;
+        const char *end = strstr(buf, "\r\n\r\n");
+        if (end) return end + 4 - buf;
+        if (*have >= RECV_BUF_LEN) {
+            *overflow = true;
+            return -1;
+        }
+        int r = *have == 0 && idle ? recv_next_request(tc, buf, yielded)
+                                   : transport_recv(tc, buf + *have, RECV_BUF_LEN - *have);
+        if (r <= 0) return r;
+        *have += r;
+    }
+}
+
+/* Длина тела запроса по Content-Length, 0 - тела нет. false - где кончается тело, не понять:
+ * Transfer-Encoding или испорченный Content-Length */
+static bool request_body_length(const char *req, size_t *length) {
+    char value[32];
+    *length = 0;
+    if (get_header_value(req, "Transfer-Encoding", value, sizeof(value))) return false;
+    if (!get_header_value(req, "Content-Length", value, sizeof(value))) return true;
+    if (value[0] < '0' || value[0] > '9') return false;
+    char *end;
+    unsigned long n = strtoul(value, &end, 10);
+    while (*end == ' ') end++;
+    if (*end) return false;
+    *length = n;
+    return true;
+}
+
+/* Выбрасываем `len` байт тела, которое не нужно обработчику. false - соединение оборвалось */
+static bool discard_body(transport_conn_t *tc, char *buf, size_t len) {
+    while (len) {
+        int r = transport_recv(tc, buf, MIN((size_t)RECV_BUF_LEN, len));
+        if (r <= 0) return false;
+        len -= r;
+    }
+    return true;
+}
+
+/* Запросы соединения идут друг за другом, пока клиент держит keep-alive */
+static void serve_requests(client_t *client, char *recv_buf, uint8_t *segment) {
+    http_conn_t conn = {};
+    conn.tc = &client->conn;
+    http_writer_init(&conn.w, conn.tc, segment);
+    transport_set_recv_timeout(conn.tc, HTTP_KEEPALIVE_MS);
+
+    // Принято байт в recv_buf: заголовки текущего запроса и, возможно, начало тела или следующего запроса
+    size_t have = 0;
+    bool keep_alive = true;
+    for (int served = 0; keep_alive; served++) {
+        bool yielded, overflow;
+        int r = recv_request_head(conn.tc, recv_buf, &have, served > 0, &yielded, &overflow);
+        if (overflow) {
+            // Остаток заголовков так и лежит в соединении: отвечаем и закрываем
+            STAT_INC(requests);
+            http_writer_begin(&conn.w, false, !is_http10(recv_buf));
+            send_error(&conn, "431 Request Header Fields Too Large");
+            break;
+        }
+        if (r == 0) {
+            // Клиент закрыл первым: TIME_WAIT остается на его стороне
+            STAT_INC(client_closes);
+            transport_close(conn.tc, conn.lent != 0);
+            cache_return(&conn.lent);
+            return;
+        }
+        if (yielded) {
+            // Воркер нужнее клиенту из очереди, браузер откроет новое соединение
+            STAT_INC(idle_yields);
+            close_conn(&conn, false);
+            return;
+        }
+        if (r < 0) {
+            // Соединение простаивало дольше HTTP_KEEPALIVE_MS
+            STAT_INC(idle_timeouts);
+            close_conn(&conn, false);
+            return;
+        }
+        size_t head_len = r;
+        if (served == 0) {
+            // Ожидание запроса включает задержку, которую добавляет сон модема
+            wifi_ps_note_first_byte(client->ps_mode, esp_timer_get_time() - client->accepted_us);
+        } else {
+            STAT_INC(keepalive_reuses);
+        }
+        STAT_INC(requests);
+
+        char req_path[256];
+        bool path_ok = parse_request_path(recv_buf, req_path, sizeof(req_path));
+        ESP_LOGI(TAG, "Requested: %s from %s", req_path, client->conn.addr);
+
+        // Тело загрузки читает обработчик прямо в recv_buf, остальным оно не нужно: его выбрасываем,
+        // чтобы не принять за следующий запрос. Если длина тела неизвестна или оно велико, после
+        // ответа закрываем. Запрос, пришедший вслед за загрузкой, обработчик затрет
+        bool upload = HTTP_UPLOAD && (strncmp(recv_buf, "PUT ", 4) == 0 || strncmp(recv_buf, "POST ", 5) == 0);
+        size_t body_len;
+        bool framed = request_body_length(recv_buf, &body_len);
+        size_t body_buffered = MIN(have - head_len, body_len);
+        bool reusable = upload ? have - head_len <= body_len
+                               : framed && body_len - body_buffered <= HTTP_DISCARD_MAX;
+
+        // Пока соединение простаивает, воркер занят. Если своей очереди ждут другие клиенты,
+        // этот ответ последний
+        keep_alive = reusable && wants_keep_alive(recv_buf) && served + 1 < HTTP_KEEPALIVE_MAX &&
+                     uxQueueMessagesWaiting(s_client_queue) == 0;
+        http_writer_begin(&conn.w, keep_alive, !is_http10(recv_buf));
+        char value[64];
+        conn.accepts_gzip = get_header_value(recv_buf, "Accept-Encoding", value, sizeof(value)) && strstr(value, "gzip");
+        bool update = asset_image_busy() || firmware_busy();
+        int64_t started = esp_timer_get_time();
+        if (!upload) count_response(true);
+        if (path_ok) {
+            route_request(&conn, recv_buf, have, req_path);
+        } else {
+            // Тело запроса, если оно есть, не читали: после ответа закрываем
+            conn.w.keep_alive = false;
+            send_error(&conn, "400 Bad Request");
+        }
+        if (!upload) {
+            count_response(false);
+            record_latency(update, esp_timer_get_time() - started);
+        }
+        // Дальше соединение обслуживает задача websocket
+        if (conn.detached) return;
+        // Оборванный ответ или тело до закрытия соединения: следующего запроса не будет
+        keep_alive = conn.w.keep_alive;
+        if (!keep_alive) break;
+
+        // Следующий запрос мог прийти вместе с этим: сдвигаем его в начало буфера
+        size_t consumed = upload ? have : head_len + body_buffered;
+        memmove(recv_buf, recv_buf + consumed, have - consumed);
+        have -= consumed;
+        if (!upload && !discard_body(conn.tc, recv_buf, body_len - body_buffered)) break;
+    }
+
+    close_conn(&conn, true);
+}
+
+/* 503 соединению, которому не досталось буферов: без сегмента http_writer пишет сразу в транспорт */
+static void reject_busy(transport_conn_t *tc) {
+    http_conn_t conn = {};
+    conn.tc = tc;
+    http_writer_init(&conn.w, tc, NULL);
+    http_writer_begin(&conn.w, false, false);
+    send_503(&conn);
+}
+
+/* Обработка одного соединения */
+static void handle_client(client_t *client) {
+    char *recv_buf = (char *)mem_pool_acquire(&s_recv_pool);
+    uint8_t *segment = (uint8_t *)mem_pool_acquire(&s_segment_pool);
+    if (!recv_buf || !segment) {
+        // Буферов по одному на воркера, сюда попасть не должны
+        reject_busy(&client->conn);
+        close_client(&client->conn, true);
+    } else {
+        serve_requests(client, recv_buf, segment);
+    }
+    mem_pool_release(&s_segment_pool, segment);
+    mem_pool_release(&s_recv_pool, recv_buf);
+}
+
+/* Воркер: обрабатывает соединения из очереди */
+static void http_worker_task(void *pv) {
+    while (1) {
+        client_t *client;
+        if (xQueueReceive(s_client_queue, &client, portMAX_DELAY) == pdTRUE) {
+            if (esp_timer_get_time() - client->accepted_us > HTTP_QUEUE_DEADLINE_MS * 1000LL) {
+                // Очередь не разбирается: просим повторить, а не отвечаем еще позже
+                STAT_INC(queue_sheds);
+                reject_busy(&client->conn);
+                transport_close(&client->conn, false);
+            } else {
+                handle_client(client);
+            }
+            mem_pool_release(&s_conn_pool, client);
+        }
+    }
+}
+
+static http_listener_t s_listeners[] = {
+    { HTTP_TRANSPORT, SERVER_PORT },
+#if HTTP_COMPARE_PORT
+    { HTTP_TRANSPORT == TRANSPORT_SOCKET ? TRANSPORT_NETCONN : TRANSPORT_SOCKET, HTTP_COMPARE_PORT },
+#endif
+};
+
+/* После переподключения Wi-Fi адрес сменился: будим accept, чтобы сервер пересоздал слушателей */
+static void on_ip_changed(void) {
+    for (size_t i = 0; i < sizeof(s_listeners) / sizeof(s_listeners[0]); i++) {
+        s_listeners[i].rebind = true;
+        if (s_listeners[i].ready) transport_listener_wake(&s_listeners[i].listener);
+    }
+}
+
+/* Серверная задача: принимает соединения на своем слушателе и раздает их воркерам */
+static void http_server_task(void *pv) {
+    http_listener_t *l = (http_listener_t *)pv;
+    // Слушать имеет смысл только после получения IP
+    boot_wait(BOOT_PHASE_WIFI, BOOT_WAIT_FOREVER);
+
+    // Не удалось создать сервер - удаляем задачу, чтобы не тратить на задачу ресурсы
+    if (transport_listen(l->kind, l->port, &l->listener) != ESP_OK) {
         vTaskDelete(NULL);
         return;
     }
+    l->ready = true;
 
-    ESP_LOGI(TAG, "HTTP server listening on port %d", SERVER_PORT);
+    ESP_LOGI(TAG, "HTTP server listening on port %d (%s)", l->port, transport_name(l->kind));
+    if (l == &s_listeners[0]) boot_mark(BOOT_PHASE_LISTEN);
 
     while (1) {
-        struct sockaddr_in6 client_addr;
-        u32_t addr_len = sizeof(client_addr);
-        int client_sock = accept(listen_sock, (struct sockaddr *)&client_addr, &addr_len);
-        if (client_sock < 0) {
-            ESP_LOGW(TAG, "Unable to accept connection: errno %d", errno);
+        transport_conn_t conn;
+        esp_err_t err = transport_accept(&l->listener, &conn);
+        if (err != ESP_OK) {
+            if (l->rebind) {
+                l->rebind = false;
+                l->ready = false;
+                transport_listener_close(&l->listener);
+                // Стек может быть еще не готов к новому адресу: повторяем, пока не выйдет
+                while (transport_listen(l->kind, l->port, &l->listener) != ESP_OK) vTaskDelay(pdMS_TO_TICKS(1000));
+                l->ready = true;
+                ESP_LOGI(TAG, "HTTP server rebound on port %d", l->port);
+                continue;
+            }
+            // ENFILE/ENOMEM здесь - признак того, что кончились сокеты или PCB
+            if (err != ESP_ERR_TIMEOUT) STAT_INC(accept_errors);
             continue;
         }
-        handle_client(client_sock);
-        // Даем контроллеру решать другие задачи (опционально)
-        // vTaskDelay(pdMS_TO_TICKS(300));
+        if (conn.ipv6) {
+            STAT_INC(ipv6_clients);
+        } else {
+            STAT_INC(ipv4_clients);
+        }
+        wifi_ps_activity();
+
+        client_t *client = (client_t *)mem_pool_acquire(&s_conn_pool);
+        if (!client) {
+            // Контекстов столько же, сколько сокетов: сюда попадаем, только если соединения
+            // открыты через оба транспорта сразу. Лучше сразу попросить повторить
+            STAT_INC(shed);
+            reject_busy(&conn);
+            transport_close(&conn, false);
+            continue;
+        }
+        client->conn = conn;
+        // Режим сна модема запоминаем до того, как соединение его разбудит
+        client->accepted_us = esp_timer_get_time();
+        client->ps_mode = wifi_ps_mode();
+        // Соединение обработает первый свободный воркер. Контекстов не больше, чем мест
+        // в очереди, так что здесь не ждем
+        xQueueSend(s_client_queue, &client, portMAX_DELAY);
     }
 
     // В любом адекватном сценарии сюда нельзя добраться.
-    close(listen_sock);
+    transport_listener_close(&l->listener);
     vTaskDelete(NULL);
 }
 
 /* Монтируем SPIFFS */
 static esp_err_t init_spiffs(void) {
-    esp_vfs_spiffs_conf_t conf = {
-        .base_path = SPIFFS_BASE_PATH,
-        .partition_label = SPIFFS_PART_LABEL,
-        .max_files = SPIFFS_MAX_FILES,
-        .format_if_mount_failed = SPIFFS_FORMAT_IF_MOUNT_FAILED
-    };
-    esp_err_t ret = esp_vfs_spiffs_register(&conf);
+    // Какой из разделов A/B активен, помнит NVS
+    esp_err_t ret = asset_image_mount(SPIFFS_BASE_PATH, SPIFFS_MAX_FILES, SPIFFS_FORMAT_IF_MOUNT_FAILED);
     if (ret != ESP_OK) {
         if (ret == ESP_FAIL) {
             ESP_LOGE(TAG, "Failed to mount or format filesystem");
@@ -281,25 +1532,105 @@ static esp_err_t init_spiffs(void) {
     }
 
     size_t total = 0, used = 0;
-    esp_spiffs_info(NULL, &total, &used);
+    esp_spiffs_info(asset_image_label(), &total, &used);
     ESP_LOGI(TAG, "SPIFFS mounted. total: %d, used: %d", (int)total, (int)used);
     return ESP_OK;
 }
 
-extern "C" void app_main(void) {
-    // Инициализируем Wi-Fi. Здесь я использую типовой для своих проектов заголовочный файл
-    // Если за пять попыток не удается подключиться, то контроллер перестанет стучаться, и нужно
-    // перезагружать девайс программно или руками. 
+/* Этапы старта. Wi-Fi и SPIFFS не зависят друг от друга и идут параллельно */
+static esp_err_t boot_wifi(void) {
+    // Инициализируем Wi-Fi. Здесь я использую типовой для своих проектов заголовочный файл.
+    // Возвращается после первого получения IP, дальше переподключается сам, сколько бы ни понадобилось.
     // Для обратной связи есть флаги `wifi_conection_established` и `wifi_conection_failed` - для управления обратной связью
+    wifi_set_ip_changed_cb(on_ip_changed);
     wifi_init_sta();
-    esp_err_t r = init_spiffs();
-    if (r != ESP_OK) {
-        ESP_LOGE(TAG, "SPIFFS init failed");
-        // можно продолжить, но сервер не будет отдавать файлы. Можно сделать ребут
-        // устройства через `esp_restart` на прод девайсе. Ошибка может исчезнуть при
-        // перезагрузке.
-        // esp_restart();
+    return ESP_OK;
+}
+
+static esp_err_t boot_index(void) {
+    upload_init(SPIFFS_BASE_PATH);
+    esp_err_t r = asset_index_build(SPIFFS_BASE_PATH);
+    if (r == ESP_OK) hitstats_init();
+    return r;
+}
+
+static esp_err_t boot_warm(void) {
+    return warmup_run(SPIFFS_BASE_PATH);
+}
+
+/* Первый старт после обновления: прошивка остается, если поднялась сама - смонтировала ФС, построила
+ * индекс и запустила задачи сервера. Сеть не ждем: без точки доступа исправная прошивка не должна
+ * откатываться, а падения до подтверждения и так откатит загрузчик */
+static esp_err_t boot_confirm(void) {
+    if (!firmware_pending_verify()) return ESP_OK;
+    int64_t deadline = esp_timer_get_time() + (int64_t)FIRMWARE_CONFIRM_MS * 1000;
+    static const boot_phase_t phases[] = { BOOT_PHASE_FS, BOOT_PHASE_INDEX, BOOT_PHASE_TASKS };
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        int64_t left_ms = (deadline - esp_timer_get_time()) / 1000;
+        if (!boot_wait(phases[i], left_ms > 0 ? (uint32_t)left_ms : 0)) {
+            ESP_LOGE(TAG, "Boot phase %d not reached, rolling back firmware", (int)phases[i]);
+            firmware_reject();
+        }
+    }
+    return firmware_confirm();
+}
+
+static const boot_stage_t s_boot_stages[] = {
+    { "boot_wifi",  BOOT_PHASE_WIFI,  0,                          boot_wifi,   BOOT_STAGE_STACK, 5 },
+    // можно продолжить без SPIFFS, но сервер будет отдавать только вшитые файлы. Можно сделать
+    // ребут устройства через `esp_restart` на прод девайсе. Ошибка может исчезнуть при перезагрузке.
+    { "boot_fs",    BOOT_PHASE_FS,    0,                          init_spiffs, BOOT_STAGE_STACK, 5 },
+    { "boot_index", BOOT_PHASE_INDEX, BOOT_DEP(BOOT_PHASE_FS),    boot_index,  BOOT_STAGE_STACK, 5 },
+    // Прогрев идет параллельно с работой сервера: первые запросы просто подключатся к загрузке
+    { "boot_warm",  BOOT_PHASE_WARM,  BOOT_DEP(BOOT_PHASE_INDEX), boot_warm,   BOOT_STAGE_STACK, 3 },
+    // Зависимости ждет сам: при неудаче этап не просто висит, а откатывает прошивку. Wi-Fi не ждет
+    { "boot_confirm", BOOT_PHASE_FIRMWARE, 0,                     boot_confirm, BOOT_STAGE_STACK, 3 },
+};
+
+extern "C" void app_main(void) {
+    boot_init();
+    init_nvs();
+    embedded_init();
+    ESP_ERROR_CHECK(file_pool_init());
+    cache_init();
+    upload_writer_init();
+    firmware_init();
+    ESP_ERROR_CHECK(websocket_init());
+    // wifi_init_sta выставляет WIFI_PS_MAX_MODEM, с него контроллер и начинает
+    ESP_ERROR_CHECK(wifi_ps_init(NULL, WIFI_PS_MAX_MODEM));
+
+    for (size_t i = 0; i < sizeof(s_boot_stages) / sizeof(s_boot_stages[0]); i++) {
+        boot_stage_start(&s_boot_stages[i]);
     }
 
-    xTaskCreate(http_server_task, "http_server", 8192, NULL, 5, NULL);
+    // Воркеры стартуют сразу, сервер начнет слушать, как только будет IP. Пока SPIFFS
+    // монтируется, index.html отдается из прошивки, остальные запросы ждут индекса файлов
+    s_client_queue = xQueueCreate(CLIENT_QUEUE_LEN, sizeof(client_t *));
+    ESP_ERROR_CHECK(mem_pool_init(&s_conn_pool, "conn", sizeof(client_t), CONN_POOL_SIZE, POOL_CAPS));
+    ESP_ERROR_CHECK(mem_pool_init(&s_recv_pool, "recv", RECV_BUF_LEN + 1, RECV_POOL_SIZE, POOL_CAPS));
+    ESP_ERROR_CHECK(mem_pool_init(&s_chunk_pool, "chunk", FILE_CHUNK, CHUNK_POOL_SIZE, POOL_CAPS));
+    ESP_ERROR_CHECK(mem_pool_init(&s_segment_pool, "segment", HTTP_WRITER_BUF_LEN, SEGMENT_POOL_SIZE, POOL_CAPS));
+    ESP_ERROR_CHECK(mem_pool_init(&s_json_pool, "json", DIAG_BUF_LEN, JSON_POOL_SIZE, POOL_CAPS));
+    ESP_ERROR_CHECK(mem_pool_init(&s_gzip_pool, "gzip", sizeof(gzip_ctx_t), GZIP_POOL_SIZE, POOL_CAPS));
+    ESP_ERROR_CHECK(mem_pool_init(&s_inflate_pool, "inflate", sizeof(inflate_stream_t), INFLATE_POOL_SIZE,
+                                  INFLATE_POOL_CAPS));
+
+    bool started = true;
+    for (int i = 0; i < HTTP_WORKER_COUNT; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "http_worker%d", i);
+        TaskHandle_t worker = NULL;
+        started &= xTaskCreate(http_worker_task, name, WORKER_TASK_STACK, NULL, 5, &worker) == pdPASS;
+        diag_register_task(worker);
+    }
+
+    for (size_t i = 0; i < sizeof(s_listeners) / sizeof(s_listeners[0]); i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "http_server%d", (int)i);
+        TaskHandle_t server_task = NULL;
+        started &= xTaskCreate(http_server_task, name, SERVER_TASK_STACK, &s_listeners[i], 5, &server_task) == pdPASS;
+        diag_register_task(server_task);
+    }
+    // Без этой отметки обновленная прошивка не подтвердит себя
+    if (started) boot_mark(BOOT_PHASE_TASKS);
 }
@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "mem_pool.h"
+
+static const char *TAG = "mem_pool";
+
+static mem_pool_t *s_pools[MEM_POOL_MAX];
+static int s_pool_count = 0;
+
+esp_err_t mem_pool_init(mem_pool_t *pool, const char *name, size_t block_size, uint16_t count, uint32_t caps) {
+    // В свободном блоке лежит указатель, и блоки должны оставаться выровненными
+    block_size = (block_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    memset(pool, 0, sizeof(*pool));
+    pool->storage = (uint8_t *)heap_caps_malloc(block_size * count, caps);
+    if (!pool->storage) {
+        ESP_LOGE(TAG, "No memory for pool %s (%u x %u)", name, (unsigned)count, (unsigned)block_size);
+        return ESP_ERR_NO_MEM;
+    }
+    pool->name = name;
+    pool->block_size = block_size;
+    pool->count = count;
+    portMUX_INITIALIZE(&pool->mux);
+    for (int i = count - 1; i >= 0; i--) {
+        void *block = pool->storage + i * block_size;
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+    }
+    if (s_pool_count < MEM_POOL_MAX) s_pools[s_pool_count++] = pool;
+    return ESP_OK;
+}
+
+void *mem_pool_acquire(mem_pool_t *pool) {
+    portENTER_CRITICAL(&pool->mux);
+    void *block = pool->free_list;
+    if (block) {
+        pool->free_list = *(void **)block;
+        pool->acquires++;
+        if (++pool->in_use > pool->peak) pool->peak = pool->in_use;
+    } else {
+        pool->failures++;
+    }
+    portEXIT_CRITICAL(&pool->mux);
+    return block;
+}
+
+void mem_pool_release(mem_pool_t *pool, void *block) {
+    if (!block) return;
+    portENTER_CRITICAL(&pool->mux);
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->in_use--;
+    portEXIT_CRITICAL(&pool->mux);
+}
+
+int mem_pool_count(void) {
+    return s_pool_count;
+}
+
+void mem_pool_get_stats(int index, mem_pool_stats_t *stats) {
+    mem_pool_t *pool = s_pools[index];
+    portENTER_CRITICAL(&pool->mux);
+    stats->name = pool->name;
+    stats->block_size = pool->block_size;
+    stats->count = pool->count;
+    stats->in_use = pool->in_use;
+    stats->peak = pool->peak;
+    stats->acquires = pool->acquires;
+    stats->failures = pool->failures;
+    portEXIT_CRITICAL(&pool->mux);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+/* Сколько пулов видно в /_diag */
+#define MEM_POOL_MAX 8
+
+/* Пул блоков одного размера. Память берется из кучи один раз при старте, дальше
+ * блоки только переходят между списком свободных и пользователями: куча не дробится */
+typedef struct {
+    const char *name;
+    size_t block_size;
+    uint16_t count;
+    uint8_t *storage;
+    void *free_list;         // свободный блок хранит указатель на следующий
+    uint16_t in_use;
+    uint16_t peak;
+    uint32_t acquires;
+    uint32_t failures;       // пул был пуст
+    portMUX_TYPE mux;
+} mem_pool_t;
+
+typedef struct {
+    const char *name;
+    size_t block_size;
+    uint16_t count;
+    uint16_t in_use;
+    uint16_t peak;
+    uint32_t acquires;
+    uint32_t failures;
+} mem_pool_stats_t;
+
+/* Выделяем `count` блоков по `block_size` байт из памяти с `caps` и регистрируем пул для /_diag */
+esp_err_t mem_pool_init(mem_pool_t *pool, const char *name, size_t block_size, uint16_t count, uint32_t caps);
+
+/* Свободный блок или NULL, если пул исчерпан. Не ждет */
+void *mem_pool_acquire(mem_pool_t *pool);
+
+void mem_pool_release(mem_pool_t *pool, void *block);
+
+/* Зарегистрированные пулы */
+int mem_pool_count(void);
+void mem_pool_get_stats(int index, mem_pool_stats_t *stats);
@@ -0,0 +1,132 @@
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "mime.h"
+
+#define MIME_DEFAULT "application/octet-stream"
+
+namespace {
+
+struct mime_entry {
+    const char *ext;
+    const char *type;
+};
+
+/* Встроенные типы. Расширения только в нижнем регистре */
+constexpr mime_entry k_builtin[] = {
+    { "html",        "text/html; charset=utf-8" },
+    { "htm",         "text/html; charset=utf-8" },
+    { "css",         "text/css" },
+    { "js",          "application/javascript" },
+    { "mjs",         "application/javascript" },
+    { "json",        "application/json" },
+    { "map",         "application/json" },
+    { "webmanifest", "application/manifest+json" },
+    { "wasm",        "application/wasm" },
+    { "xml",         "application/xml" },
+    { "png",         "image/png" },
+    { "jpg",         "image/jpeg" },
+    { "jpeg",        "image/jpeg" },
+    { "gif",         "image/gif" },
+    { "svg",         "image/svg+xml" },
+    { "ico",         "image/x-icon" },
+    { "webp",        "image/webp" },
+    { "avif",        "image/avif" },
+    { "woff",        "font/woff" },
+    { "woff2",       "font/woff2" },
+    { "ttf",         "font/ttf" },
+    { "txt",         "text/plain; charset=utf-8" },
+};
+constexpr size_t k_builtin_count = sizeof(k_builtin) / sizeof(k_builtin[0]);
+
+/* Размер таблицы (степень двойки) и максимальная длина расширения */
+constexpr size_t k_slots = 64;
+constexpr size_t k_ext_max = 11;
+
+constexpr size_t const_strlen(const char *s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+constexpr char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+/* FNV-1a с затравкой, регистр не учитывается */
+constexpr uint32_t ext_hash(const char *s, size_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)lower(s[i]);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+constexpr bool seed_is_perfect(uint32_t seed) {
+    bool used[k_slots] = {};
+    for (size_t i = 0; i < k_builtin_count; i++) {
+        size_t slot = ext_hash(k_builtin[i].ext, const_strlen(k_builtin[i].ext), seed) & (k_slots - 1);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+/* Подбираем затравку, при которой у встроенных расширений нет коллизий */
+constexpr uint32_t find_seed() {
+    for (uint32_t seed = 1; seed < 100000; seed++) {
+        if (seed_is_perfect(seed)) return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t k_seed = find_seed();
+static_assert(k_seed != 0, "no perfect hash seed for builtin MIME table");
+
+struct slot_table {
+    int8_t index[k_slots];
+};
+
+constexpr slot_table build_table() {
+    slot_table t = {};
+    for (size_t i = 0; i < k_slots; i++) t.index[i] = -1;
+    for (size_t i = 0; i < k_builtin_count; i++) {
+        t.index[ext_hash(k_builtin[i].ext, const_strlen(k_builtin[i].ext), k_seed) & (k_slots - 1)] = (int8_t)i;
+    }
+    return t;
+}
+
+constexpr slot_table k_table = build_table();
+
+mime_entry s_extra[MIME_EXTRA_MAX];
+int s_extra_count = 0;
+
+} // namespace
+
+const char *mime_lookup(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return MIME_DEFAULT;
+    ext++; // skip '.'
+    size_t len = strlen(ext);
+
+    if (len <= k_ext_max) {
+        int8_t i = k_table.index[ext_hash(ext, len, k_seed) & (k_slots - 1)];
+        if (i >= 0 && strcasecmp(k_builtin[i].ext, ext) == 0) return k_builtin[i].type;
+    }
+
+    for (int i = 0; i < s_extra_count; i++) {
+        if (strcasecmp(s_extra[i].ext, ext) == 0) return s_extra[i].type;
+    }
+    return MIME_DEFAULT;
+}
+
+bool mime_register(const char *ext, const char *type) {
+    if (!ext || !type || s_extra_count >= MIME_EXTRA_MAX) return false;
+    s_extra[s_extra_count].ext = ext;
+    s_extra[s_extra_count].type = type;
+    s_extra_count++;
+    return true;
+}
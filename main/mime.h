@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Сколько типов можно добавить через mime_register */
+#define MIME_EXTRA_MAX 16
+
+/* Тип по расширению файла из `path`. Встроенные расширения разрешаются за одну пробу
+ * совершенной хеш-таблицы, остальные ищутся среди зарегистрированных */
+const char *mime_lookup(const char *path);
+
+/* Регистрируем дополнительный тип (расширение без точки). Вызывать до старта сервера,
+ * `ext` и `type` должны жить всё время работы. false, если место кончилось */
+bool mime_register(const char *ext, const char *type);
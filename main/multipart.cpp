@@ -0,0 +1,176 @@
+#include <string.h>
+#include <strings.h>
+
+#include "multipart.h"
+
+/* Значение параметра `key` (boundary, name, filename) в строке заголовка [p, end).
+ * Параметр начинается после ';' или пробела, значение может быть в кавычках */
+static bool header_param(const char *p, const char *end, const char *key, char *buf, size_t buflen) {
+    size_t key_len = strlen(key);
+    for (const char *s = p; s + key_len < end; s++) {
+        if ((s > p && s[-1] != ';' && s[-1] != ' ') || strncasecmp(s, key, key_len) != 0 || s[key_len] != '=') continue;
+        const char *v = s + key_len + 1;
+        const char *v_end;
+        if (v < end && *v == '"') {
+            v++;
+            v_end = (const char *)memchr(v, '"', end - v);
+            if (!v_end) return false;
+        } else {
+            v_end = v;
+            while (v_end < end && *v_end != ';' && *v_end != ' ' && *v_end != '\r') v_end++;
+        }
+        size_t len = v_end - v;
+        if (len >= buflen) return false;
+        memcpy(buf, v, len);
+        buf[len] = 0;
+        return true;
+    }
+    return false;
+}
+
+esp_err_t multipart_begin(multipart_t *mp, const char *content_type, const multipart_handler_t *handler) {
+    if (strncasecmp(content_type, "multipart/form-data", 19) != 0) return ESP_ERR_INVALID_ARG;
+    char boundary[MULTIPART_BOUNDARY_MAX + 1];
+    if (!header_param(content_type, content_type + strlen(content_type), "boundary", boundary, sizeof(boundary)) ||
+        !boundary[0]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memset(mp, 0, sizeof(*mp));
+    mp->handler = *handler;
+    mp->delim_len = strlen(boundary) + 4;
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, boundary, mp->delim_len - 4);
+
+    // Префикс-функция: при несовпадении откатываемся, не теряя уже совпавшие байты
+    mp->fail[0] = 0;
+    for (int i = 1, k = 0; i < mp->delim_len; i++) {
+        while (k > 0 && mp->delim[i] != mp->delim[k]) k = mp->fail[k - 1];
+        if (mp->delim[i] == mp->delim[k]) k++;
+        mp->fail[i] = k;
+    }
+    // Первый разделитель стоит в самом начале тела, без CRLF перед ним
+    mp->state = MULTIPART_PREAMBLE;
+    mp->match = 2;
+    return ESP_OK;
+}
+
+static esp_err_t emit(multipart_t *mp, const uint8_t *data, size_t len) {
+    if (mp->state != MULTIPART_DATA || len == 0) return ESP_OK;
+    return mp->handler.part_data(mp->handler.arg, data, len);
+}
+
+/* Ищем разделитель. Все, что до него, - данные части. Байты, похожие на начало разделителя,
+ * придерживаем до следующего куска. `*used` - сколько байт куска разобрано */
+static esp_err_t scan(multipart_t *mp, const uint8_t *p, size_t len, size_t *used, bool *found) {
+    const uint8_t *run = NULL;
+    esp_err_t err = ESP_OK;
+    size_t i = 0;
+    *found = false;
+    while (i < len && err == ESP_OK) {
+        uint8_t c = p[i++];
+        while (1) {
+            if (c == (uint8_t)mp->delim[mp->match]) {
+                if (mp->match == 0 && run) {
+                    err = emit(mp, run, p + i - 1 - run);
+                    run = NULL;
+                }
+                mp->match++;
+                break;
+            }
+            if (mp->match == 0) {
+                if (!run) run = p + i - 1;
+                break;
+            }
+            // Придержанные байты все-таки данные, кроме тех, что снова похожи на начало разделителя
+            uint8_t keep = mp->fail[mp->match - 1];
+            if (err == ESP_OK) err = emit(mp, (const uint8_t *)mp->delim, mp->match - keep);
+            mp->match = keep;
+        }
+        if (mp->match == mp->delim_len) {
+            mp->match = 0;
+            *found = true;
+            break;
+        }
+    }
+    if (err == ESP_OK && run) err = emit(mp, run, p + i - run);
+    *used = i;
+    return err;
+}
+
+/* Заголовки части собраны: достаем имя поля и файла */
+static esp_err_t part_begin(multipart_t *mp) {
+    char name[32] = "";
+    char filename[MULTIPART_FILENAME_MAX] = "";
+    const char *end = mp->head + mp->head_len;
+    for (const char *line = mp->head; line < end;) {
+        const char *eol = (const char *)memchr(line, '\r', end - line);
+        if (!eol) eol = end;
+        if (strncasecmp(line, "Content-Disposition:", 20) == 0) {
+            header_param(line + 20, eol, "name", name, sizeof(name));
+            header_param(line + 20, eol, "filename", filename, sizeof(filename));
+        }
+        line = eol + 2;
+    }
+    return mp->handler.part_begin(mp->handler.arg, name, filename);
+}
+
+esp_err_t multipart_feed(multipart_t *mp, const uint8_t *data, size_t len) {
+    esp_err_t err = ESP_OK;
+    while (len && err == ESP_OK) {
+        switch (mp->state) {
+        case MULTIPART_PREAMBLE:
+        case MULTIPART_DATA: {
+            size_t used;
+            bool found;
+            err = scan(mp, data, len, &used, &found);
+            data += used;
+            len -= used;
+            if (err == ESP_OK && found) {
+                if (mp->state == MULTIPART_DATA) err = mp->handler.part_end(mp->handler.arg);
+                mp->state = MULTIPART_AFTER_DELIM;
+                mp->after_len = 0;
+            }
+            break;
+        }
+        case MULTIPART_AFTER_DELIM:
+            mp->after[mp->after_len++] = *data++;
+            len--;
+            if (mp->after_len < 2) break;
+            if (memcmp(mp->after, "--", 2) == 0) {
+                mp->state = MULTIPART_DONE;
+            } else if (memcmp(mp->after, "\r\n", 2) == 0) {
+                mp->state = MULTIPART_HEAD;
+                mp->head_len = 0;
+            } else {
+                err = ESP_ERR_INVALID_RESPONSE;
+            }
+            break;
+        case MULTIPART_HEAD:
+            if (mp->head_len >= sizeof(mp->head)) {
+                err = ESP_ERR_INVALID_RESPONSE;
+                break;
+            }
+            mp->head[mp->head_len++] = *data++;
+            len--;
+            if (mp->head_len >= 4 && memcmp(mp->head + mp->head_len - 4, "\r\n\r\n", 4) == 0) {
+                mp->head_len -= 2;
+                err = part_begin(mp);
+                mp->state = MULTIPART_DATA;
+                mp->match = 0;
+            }
+            break;
+        case MULTIPART_DONE:
+            // Эпилог после завершающего разделителя ничего не значит
+            len = 0;
+            break;
+        case MULTIPART_ERROR:
+            return ESP_ERR_INVALID_RESPONSE;
+        }
+    }
+    if (err != ESP_OK) mp->state = MULTIPART_ERROR;
+    return err;
+}
+
+bool multipart_done(const multipart_t *mp) {
+    return mp->state == MULTIPART_DONE;
+}
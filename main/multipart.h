@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/* Потоковый разбор multipart/form-data (RFC 7578). Тело подается кусками любого размера,
+ * данные частей отдаются сразу: в памяти держатся только заголовки текущей части */
+#define MULTIPART_BOUNDARY_MAX 70
+#define MULTIPART_HEAD_MAX 512
+#define MULTIPART_FILENAME_MAX 64
+
+/* Обработчики частей. Ошибка любого из них прерывает разбор с тем же кодом */
+typedef struct {
+    /* Началась часть. `filename` пустой у обычных полей формы */
+    esp_err_t (*part_begin)(void *arg, const char *name, const char *filename);
+    esp_err_t (*part_data)(void *arg, const uint8_t *data, size_t len);
+    esp_err_t (*part_end)(void *arg);
+    void *arg;
+} multipart_handler_t;
+
+typedef enum {
+    MULTIPART_PREAMBLE,
+    MULTIPART_AFTER_DELIM,  // после разделителя: "\r\n" - следующая часть, "--" - конец
+    MULTIPART_HEAD,
+    MULTIPART_DATA,
+    MULTIPART_DONE,
+    MULTIPART_ERROR,
+} multipart_state_t;
+
+typedef struct {
+    multipart_handler_t handler;
+    multipart_state_t state;
+    char delim[MULTIPART_BOUNDARY_MAX + 5];  // "\r\n--" + boundary
+    uint8_t fail[MULTIPART_BOUNDARY_MAX + 4]; // префикс-функция delim для поиска по кускам
+    uint8_t delim_len;
+    uint8_t match;                            // сколько байт delim совпало к концу прошлого куска
+    char after[2];
+    uint8_t after_len;
+    char head[MULTIPART_HEAD_MAX];
+    size_t head_len;
+} multipart_t;
+
+/* Границу берем из Content-Type запроса. ESP_ERR_INVALID_ARG - это не multipart/form-data */
+esp_err_t multipart_begin(multipart_t *mp, const char *content_type, const multipart_handler_t *handler);
+
+/* Очередной кусок тела. ESP_ERR_INVALID_RESPONSE - тело не разбирается */
+esp_err_t multipart_feed(multipart_t *mp, const uint8_t *data, size_t len);
+
+/* Тело закончилось на завершающем разделителе */
+bool multipart_done(const multipart_t *mp);
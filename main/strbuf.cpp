@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "strbuf.h"
+
+void strbuf_appendf(char *buf, size_t buflen, size_t *pos, const char *fmt, ...) {
+    if (*pos >= buflen) return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *pos, buflen - *pos, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    *pos += (size_t)n;
+    if (*pos >= buflen) *pos = buflen - 1;
+}
+
+void strbuf_append_json(char *buf, size_t buflen, size_t *pos, const char *str) {
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        char esc[8];
+        int n;
+        if (*c == '"' || *c == '\\') {
+            n = snprintf(esc, sizeof(esc), "\\%c", *c);
+        } else if (*c < 0x20) {
+            n = snprintf(esc, sizeof(esc), "\\u%04x", *c);
+        } else {
+            esc[0] = *c;
+            n = 1;
+        }
+        if (*pos + n >= buflen) break;
+        memcpy(buf + *pos, esc, n);
+        *pos += n;
+        buf[*pos] = 0;
+    }
+}
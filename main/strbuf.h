@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Дописываем форматированную строку в `buf` (buflen bytes) с позиции `*pos`,
+ * не выходя за границы. При нехватке места строка обрезается */
+void strbuf_appendf(char *buf, size_t buflen, size_t *pos, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+/* Дописываем `str` как содержимое строки JSON: кавычки, обратная косая черта и управляющие
+ * символы экранируются. Не влезает - обрезаем по целому символу */
+void strbuf_append_json(char *buf, size_t buflen, size_t *pos, const char *str);
@@ -0,0 +1,423 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "lwip/api.h"
+#include "lwip/tcp.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include "transport.h"
+
+static const char *TAG = "transport";
+
+/* Реализация одного транспорта */
+typedef struct {
+    const char *name;
+    esp_err_t (*listen)(uint16_t port, transport_listener_t *listener);
+    esp_err_t (*accept)(transport_listener_t *listener, transport_conn_t *conn);
+    void (*wake)(transport_listener_t *listener);
+    void (*close_listener)(transport_listener_t *listener);
+    int (*recv)(transport_conn_t *conn, void *buf, size_t len);
+    void (*set_recv_timeout)(transport_conn_t *conn, int ms);
+    bool (*send)(transport_conn_t *conn, const void *data, size_t len, bool nocopy, bool more);
+    bool (*send_nowait)(transport_conn_t *conn, const void *data, size_t len, bool more);
+    void (*close)(transport_conn_t *conn, bool reset);
+    bool zero_copy;
+    bool aborts;        // close с reset всегда дает RST
+} transport_ops_t;
+
+static transport_stats_t s_stats[TRANSPORT_COUNT];
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* ---------- BSD-сокеты ---------- */
+
+/* Адрес клиента текстом. IPv4-клиенты двойного стека приходят как ::ffff:a.b.c.d,
+ * их показываем и считаем как IPv4. Возвращает true для настоящего IPv6 */
+static bool format_peer(const struct sockaddr_storage *addr, char *buf, size_t buflen) {
+    if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)addr;
+        static const uint8_t v4_mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+        if (memcmp(a6->sin6_addr.s6_addr, v4_mapped, sizeof(v4_mapped)) == 0) {
+            inet_ntop(AF_INET, &a6->sin6_addr.s6_addr[12], buf, buflen);
+            return false;
+        }
+        inet_ntop(AF_INET6, &a6->sin6_addr, buf, buflen);
+        return true;
+    }
+    inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, buflen);
+    return false;
+}
+
+/* С IPv6 в lwIP сокет AF_INET6 на in6addr_any принимает и IPv4, и IPv6 (если не задан IPV6_V6ONLY) */
+static esp_err_t sock_listen(uint16_t port, transport_listener_t *listener) {
+#if CONFIG_LWIP_IPV6
+    struct sockaddr_in6 server_addr;
+    int listen_sock = socket(AF_INET6, SOCK_STREAM, IPPROTO_IP);
+#else
+    struct sockaddr_in server_addr;
+    int listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+#endif
+
+    if (listen_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return ESP_FAIL;
+    }
+
+    int opt = 1;
+    // Разрешаем переиспользование адреса
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    memset(&server_addr, 0, sizeof(server_addr));
+#if CONFIG_LWIP_IPV6
+    server_addr.sin6_family = AF_INET6;
+    server_addr.sin6_addr = in6addr_any;
+    server_addr.sin6_port = htons(port);
+#else
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(port);
+#endif
+
+    // Привязываем сокет к адресу сервера
+    if (bind(listen_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(listen_sock);
+        return ESP_FAIL;
+    }
+
+    // Начинаем слушать сокет
+    if (listen(listen_sock, TRANSPORT_LISTEN_BACKLOG) != 0) {
+        ESP_LOGE(TAG, "Error during listen: errno %d", errno);
+        close(listen_sock);
+        return ESP_FAIL;
+    }
+    listener->sock = listen_sock;
+    return ESP_OK;
+}
+
+static esp_err_t sock_accept(transport_listener_t *listener, transport_conn_t *conn) {
+    struct sockaddr_storage client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    int sock = accept(listener->sock, (struct sockaddr *)&client_addr, &addr_len);
+    if (sock < 0) {
+        ESP_LOGW(TAG, "Unable to accept connection: errno %d", errno);
+        return ESP_FAIL;
+    }
+    conn->sock = sock;
+    conn->ipv6 = format_peer(&client_addr, conn->addr, sizeof(conn->addr));
+    struct timeval tv = { TRANSPORT_SEND_TIMEOUT_MS / 1000, (TRANSPORT_SEND_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return ESP_OK;
+}
+
+static void sock_wake(transport_listener_t *listener) {
+    int sock = listener->sock;
+    if (sock >= 0) shutdown(sock, SHUT_RDWR);
+}
+
+static void sock_close_listener(transport_listener_t *listener) {
+    close(listener->sock);
+    listener->sock = -1;
+}
+
+static int sock_recv(transport_conn_t *conn, void *buf, size_t len) {
+    int r = recv(conn->sock, buf, len, 0);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return TRANSPORT_RECV_TIMEOUT;
+    return r;
+}
+
+static void sock_set_recv_timeout(transport_conn_t *conn, int ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+static bool sock_send(transport_conn_t *conn, const void *data, size_t len, bool nocopy, bool more) {
+    /* Счетчик отправленных байтов */
+    size_t sent = 0;
+    // Отправляем данные в сокет, пока буфер не кончится
+    while (sent < len) {
+        ssize_t s = send(conn->sock, (const uint8_t *)data + sent, len - sent, more ? MSG_MORE : 0);
+        if (s < 0) {
+            ESP_LOGW(TAG, "send error");
+            return false;
+        }
+        sent += s;
+    }
+    return true;
+}
+
+/* Только то, что сразу помещается в буфер отправки сокета. Частичная запись - тоже неудача */
+static bool sock_send_nowait(transport_conn_t *conn, const void *data, size_t len, bool more) {
+    ssize_t s = send(conn->sock, data, len, MSG_DONTWAIT | (more ? MSG_MORE : 0));
+    return s == (ssize_t)len;
+}
+
+/* SO_LINGER {1, 0} в lwIP дает RST, только если в очереди остались неотправленные или
+ * неподтвержденные данные (клиент перестал читать). Иначе это обычное закрытие с FIN */
+static void sock_close(transport_conn_t *conn, bool reset) {
+    if (reset) {
+        struct linger lg = { 1, 0 };
+        setsockopt(conn->sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    } else {
+        shutdown(conn->sock, SHUT_RDWR);
+    }
+    close(conn->sock);
+}
+
+/* ---------- netconn ---------- */
+
+static esp_err_t nc_listen(uint16_t port, transport_listener_t *listener) {
+#if CONFIG_LWIP_IPV6
+    // IPv6-соединение на IP_ANY_TYPE принимает клиентов обоих стеков
+    struct netconn *nc = netconn_new(NETCONN_TCP_IPV6);
+    const ip_addr_t *any = IP_ANY_TYPE;
+#else
+    struct netconn *nc = netconn_new(NETCONN_TCP);
+    const ip_addr_t *any = IP_ADDR_ANY;
+#endif
+    if (!nc) {
+        ESP_LOGE(TAG, "Unable to create netconn");
+        return ESP_ERR_NO_MEM;
+    }
+    err_t err = netconn_bind(nc, any, port);
+    if (err == ERR_OK) err = netconn_listen_with_backlog(nc, TRANSPORT_LISTEN_BACKLOG);
+    if (err != ERR_OK) {
+        ESP_LOGE(TAG, "Netconn unable to listen on %u: %d", port, err);
+        netconn_delete(nc);
+        return ESP_FAIL;
+    }
+    // accept на netconn не разбудить из другой задачи: просыпаемся сами
+    netconn_set_recvtimeout(nc, TRANSPORT_ACCEPT_POLL_MS);
+    listener->nc = nc;
+    return ESP_OK;
+}
+
+static esp_err_t nc_accept(transport_listener_t *listener, transport_conn_t *conn) {
+    struct netconn *nc;
+    err_t err = netconn_accept(listener->nc, &nc);
+    if (err == ERR_TIMEOUT) return ESP_ERR_TIMEOUT;
+    if (err != ERR_OK) {
+        ESP_LOGW(TAG, "Unable to accept connection: %d", err);
+        return ESP_FAIL;
+    }
+    conn->nc = nc;
+    conn->rx = NULL;
+    conn->rx_offset = 0;
+    netconn_set_sendtimeout(nc, TRANSPORT_SEND_TIMEOUT_MS);
+
+    ip_addr_t addr;
+    u16_t port;
+    conn->ipv6 = false;
+    conn->addr[0] = 0;
+    if (netconn_peer(nc, &addr, &port) == ERR_OK) {
+#if CONFIG_LWIP_IPV6
+        if (IP_IS_V6(&addr) && ip6_addr_isipv4mappedipv6(ip_2_ip6(&addr))) {
+            ip4_addr_t v4;
+            unmap_ipv4_mapped_ipv6(&v4, ip_2_ip6(&addr));
+            ip4addr_ntoa_r(&v4, conn->addr, sizeof(conn->addr));
+            return ESP_OK;
+        }
+        conn->ipv6 = IP_IS_V6(&addr);
+#endif
+        ipaddr_ntoa_r(&addr, conn->addr, sizeof(conn->addr));
+    }
+    return ESP_OK;
+}
+
+static void nc_wake(transport_listener_t *listener) {
+}
+
+static void nc_close_listener(transport_listener_t *listener) {
+    netconn_delete(listener->nc);
+    listener->nc = NULL;
+}
+
+/* netconn отдает данные netbuf'ами: копируем из текущего, пока он не кончится */
+static int nc_recv(transport_conn_t *conn, void *buf, size_t len) {
+    if (!conn->rx) {
+        err_t err = netconn_recv(conn->nc, &conn->rx);
+        if (err == ERR_CLSD) return 0;
+        if (err == ERR_TIMEOUT) return TRANSPORT_RECV_TIMEOUT;
+        if (err != ERR_OK) return -1;
+        conn->rx_offset = 0;
+    }
+    u16_t n = netbuf_copy_partial(conn->rx, buf, len, conn->rx_offset);
+    conn->rx_offset += n;
+    if (conn->rx_offset >= netbuf_len(conn->rx)) {
+        netbuf_delete(conn->rx);
+        conn->rx = NULL;
+    }
+    return n;
+}
+
+static void nc_set_recv_timeout(transport_conn_t *conn, int ms) {
+    netconn_set_recvtimeout(conn->nc, ms);
+}
+
+/* С NETCONN_NOCOPY стек ссылается на буфер (PBUF_ROM), пока данные не подтверждены.
+ * Поэтому так отправляются только буферы, которые живут до закрытия соединения через RST:
+ * tcp_abort освобождает все его сегменты сразу */
+static bool nc_send(transport_conn_t *conn, const void *data, size_t len, bool nocopy, bool more) {
+    u8_t flags = nocopy ? NETCONN_NOCOPY : NETCONN_COPY;
+    if (more) flags |= NETCONN_MORE;
+    err_t err = netconn_write(conn->nc, data, len, flags);
+    if (err != ERR_OK) {
+        ESP_LOGW(TAG, "netconn write error %d", err);
+        return false;
+    }
+    return true;
+}
+
+static bool nc_send_nowait(transport_conn_t *conn, const void *data, size_t len, bool more) {
+    size_t written = 0;
+    err_t err = netconn_write_partly(conn->nc, data, len, NETCONN_COPY | NETCONN_DONTBLOCK | (more ? NETCONN_MORE : 0),
+                                     &written);
+    return err == ERR_OK && written == len;
+}
+
+typedef struct {
+    struct tcpip_api_call_data call;
+    struct netconn *nc;
+} nc_abort_t;
+
+/* В потоке tcpip. tcp_abort шлет RST и сразу освобождает PCB, netconn узнает об этом через свой err-колбэк */
+static err_t nc_abort_cb(struct tcpip_api_call_data *call) {
+    nc_abort_t *a = (nc_abort_t *)call;
+    if (a->nc->pcb.tcp) tcp_abort(a->nc->pcb.tcp);
+    return ERR_OK;
+}
+
+static void nc_close(transport_conn_t *conn, bool reset) {
+    if (conn->rx) {
+        netbuf_delete(conn->rx);
+        conn->rx = NULL;
+    }
+    if (reset) {
+        nc_abort_t a = {};
+        a.nc = conn->nc;
+        tcpip_api_call(nc_abort_cb, &a.call);
+    }
+    netconn_delete(conn->nc);
+}
+
+static const transport_ops_t s_ops[TRANSPORT_COUNT] = {
+    {
+        .name = "socket",
+        .listen = sock_listen,
+        .accept = sock_accept,
+        .wake = sock_wake,
+        .close_listener = sock_close_listener,
+        .recv = sock_recv,
+        .set_recv_timeout = sock_set_recv_timeout,
+        .send = sock_send,
+        .send_nowait = sock_send_nowait,
+        .close = sock_close,
+        .zero_copy = false,
+        .aborts = false,
+    },
+    {
+        .name = "netconn",
+        .listen = nc_listen,
+        .accept = nc_accept,
+        .wake = nc_wake,
+        .close_listener = nc_close_listener,
+        .recv = nc_recv,
+        .set_recv_timeout = nc_set_recv_timeout,
+        .send = nc_send,
+        .send_nowait = nc_send_nowait,
+        .close = nc_close,
+        .zero_copy = true,
+        .aborts = true,
+    },
+};
+
+/* ---------- Общий интерфейс ---------- */
+
+const char *transport_name(transport_kind_t kind) {
+    return s_ops[kind].name;
+}
+
+esp_err_t transport_listen(transport_kind_t kind, uint16_t port, transport_listener_t *listener) {
+    listener->kind = kind;
+    listener->sock = -1;
+    listener->nc = NULL;
+    return s_ops[kind].listen(port, listener);
+}
+
+esp_err_t transport_accept(transport_listener_t *listener, transport_conn_t *conn) {
+    memset(conn, 0, sizeof(*conn));
+    conn->kind = listener->kind;
+    conn->sock = -1;
+    esp_err_t err = s_ops[listener->kind].accept(listener, conn);
+    if (err == ESP_OK) {
+        portENTER_CRITICAL(&s_stats_mux);
+        s_stats[listener->kind].connections++;
+        portEXIT_CRITICAL(&s_stats_mux);
+    }
+    return err;
+}
+
+void transport_listener_wake(transport_listener_t *listener) {
+    s_ops[listener->kind].wake(listener);
+}
+
+void transport_listener_close(transport_listener_t *listener) {
+    s_ops[listener->kind].close_listener(listener);
+}
+
+int transport_recv(transport_conn_t *conn, void *buf, size_t len) {
+    return s_ops[conn->kind].recv(conn, buf, len);
+}
+
+void transport_set_recv_timeout(transport_conn_t *conn, int ms) {
+    s_ops[conn->kind].set_recv_timeout(conn, ms);
+}
+
+static void add_send_stats(transport_kind_t kind, size_t len, bool nocopy, bool ok, int64_t elapsed) {
+    portENTER_CRITICAL(&s_stats_mux);
+    transport_stats_t *st = &s_stats[kind];
+    st->send_us += elapsed;
+    if (ok) {
+        st->bytes += len;
+        if (nocopy) st->nocopy_bytes += len;
+    }
+    portEXIT_CRITICAL(&s_stats_mux);
+}
+
+bool transport_send(transport_conn_t *conn, const void *data, size_t len, bool stable, bool more) {
+    const transport_ops_t *ops = &s_ops[conn->kind];
+    bool nocopy = stable && ops->zero_copy;
+    int64_t start = esp_timer_get_time();
+    bool ok = ops->send(conn, data, len, nocopy, more);
+    add_send_stats(conn->kind, len, nocopy, ok, esp_timer_get_time() - start);
+    return ok;
+}
+
+bool transport_send_nowait(transport_conn_t *conn, const void *data, size_t len, bool more) {
+    int64_t start = esp_timer_get_time();
+    bool ok = s_ops[conn->kind].send_nowait(conn, data, len, more);
+    add_send_stats(conn->kind, len, false, ok, esp_timer_get_time() - start);
+    return ok;
+}
+
+bool transport_zero_copy(const transport_conn_t *conn) {
+    return s_ops[conn->kind].zero_copy;
+}
+
+bool transport_aborts(const transport_conn_t *conn) {
+    return s_ops[conn->kind].aborts;
+}
+
+void transport_close(transport_conn_t *conn, bool reset) {
+    s_ops[conn->kind].close(conn, reset);
+}
+
+void transport_get_stats(transport_kind_t kind, transport_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_mux);
+    *stats = s_stats[kind];
+    portEXIT_CRITICAL(&s_stats_mux);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include "esp_err.h"
+
+/* Как часто accept на netconn просыпается проверить, не пора ли пересоздать слушателя */
+#define TRANSPORT_ACCEPT_POLL_MS 1000
+#define TRANSPORT_LISTEN_BACKLOG 5
+/* Сколько отправка ждет клиента, который не читает ответ. Потом соединение считается оборванным */
+#define TRANSPORT_SEND_TIMEOUT_MS 10000
+
+/* Транспорт HTTP-сервера. Код разбора запросов и отдачи файлов над ним один и тот же */
+typedef enum {
+    TRANSPORT_SOCKET,   // BSD-сокеты: send копирует каждый буфер в pbuf
+    TRANSPORT_NETCONN,  // netconn API lwIP: стабильные буферы уходят в стек без копии
+    TRANSPORT_COUNT,
+} transport_kind_t;
+
+struct netconn;
+struct netbuf;
+
+typedef struct {
+    transport_kind_t kind;
+    int sock;
+    struct netconn *nc;
+} transport_listener_t;
+
+typedef struct {
+    transport_kind_t kind;
+    int sock;
+    struct netconn *nc;
+    struct netbuf *rx;       // netconn: принятый, но еще не дочитанный буфер
+    uint16_t rx_offset;
+    bool ipv6;
+    char addr[INET6_ADDRSTRLEN];
+} transport_conn_t;
+
+typedef struct {
+    uint32_t connections;
+    uint64_t bytes;          // отправлено байт
+    uint64_t nocopy_bytes;   // из них отдано стеку без копирования
+    uint64_t send_us;        // время внутри вызовов отправки
+} transport_stats_t;
+
+const char *transport_name(transport_kind_t kind);
+
+/* Слушаем `port` на всех адресах: IPv4 и, с CONFIG_LWIP_IPV6, IPv6 */
+esp_err_t transport_listen(transport_kind_t kind, uint16_t port, transport_listener_t *listener);
+
+/* Ждем соединение. ESP_ERR_TIMEOUT: netconn проснулся без клиента. ESP_FAIL: ошибка accept,
+ * в том числе после transport_listener_wake */
+esp_err_t transport_accept(transport_listener_t *listener, transport_conn_t *conn);
+
+/* Будим accept из другой задачи, чтобы сервер пересоздал слушателя */
+void transport_listener_wake(transport_listener_t *listener);
+
+void transport_listener_close(transport_listener_t *listener);
+
+/* transport_recv не дождался данных за таймаут приема: соединение живо, можно ждать дальше */
+#define TRANSPORT_RECV_TIMEOUT (-2)
+
+/* > 0 - принято байт, 0 - клиент закрыл соединение, TRANSPORT_RECV_TIMEOUT - таймаут,
+ * другое < 0 - ошибка */
+int transport_recv(transport_conn_t *conn, void *buf, size_t len);
+
+void transport_set_recv_timeout(transport_conn_t *conn, int ms);
+
+/* Отправляем `len` байт целиком. `stable`: буфер не меняется и не освобождается, пока соединение
+ * не закрыто через RST (вшитые файлы, cache_lend), его можно отдать стеку без копии.
+ * `more`: следом пойдут еще данные ответа */
+bool transport_send(transport_conn_t *conn, const void *data, size_t len, bool stable, bool more);
+
+/* Отправляем `len` байт, не дожидаясь клиента: только если они целиком помещаются в буфер
+ * отправки. false - не поместились (возможно, частично ушли) или ошибка; писать в соединение
+ * после этого нельзя, его остается закрыть */
+bool transport_send_nowait(transport_conn_t *conn, const void *data, size_t len, bool more);
+
+/* Стабильные буферы уходят без копии: склеивать их с заголовками в один буфер невыгодно */
+bool transport_zero_copy(const transport_conn_t *conn);
+
+/* Закрытие с reset точно дает RST (netconn: tcp_abort). Сокеты lwIP с SO_LINGER 0 шлют RST,
+ * только если в очереди остались данные, иначе закрываются с FIN и оставляют TIME_WAIT у нас */
+bool transport_aborts(const transport_conn_t *conn);
+
+/* Закрываем соединение. `reset`: через RST, чтобы у нас не остался TIME_WAIT */
+void transport_close(transport_conn_t *conn, bool reset);
+
+void transport_get_stats(transport_kind_t kind, transport_stats_t *stats);
@@ -0,0 +1,491 @@
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_spiffs.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "upload.h"
+#include "file_pool.h"
+#include "cache.h"
+#include "diag.h"
+#include "asset_image.h"
+
+static const char *TAG = "upload";
+
+static char s_tmp_path[ASSET_PATH_MAX];
+static char s_journal_path[ASSET_PATH_MAX];
+static char s_backup_path[ASSET_PATH_MAX];
+static char s_retired_path[ASSET_PATH_MAX];  // без номера
+static bool s_busy = false;
+static upload_stats_t s_stats;
+static portMUX_TYPE s_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/* Заполненный буфер кольца. Без буфера - метка конца: писатель отвечает через s_flushed */
+typedef struct {
+    upload_t *up;
+    uint8_t *buf;
+    size_t len;
+} ring_item_t;
+
+static QueueHandle_t s_free;        // свободные буферы кольца
+static QueueHandle_t s_full;        // заполненные, в порядке приема
+static SemaphoreHandle_t s_flushed;
+
+/* Приемник загрузки файла: временный файл */
+static esp_err_t file_sink(void *ctx, const uint8_t *p, size_t len) {
+    upload_t *up = (upload_t *)ctx;
+    while (len) {
+        ssize_t w = write(up->fd, p, len);
+        // SPIFFS кончилась, хотя место проверяли: параллельно писал кто-то еще
+        if (w <= 0) return ESP_ERR_NO_MEM;
+        p += w;
+        len -= w;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t sink_write(upload_t *up, const uint8_t *p, size_t len) {
+    int64_t t0 = esp_timer_get_time();
+    esp_err_t err = up->sink(up->sink_ctx, p, len);
+    up->write_us += esp_timer_get_time() - t0;
+    return err;
+}
+
+static void writer_task(void *pv) {
+    ring_item_t item;
+    while (1) {
+        xQueueReceive(s_full, &item, portMAX_DELAY);
+        if (!item.buf) {
+            xSemaphoreGive(s_flushed);
+            continue;
+        }
+        // После ошибки буферы только возвращаем в кольцо: загрузка все равно не удастся
+        if (item.up->err == ESP_OK) item.up->err = sink_write(item.up, item.buf, item.len);
+        xQueueSend(s_free, &item.buf, portMAX_DELAY);
+    }
+}
+
+void upload_writer_init(void) {
+    s_free = xQueueCreate(UPLOAD_RING_BUFS, sizeof(uint8_t *));
+    // Место под все буферы и метку конца: отправка в очередь не ждет
+    s_full = xQueueCreate(UPLOAD_RING_BUFS + 1, sizeof(ring_item_t));
+    s_flushed = xSemaphoreCreateBinary();
+    uint8_t *ring = (uint8_t *)heap_caps_malloc(UPLOAD_RING_BUFS * UPLOAD_RING_BUF_LEN,
+                                                MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    TaskHandle_t task = NULL;
+    if (!s_free || !s_full || !s_flushed || !ring ||
+        xTaskCreate(writer_task, "upload_writer", UPLOAD_TASK_STACK, NULL, 5, &task) != pdPASS) {
+        ESP_LOGW(TAG, "No memory for upload ring, uploads are serial");
+        heap_caps_free(ring);
+        s_full = NULL;
+        return;
+    }
+    for (int i = 0; i < UPLOAD_RING_BUFS; i++) {
+        uint8_t *buf = ring + i * UPLOAD_RING_BUF_LEN;
+        xQueueSend(s_free, &buf, 0);
+    }
+    diag_register_task(task);
+}
+
+static void finish_replace(const char *path);
+
+/* Подмену оборвал сбой: по журналу доводим ее до конца, если временный файл уже целиком
+ * на месте старого или старого уже нет, иначе оставляем старый */
+static void recover(void) {
+    int fd = open(s_journal_path, O_RDONLY);
+    if (fd < 0) return;
+    char path[ASSET_PATH_MAX + 8];
+    ssize_t n = read(fd, path, sizeof(path) - 1);
+    close(fd);
+    // Журнал без перевода строки не дописан: до подмены дело не дошло
+    if (n > 1 && path[n - 1] == '\n') {
+        path[n - 1] = 0;
+        struct stat st;
+        bool has_tmp = stat(s_tmp_path, &st) == 0;
+        bool has_target = stat(path, &st) == 0;
+        if (has_tmp && !has_target) {
+            // Старый файл уже в резервной копии
+            if (rename(s_tmp_path, path) == 0) {
+                finish_replace(path);
+                ESP_LOGW(TAG, "Completed interrupted upload of %s", path);
+            } else if (rename(s_backup_path, path) == 0) {
+                ESP_LOGW(TAG, "Restored %s after interrupted upload", path);
+            }
+        } else if (!has_tmp && has_target) {
+            // Новый файл уже на месте, осталась уборка
+            finish_replace(path);
+            ESP_LOGW(TAG, "Completed interrupted upload of %s", path);
+        } else if (!has_tmp && rename(s_backup_path, path) == 0) {
+            ESP_LOGW(TAG, "Restored %s after interrupted upload", path);
+        }
+    }
+    unlink(s_backup_path);
+    unlink(s_journal_path);
+}
+
+void upload_init(const char *base_path) {
+    snprintf(s_tmp_path, sizeof(s_tmp_path), "%s/%s", base_path, UPLOAD_TMP_NAME);
+    snprintf(s_journal_path, sizeof(s_journal_path), "%s/%s", base_path, UPLOAD_JOURNAL_NAME);
+    snprintf(s_backup_path, sizeof(s_backup_path), "%s/%s", base_path, UPLOAD_BACKUP_NAME);
+    snprintf(s_retired_path, sizeof(s_retired_path), "%s/%s", base_path, UPLOAD_RETIRED_NAME);
+    recover();
+    if (unlink(s_tmp_path) == 0) ESP_LOGW(TAG, "Removed unfinished upload");
+    // Удаленные файлы, которые дочитывали ответы до перезагрузки
+    for (int i = 0; i < FILE_POOL_SIZE; i++) {
+        char path[ASSET_PATH_MAX + 4];
+        snprintf(path, sizeof(path), "%s%d", s_retired_path, i);
+        unlink(path);
+    }
+}
+
+static void reject(void) {
+    portENTER_CRITICAL(&s_mux);
+    s_stats.rejected++;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+esp_err_t upload_check_space(size_t len) {
+    if (len > UPLOAD_MAX_SIZE) {
+        reject();
+        return ESP_ERR_INVALID_SIZE;
+    }
+    size_t total = 0, used = 0;
+    if (esp_spiffs_info(asset_image_label(), &total, &used) != ESP_OK || used + len + UPLOAD_SPACE_RESERVE > total) {
+        reject();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+static void release(void) {
+    portENTER_CRITICAL(&s_mux);
+    s_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+/* Занимаем конвейер: загрузки, удаления и запись образа идут по одной */
+static bool claim(void) {
+    portENTER_CRITICAL(&s_mux);
+    bool busy = s_busy;
+    s_busy = true;
+    if (busy) s_stats.rejected++;
+    portEXIT_CRITICAL(&s_mux);
+    return !busy;
+}
+
+/* Скрытые файлы не отдаются, а под одним из них лежит временный файл загрузки */
+static bool valid_target(const char *fullpath) {
+    const char *name = strrchr(fullpath, '/');
+    name = name ? name + 1 : fullpath;
+    return strlen(fullpath) < ASSET_PATH_MAX + 4 && name[0] != '.' && name[0] != 0;
+}
+
+esp_err_t upload_stream_begin(upload_t *up, upload_sink_t sink, void *ctx, size_t limit, upload_mode_t mode) {
+    if (!claim()) return ESP_ERR_INVALID_STATE;
+
+    up->fd = -1;
+    up->path[0] = 0;
+    up->size = 0;
+    up->limit = limit;
+    up->started_us = esp_timer_get_time();
+    up->mode = s_full ? mode : UPLOAD_SERIAL;
+    up->sink = sink;
+    up->sink_ctx = ctx;
+    up->buf = NULL;
+    up->fill = 0;
+    up->err = ESP_OK;
+    up->write_us = 0;
+    up->stalls = 0;
+    up->stall_us = 0;
+    return ESP_OK;
+}
+
+esp_err_t upload_begin(upload_t *up, const char *fullpath, upload_mode_t mode) {
+    if (!valid_target(fullpath)) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = upload_stream_begin(up, file_sink, up, UPLOAD_MAX_SIZE, mode);
+    if (err != ESP_OK) return err;
+
+    up->fd = open(s_tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (up->fd < 0) {
+        ESP_LOGE(TAG, "Unable to create %s: errno %d", s_tmp_path, errno);
+        release();
+        return ESP_FAIL;
+    }
+    strcpy(up->path, fullpath);
+    return ESP_OK;
+}
+
+static void submit(upload_t *up) {
+    ring_item_t item = { up, up->buf, up->fill };
+    xQueueSend(s_full, &item, portMAX_DELAY);
+    up->buf = NULL;
+}
+
+/* Копируем в кольцо. Заполненный буфер сразу уходит писателю */
+static esp_err_t ring_write(upload_t *up, const uint8_t *p, size_t len) {
+    while (len) {
+        if (up->err != ESP_OK) return up->err;
+        if (!up->buf) {
+            if (xQueueReceive(s_free, &up->buf, 0) != pdTRUE) {
+                // Кольцо полное: только здесь прием и ждет flash
+                int64_t t0 = esp_timer_get_time();
+                xQueueReceive(s_free, &up->buf, portMAX_DELAY);
+                up->stalls++;
+                up->stall_us += esp_timer_get_time() - t0;
+            }
+            up->fill = 0;
+        }
+        size_t n = MIN(len, UPLOAD_RING_BUF_LEN - up->fill);
+        memcpy(up->buf + up->fill, p, n);
+        up->fill += n;
+        p += n;
+        len -= n;
+        if (up->fill == UPLOAD_RING_BUF_LEN) submit(up);
+    }
+    return ESP_OK;
+}
+
+/* Отдаем недописанный буфер и ждем, пока писатель дойдет до конца очереди */
+static esp_err_t ring_flush(upload_t *up) {
+    if (up->buf && up->fill) {
+        submit(up);
+    } else if (up->buf) {
+        xQueueSend(s_free, &up->buf, portMAX_DELAY);
+        up->buf = NULL;
+    }
+    ring_item_t mark = { up, NULL, 0 };
+    xQueueSend(s_full, &mark, portMAX_DELAY);
+    xSemaphoreTake(s_flushed, portMAX_DELAY);
+    return up->err;
+}
+
+/* Ждем, пока все принятое дойдет до приемника. Ошибка приемника, если была */
+static esp_err_t drain(upload_t *up) {
+    return up->mode == UPLOAD_PIPELINED ? ring_flush(up) : up->err;
+}
+
+esp_err_t upload_write(upload_t *up, const void *data, size_t len) {
+    if (up->size + len > up->limit) return ESP_ERR_INVALID_SIZE;
+    esp_err_t err;
+    if (up->mode == UPLOAD_PIPELINED) {
+        err = ring_write(up, (const uint8_t *)data, len);
+    } else {
+        err = up->err = sink_write(up, (const uint8_t *)data, len);
+    }
+    if (err == ESP_OK) up->size += len;
+    return err;
+}
+
+esp_err_t upload_flush(upload_t *up) {
+    return drain(up);
+}
+
+esp_err_t upload_stream_end(upload_t *up) {
+    esp_err_t err = drain(up);
+    release();
+    return err;
+}
+
+/* Счетчики конвейера копятся по всем загрузкам файлов */
+static void add_pipeline_stats(const upload_t *up) {
+    portENTER_CRITICAL(&s_mux);
+    s_stats.write_us += up->write_us;
+    s_stats.stalls += up->stalls;
+    s_stats.stall_us += up->stall_us;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+/* Убираем из пула дескрипторов и кеша все, что читалось из `path`. Возвращает, сколько
+ * дескрипторов еще читают ответы */
+static int invalidate(const char *path) {
+    cache_invalidate(path);
+    return file_pool_invalidate(path);
+}
+
+/* Свободное скрытое имя для удаленного файла, который еще читают. Читателей не больше,
+ * чем дескрипторов в пуле */
+static bool retired_name(char *buf, size_t buflen) {
+    for (int i = 0; i < FILE_POOL_SIZE; i++) {
+        snprintf(buf, buflen, "%s%d", s_retired_path, i);
+        struct stat st;
+        if (stat(buf, &st) != 0) return true;
+    }
+    return false;
+}
+
+/* Удаляем старое содержимое `path`, которое лежит в `file`: в нем самом или в резервной копии.
+ * SPIFFS вместе с файлом закрывает его дескрипторы, поэтому файл, который еще отдает ответ,
+ * только прячется под скрытым именем, а удаляет его пул, когда ответ дочитает. Результат как у unlink */
+static int discard(const char *path, const char *file) {
+    char retired[ASSET_PATH_MAX + 4];
+    if (invalidate(path) > 0 && retired_name(retired, sizeof(retired)) && rename(file, retired) == 0) {
+        if (file_pool_retire(path, retired)) return 0;
+        // Ответ успел дочитать, пока файл переименовывали
+        file = retired;
+    }
+    return unlink(file);
+}
+
+/* Несжатый файл уходит вместе с .gz: иначе отдавался бы устаревший .gz */
+static int remove_gz(const char *path) {
+    size_t len = strlen(path);
+    if (len > 3 && strcmp(path + len - 3, ".gz") == 0) return 0;
+    char gz_path[ASSET_PATH_MAX + 8];
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+    return discard(gz_path, gz_path) == 0;
+}
+
+static int remove_file(const char *path) {
+    int removed = 0;
+    if (discard(path, path) == 0) removed++;
+    return removed + remove_gz(path);
+}
+
+/* Новый файл на месте: старый (в резервной копии) больше не нужен, как и устаревший .gz */
+static void finish_replace(const char *path) {
+    discard(path, s_backup_path);
+    remove_gz(path);
+}
+
+/* Журнал - путь файла, который сейчас подменяется, с переводом строки в конце */
+static bool write_journal(const char *path) {
+    int fd = open(s_journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    char line[ASSET_PATH_MAX + 8];
+    int len = snprintf(line, sizeof(line), "%s\n", path);
+    bool ok = write(fd, line, len) == len;
+    ok = close(fd) == 0 && ok;
+    if (!ok) unlink(s_journal_path);
+    return ok;
+}
+
+/* Подменяем `path` готовым временным файлом. SPIFFS не переименовывает поверх существующего
+ * файла, поэтому старый (`exists`) сначала уходит в резервную копию и возвращается, если подмена
+ * не удалась. Пока идет подмена, лежит журнал: после сбоя upload_init по нему ее доводит или откатывает */
+static esp_err_t replace_file(const char *path, bool exists) {
+    if (!write_journal(path)) {
+        ESP_LOGE(TAG, "Unable to write %s: errno %d", s_journal_path, errno);
+        unlink(s_tmp_path);
+        return ESP_FAIL;
+    }
+    esp_err_t err = ESP_OK;
+    invalidate(path);
+    if (exists && rename(path, s_backup_path) != 0) {
+        ESP_LOGE(TAG, "Unable to back up %s: errno %d", path, errno);
+        err = ESP_FAIL;
+    } else if (rename(s_tmp_path, path) != 0) {
+        ESP_LOGE(TAG, "Unable to rename to %s: errno %d", path, errno);
+        if (exists) rename(s_backup_path, path);
+        err = ESP_FAIL;
+    } else {
+        finish_replace(path);
+    }
+    if (err != ESP_OK) unlink(s_tmp_path);
+    unlink(s_journal_path);
+    return err;
+}
+
+esp_err_t upload_commit(upload_t *up, bool *created) {
+    esp_err_t err = drain(up);
+    if (err != ESP_OK) {
+        upload_abort(up);
+        return err;
+    }
+    int64_t t0 = esp_timer_get_time();
+    close(up->fd);
+    up->fd = -1;
+    add_pipeline_stats(up);
+
+    // Файл подменяется, когда его никто не отдает: ответ не увидит половину старого и нового
+    err = asset_update_begin(UPLOAD_COMMIT_WAIT_MS);
+    if (err != ESP_OK) {
+        upload_abort(up);
+        return err;
+    }
+    struct stat st;
+    *created = stat(up->path, &st) != 0;
+    err = replace_file(up->path, !*created);
+    // Индекс перечитываем и после неудачи: .gz мог уйти, а файл вернуться из резервной копии
+    esp_err_t update_err = asset_update(up->path);
+    if (err == ESP_OK) err = update_err;
+    asset_update_end();
+
+    int64_t now = esp_timer_get_time();
+    uint64_t total_us = now - up->started_us;
+    portENTER_CRITICAL(&s_mux);
+    if (err == ESP_OK) {
+        s_stats.files++;
+        s_stats.bytes += up->size;
+        s_stats.total_us += total_us;
+        s_stats.commit_us += now - t0;
+        s_stats.last_size = up->size;
+        s_stats.last_kb_per_s = total_us ? (uint32_t)(up->size * 1000000ULL / 1024 / total_us) : 0;
+        upload_mode_stats_t *mode = &s_stats.modes[up->mode];
+        mode->files++;
+        mode->bytes += up->size;
+        mode->total_us += total_us;
+    } else {
+        s_stats.failed++;
+    }
+    s_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Uploaded %s: %u bytes in %u ms (%s)", up->path, (unsigned)up->size,
+                 (unsigned)(total_us / 1000), upload_mode_name(up->mode));
+    }
+    return err;
+}
+
+esp_err_t upload_delete(const char *fullpath, int *removed) {
+    *removed = 0;
+    if (!valid_target(fullpath)) return ESP_ERR_INVALID_ARG;
+    if (!claim()) return ESP_ERR_INVALID_STATE;
+    esp_err_t err = asset_update_begin(UPLOAD_COMMIT_WAIT_MS);
+    if (err == ESP_OK) {
+        *removed = remove_file(fullpath);
+        // Запись индекса без вариантов asset_lookup больше не находит
+        err = asset_update(fullpath);
+        asset_update_end();
+    }
+    portENTER_CRITICAL(&s_mux);
+    s_stats.deleted += *removed;
+    s_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+    if (err == ESP_OK && *removed == 0) return ESP_ERR_NOT_FOUND;
+    return err;
+}
+
+void upload_abort(upload_t *up) {
+    // Писатель мог еще держать буферы этой загрузки
+    if (up->fd >= 0) {
+        drain(up);
+        close(up->fd);
+        add_pipeline_stats(up);
+    }
+    up->fd = -1;
+    unlink(s_tmp_path);
+    portENTER_CRITICAL(&s_mux);
+    s_stats.failed++;
+    s_busy = false;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+void upload_get_stats(upload_stats_t *stats) {
+    portENTER_CRITICAL(&s_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_mux);
+}
+
+const char *upload_mode_name(upload_mode_t mode) {
+    return mode == UPLOAD_PIPELINED ? "pipelined" : "serial";
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "assets.h"
+
+/* Загрузка файлов в ФС. Тело пишется во временный файл порциями приемного буфера,
+ * готовый файл подменяет старый переименованием, так что память от размера не зависит */
+#define UPLOAD_MAX_SIZE (512 * 1024)
+/* SPIFFS нужны свободные страницы для сборки мусора: совсем до конца не заполняем */
+#define UPLOAD_SPACE_RESERVE (32 * 1024)
+/* Сколько подмена файла ждет, пока уйдут читатели индекса. Ответы держат его, только пока
+ * готовят заголовки и открывают файл, тело дочитывают уже без него */
+#define UPLOAD_COMMIT_WAIT_MS 5000
+/* Временный файл, журнал подмены и резервная копия старого файла на время подмены.
+ * Удаленный файл, который еще дочитывает ответ, лежит под UPLOAD_RETIRED_NAME с номером.
+ * Скрытые файлы в индекс не попадают */
+#define UPLOAD_TMP_NAME ".upload"
+#define UPLOAD_JOURNAL_NAME ".upload.journal"
+#define UPLOAD_BACKUP_NAME ".upload.old"
+#define UPLOAD_RETIRED_NAME ".upload.retired"
+/* Конвейер: прием складывает тело в кольцо буферов, отдельная задача пишет их на flash.
+ * Прием ждет запись, только когда заняты все буферы кольца */
+#define UPLOAD_RING_BUFS 4
+#define UPLOAD_RING_BUF_LEN 4096
+#define UPLOAD_TASK_STACK 4096
+
+typedef enum {
+    UPLOAD_SERIAL,      // прием и запись по очереди в задаче соединения
+    UPLOAD_PIPELINED,   // запись в задаче upload_writer
+    UPLOAD_MODE_COUNT,
+} upload_mode_t;
+
+/* Режим по умолчанию. Последовательный оставлен для сравнения: заголовок "X-Upload-Mode: serial" */
+#define UPLOAD_DEFAULT_MODE UPLOAD_PIPELINED
+
+/* Приемник тела: временный файл или сырой раздел. В конвейере вызывается из задачи upload_writer */
+typedef esp_err_t (*upload_sink_t)(void *ctx, const uint8_t *data, size_t len);
+
+typedef struct {
+    int fd;
+    char path[ASSET_PATH_MAX + 4];  // куда ляжет файл
+    size_t size;
+    size_t limit;
+    int64_t started_us;
+    upload_mode_t mode;
+    upload_sink_t sink;
+    void *sink_ctx;
+    uint8_t *buf;                   // заполняемый буфер кольца
+    size_t fill;
+    volatile esp_err_t err;         // ошибка приемника
+    uint64_t write_us;              // в приемнике
+    uint32_t stalls;
+    uint64_t stall_us;
+} upload_t;
+
+typedef struct {
+    uint32_t files;
+    uint64_t bytes;
+    uint64_t total_us;
+} upload_mode_stats_t;
+
+typedef struct {
+    uint32_t files;         // загружено файлов
+    uint32_t failed;        // оборвались или не записались
+    uint32_t rejected;      // не приняты: велики, нет места, идет другая загрузка
+    uint32_t deleted;       // удалено файлов
+    uint64_t bytes;
+    uint64_t total_us;      // от первого байта тела до подмены файла
+    uint64_t write_us;      // из них в записи на flash
+    uint64_t commit_us;     // из них в подмене файла и обновлении индекса
+    uint32_t last_size;
+    uint32_t last_kb_per_s;
+    uint32_t stalls;        // прием ждал свободный буфер кольца
+    uint64_t stall_us;
+    upload_mode_stats_t modes[UPLOAD_MODE_COUNT];
+} upload_stats_t;
+
+/* Кольцо буферов и задача записи. Без памяти под кольцо загрузки идут последовательно */
+void upload_writer_init(void);
+
+/* Доводим или откатываем подмену файла, оборванную сбоем, и удаляем временный файл
+ * оборванной загрузки. До построения индекса */
+void upload_init(const char *base_path);
+
+/* Поместится ли тело длиной `len`. ESP_ERR_INVALID_SIZE - больше UPLOAD_MAX_SIZE,
+ * ESP_ERR_NO_MEM - на разделе нет места */
+esp_err_t upload_check_space(size_t len);
+
+/* Начинаем файл `fullpath`. Одновременно идет одна загрузка: ESP_ERR_INVALID_STATE - занято.
+ * ESP_ERR_INVALID_ARG - путь длинный или скрытый файл */
+esp_err_t upload_begin(upload_t *up, const char *fullpath, upload_mode_t mode);
+
+esp_err_t upload_write(upload_t *up, const void *data, size_t len);
+
+/* Тело идет не в файл, а в свой приемник, через тот же конвейер. Загрузка файлов в это
+ * время получает ESP_ERR_INVALID_STATE. Больше `limit` байт - ESP_ERR_INVALID_SIZE */
+esp_err_t upload_stream_begin(upload_t *up, upload_sink_t sink, void *ctx, size_t limit, upload_mode_t mode);
+
+/* Ждем, пока все принятое дойдет до приемника. Ошибка приемника, если была */
+esp_err_t upload_flush(upload_t *up);
+
+/* Дожидаемся приемника и отпускаем конвейер */
+esp_err_t upload_stream_end(upload_t *up);
+
+/* Подменяем файл загруженным и обновляем индекс, кеш и пул дескрипторов.
+ * Загрузка несжатого файла удаляет его устаревший .gz. `created` - файла раньше не было */
+esp_err_t upload_commit(upload_t *up, bool *created);
+
+void upload_abort(upload_t *up);
+
+/* Удаляем файл вместе с его .gz и убираем из индекса, кеша и пула дескрипторов.
+ * `removed` - сколько файлов удалено, ESP_ERR_NOT_FOUND - ни одного */
+esp_err_t upload_delete(const char *fullpath, int *removed);
+
+void upload_get_stats(upload_stats_t *stats);
+
+const char *upload_mode_name(upload_mode_t mode);
@@ -0,0 +1,161 @@
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "warmup.h"
+#include "assets.h"
+#include "cache.h"
+#include "hitstats.h"
+
+static const char *TAG = "warmup";
+
+static const char *const s_preload[] = { WARMUP_PRELOAD_LIST };
+
+static const char *s_base_path;
+static warmup_status_t s_status;
+// Уже прогретые файлы: index.html может ссылаться на один файл несколько раз
+static const asset_t *s_warmed[WARMUP_MAX_ASSETS];
+static int s_warmed_count = 0;
+
+/* Прогреваем один файл из индекса */
+static void warm_asset(const asset_t *asset) {
+    for (int i = 0; i < s_warmed_count; i++) {
+        if (s_warmed[i] == asset) return;
+    }
+    if (s_warmed_count >= WARMUP_MAX_ASSETS) return;
+    s_warmed[s_warmed_count++] = asset;
+
+    // Браузеры почти всегда принимают gzip: греем тот вариант, который они получат.
+    // Под чтением индекса: загрузка не должна подменить файл посреди прогрева
+    asset_read_begin();
+    asset_encoding_t enc = asset_pick_encoding(asset, true);
+    char path[ASSET_PATH_MAX + 4];
+    asset_variant_path(asset, enc, path, sizeof(path));
+    size_t size = asset->variants[enc].size;
+    esp_err_t err = cache_preload(path, size, WARMUP_PIN);
+    asset_read_end();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to warm %s (%s)", path, esp_err_to_name(err));
+        s_status.failed++;
+        return;
+    }
+    s_status.assets++;
+    s_status.bytes += size;
+}
+
+/* Прогреваем файл по пути `rel` от корня ФС длиной `len` */
+static void warm_one(const char *rel, size_t len) {
+    char fullpath[ASSET_PATH_MAX];
+    int n = snprintf(fullpath, sizeof(fullpath), "%s/%.*s", s_base_path, (int)len, rel);
+    if (n < 0 || (size_t)n >= sizeof(fullpath)) return;
+
+    asset_read_begin();
+    const asset_t *asset = asset_lookup(fullpath);
+    asset_read_end();
+    if (!asset) {
+        ESP_LOGW(TAG, "Not in index: %s", fullpath);
+        s_status.failed++;
+        return;
+    }
+    warm_asset(asset);
+}
+
+/* Значение атрибута `attr` внутри тега [tag, end). false, если атрибута нет */
+static bool tag_attr(const char *tag, const char *end, const char *attr, const char **value, size_t *len) {
+    size_t attr_len = strlen(attr);
+    for (const char *p = tag; p + attr_len + 2 < end; p++) {
+        if (p[-1] != ' ' || strncasecmp(p, attr, attr_len) != 0 || p[attr_len] != '=') continue;
+        char quote = p[attr_len + 1];
+        if (quote != '"' && quote != '\'') continue;
+        const char *v = p + attr_len + 2;
+        const char *close = (const char *)memchr(v, quote, end - v);
+        if (!close) return false;
+        *value = v;
+        *len = close - v;
+        return true;
+    }
+    return false;
+}
+
+/* Ищем в index.html ссылки на локальные скрипты и стили и прогреваем их */
+static void warm_referenced(const char *html, size_t html_len) {
+    static const struct { const char *tag; const char *attr; } refs[] = {
+        { "<script", "src" },
+        { "<link", "href" },
+    };
+    const char *end = html + html_len;
+    for (const char *p = html; p < end; p++) {
+        if (*p != '<') continue;
+        for (size_t i = 0; i < sizeof(refs) / sizeof(refs[0]); i++) {
+            size_t tag_len = strlen(refs[i].tag);
+            if ((size_t)(end - p) <= tag_len || strncasecmp(p, refs[i].tag, tag_len) != 0) continue;
+            const char *tag_end = (const char *)memchr(p, '>', end - p);
+            if (!tag_end) return;
+            const char *value;
+            size_t len;
+            if (!tag_attr(p + tag_len, tag_end, refs[i].attr, &value, &len)) continue;
+            // Внешние ресурсы (шрифты с CDN и т.п.) не наши
+            if (memchr(value, ':', len) || (len > 1 && value[0] == '/' && value[1] == '/')) continue;
+            const char *q = (const char *)memchr(value, '?', len);
+            if (q) len = q - value;
+            while (len && (*value == '/' || *value == '.')) {
+                value++;
+                len--;
+            }
+            if (len) warm_one(value, len);
+        }
+    }
+}
+
+esp_err_t warmup_run(const char *base_path) {
+    s_base_path = base_path;
+    s_status.started_us = esp_timer_get_time();
+
+    // Сначала то, что на этой установке реально запрашивают чаще всего. Закрепляется
+    // оно же, пока хватает CACHE_PIN_BUDGET
+    const asset_t *ranked[WARMUP_MAX_ASSETS];
+    int ranked_count = hitstats_ranked(ranked, WARMUP_MAX_ASSETS);
+    for (int i = 0; i < ranked_count; i++) {
+        warm_asset(ranked[i]);
+    }
+
+    // Затем статический список и ссылки из index.html: для свежей установки без статистики
+    for (size_t i = 0; i < sizeof(s_preload) / sizeof(s_preload[0]); i++) {
+        warm_one(s_preload[i], strlen(s_preload[i]));
+    }
+
+#if WARMUP_AUTO
+    // index.html разбираем прямо из кеша
+    char index_path[ASSET_PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/index.html", s_base_path);
+    asset_read_begin();
+    const asset_t *index = asset_lookup(index_path);
+    size_t size = index ? index->variants[ASSET_ENC_IDENTITY].size : 0;
+    bool loaded = size && cache_preload(index_path, size, false) == ESP_OK;
+    asset_read_end();
+    if (loaded) {
+        bool loader;
+        cache_entry_t *entry = cache_acquire(index_path, size, &loader);
+        if (entry && !loader && cache_wait(entry, size - 1) == (ssize_t)size) {
+            warm_referenced((const char *)cache_data(entry), size);
+        } else if (entry && loader) {
+            // Успели вытеснить между загрузкой и разбором
+            cache_abort(entry);
+        }
+        if (entry) cache_release(entry);
+    }
+#endif
+
+    s_status.finished_us = esp_timer_get_time();
+    s_status.ready = true;
+    ESP_LOGI(TAG, "Warm-up done: %u assets, %u bytes in %lld ms", s_status.assets, (unsigned)s_status.bytes,
+             (long long)((s_status.finished_us - s_status.started_us) / 1000));
+    return ESP_OK;
+}
+
+void warmup_get_status(warmup_status_t *status) {
+    *status = s_status;
+}
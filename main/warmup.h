@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+/* Что прогреть в кеш при старте. Пути от корня ФС, через запятую в кавычках */
+#define WARMUP_PRELOAD_LIST "index.html"
+/* Дополнительно прогреть всё, на что index.html ссылается через <script src> и <link href> */
+#define WARMUP_AUTO 1
+/* Закрепить прогретые файлы, чтобы их не вытеснило */
+#define WARMUP_PIN 1
+#define WARMUP_MAX_ASSETS 16
+
+typedef struct {
+    bool ready;           // прогрев завершен
+    uint16_t assets;      // сколько файлов загружено в кеш
+    uint16_t failed;      // сколько не поместилось или не прочиталось
+    uint32_t bytes;
+    int64_t started_us;   // от старта системы
+    int64_t finished_us;
+} warmup_status_t;
+
+/* Прогреваем кеш (выполняется в задаче этапа старта). Порядок: файлы по убыванию
+ * обращений из hitstats, затем WARMUP_PRELOAD_LIST, затем ссылки из index.html.
+ * Индекс файлов и hitstats должны быть уже готовы */
+esp_err_t warmup_run(const char *base_path);
+
+void warmup_get_status(warmup_status_t *status);
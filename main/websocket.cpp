@@ -0,0 +1,521 @@
+#include <string.h>
+#include <stdio.h>
+#include <sys/param.h>
+#include <sys/select.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+#include "websocket.h"
+#include "mem_pool.h"
+#include "diag.h"
+#include "wifi_ps.h"
+
+static const char *TAG = "websocket";
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_LEN 24           // base64 от 16 байт
+#define WS_CONTROL_MAX 125      // полезная нагрузка управляющего кадра
+#define WS_RX_LEN 512
+
+enum {
+    WS_OP_CONTINUATION = 0x0,
+    WS_OP_TEXT = 0x1,
+    WS_OP_BINARY = 0x2,
+    WS_OP_CLOSE = 0x8,
+    WS_OP_PING = 0x9,
+    WS_OP_PONG = 0xA,
+};
+
+typedef enum {
+    WS_FREE = 0,
+    WS_OPENING,     // воркер отправляет 101
+    WS_OPEN,
+    WS_CLOSING,     // отправили close, ждем, что клиент закроет TCP
+} ws_state_t;
+
+typedef struct {
+    ws_state_t state;
+    transport_conn_t tc;
+    int64_t last_rx_us;
+    int64_t ping_us;            // отправлен ping без ответа, 0 - не ждем
+    int64_t close_deadline_us;
+    // Заголовок текущего кадра: приходит кусками, как и все остальное
+    uint8_t hdr[14];
+    uint8_t hdr_len;
+    uint8_t hdr_need;
+    uint8_t opcode;
+    bool fin;
+    uint32_t payload_len;
+    uint32_t payload_pos;
+    // Сообщение, которое собирается из фрагментов. Управляющие кадры могут прийти между ними
+    uint8_t msg_opcode;         // 0 - сообщения нет
+    uint8_t *msg;
+    size_t msg_len;
+    // Текст проверяется на UTF-8 по кадрам: символ может быть разрезан между фрагментами.
+    // Сколько байтов продолжения еще ждем и в каком диапазоне должен быть следующий
+    uint8_t utf8_need;
+    uint8_t utf8_lo;
+    uint8_t utf8_hi;
+    uint8_t ctrl[WS_CONTROL_MAX];
+} ws_client_t;
+
+static ws_client_t s_clients[WEBSOCKET_MAX_CLIENTS];
+/* Состояние слотов и отправка: кадры разных задач не должны перемешаться в одном сокете,
+ * а закрыть сокет можно, только когда в него никто не пишет. Отправка не ждет клиента,
+ * поэтому мьютекс держится недолго */
+static SemaphoreHandle_t s_lock;
+static mem_pool_t s_msg_pool;
+static uint8_t s_rx_buf[WS_RX_LEN];
+static websocket_message_cb_t s_message_cb;
+
+static websocket_stats_t s_stats;
+static portMUX_TYPE s_stats_mux = portMUX_INITIALIZER_UNLOCKED;
+#define STAT_ADD(field, n) do { portENTER_CRITICAL(&s_stats_mux); s_stats.field += (n); portEXIT_CRITICAL(&s_stats_mux); } while (0)
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+/* Sec-WebSocket-Accept: base64(SHA-1(ключ + GUID)) */
+static bool accept_key(const char *key, char *out, size_t outlen) {
+    char buf[WS_KEY_LEN + sizeof(WS_GUID)];
+    int n = snprintf(buf, sizeof(buf), "%s%s", key, WS_GUID);
+    uint8_t sha[20];
+    size_t olen;
+    return mbedtls_sha1((const unsigned char *)buf, n, sha) == 0 &&
+           mbedtls_base64_encode((unsigned char *)out, outlen, &olen, sha, sizeof(sha)) == 0;
+}
+
+static void parser_reset(ws_client_t *c) {
+    c->hdr_len = 0;
+    c->hdr_need = 2;
+}
+
+/* Кадр от сервера: без маски, целиком. Вызывается под s_lock. Кадр уходит, только если
+ * целиком помещается в буфер отправки: медленный клиент не задерживает остальных */
+static bool send_frame(ws_client_t *c, uint8_t opcode, const void *data, size_t len) {
+    uint8_t hdr[10];
+    size_t n = 2;
+    hdr[0] = 0x80 | opcode;
+    if (len < 126) {
+        hdr[1] = len;
+    } else if (len <= 0xFFFF) {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len;
+        n = 4;
+    } else {
+        hdr[1] = 127;
+        for (int i = 0; i < 8; i++) hdr[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        n = 10;
+    }
+    wifi_ps_activity();
+    bool ok = transport_send_nowait(&c->tc, hdr, n, len > 0) &&
+              (len == 0 || transport_send_nowait(&c->tc, data, len, false));
+    if (!ok) {
+        // Клиент не читает, а в сокете, может быть, уже половина кадра. Закроет задача,
+        // пока что ему больше не пишем
+        STAT_INC(send_errors);
+        c->state = WS_CLOSING;
+        c->close_deadline_us = 0;
+        return false;
+    }
+    if (opcode == WS_OP_TEXT || opcode == WS_OP_BINARY) {
+        portENTER_CRITICAL(&s_stats_mux);
+        s_stats.messages_out++;
+        s_stats.bytes_out += len;
+        portEXIT_CRITICAL(&s_stats_mux);
+    }
+    return true;
+}
+
+static void send_locked(ws_client_t *c, uint8_t opcode, const void *data, size_t len) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (c->state == WS_OPEN) send_frame(c, opcode, data, len);
+    xSemaphoreGive(s_lock);
+}
+
+/* Отправляем close с кодом `code` и ждем, что клиент закроет TCP первым */
+static void start_close(ws_client_t *c, uint16_t code) {
+    uint8_t payload[2] = { (uint8_t)(code >> 8), (uint8_t)code };
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (c->state == WS_OPEN && send_frame(c, WS_OP_CLOSE, payload, sizeof(payload))) {
+        c->state = WS_CLOSING;
+        c->close_deadline_us = esp_timer_get_time() + WEBSOCKET_CLOSE_MS * 1000LL;
+    }
+    xSemaphoreGive(s_lock);
+    // Недособранное сообщение уже не понадобится: буфер нужнее другим
+    if (c->msg) mem_pool_release(&s_msg_pool, c->msg);
+    c->msg = NULL;
+    c->msg_opcode = 0;
+    if (code == WEBSOCKET_CLOSE_PROTOCOL || code == WEBSOCKET_CLOSE_INVALID_DATA) STAT_INC(protocol_errors);
+}
+
+/* Освобождаем слот. Если клиент сам не закрыл, закрываем через RST, чтобы не держать TIME_WAIT */
+static void release(ws_client_t *c, bool client_closed) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    transport_close(&c->tc, !client_closed);
+    if (c->msg) mem_pool_release(&s_msg_pool, c->msg);
+    c->msg = NULL;
+    c->msg_opcode = 0;
+    c->state = WS_FREE;
+    xSemaphoreGive(s_lock);
+
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.clients--;
+    s_stats.closed++;
+    if (client_closed) s_stats.client_closes++;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
+
+/* Заголовок кадра принят целиком. false - соединение закрывается */
+static bool frame_begin(ws_client_t *c) {
+    uint8_t b0 = c->hdr[0];
+    uint8_t len7 = c->hdr[1] & 0x7F;
+    c->fin = b0 & 0x80;
+    c->opcode = b0 & 0x0F;
+    uint64_t len = len7;
+    if (len7 == 126) {
+        len = (c->hdr[2] << 8) | c->hdr[3];
+    } else if (len7 == 127) {
+        len = 0;
+        for (int i = 0; i < 8; i++) len = (len << 8) | c->hdr[2 + i];
+    }
+    c->payload_len = MIN(len, (uint64_t)UINT32_MAX);
+    c->payload_pos = 0;
+    // Расширений не договаривались: биты RSV должны быть нулевыми
+    if (b0 & 0x70) {
+        start_close(c, WEBSOCKET_CLOSE_PROTOCOL);
+        return false;
+    }
+
+    if (c->opcode & 0x08) {
+        // Управляющий кадр: короткий и не фрагментированный
+        bool known = c->opcode == WS_OP_CLOSE || c->opcode == WS_OP_PING || c->opcode == WS_OP_PONG;
+        if (!known || !c->fin || len > WS_CONTROL_MAX) {
+            start_close(c, WEBSOCKET_CLOSE_PROTOCOL);
+            return false;
+        }
+        return true;
+    }
+
+    if (c->opcode == WS_OP_TEXT || c->opcode == WS_OP_BINARY) {
+        // Новое сообщение, пока не закончено предыдущее
+        if (c->msg_opcode) {
+            start_close(c, WEBSOCKET_CLOSE_PROTOCOL);
+            return false;
+        }
+        c->msg = (uint8_t *)mem_pool_acquire(&s_msg_pool);
+        if (!c->msg) {
+            start_close(c, WEBSOCKET_CLOSE_TRY_AGAIN);
+            return false;
+        }
+        c->msg_opcode = c->opcode;
+        c->msg_len = 0;
+        c->utf8_need = 0;
+    } else if (c->opcode == WS_OP_CONTINUATION) {
+        if (!c->msg_opcode) {
+            start_close(c, WEBSOCKET_CLOSE_PROTOCOL);
+            return false;
+        }
+        STAT_INC(fragments_in);
+    } else {
+        start_close(c, WEBSOCKET_CLOSE_PROTOCOL);
+        return false;
+    }
+    if (len > WEBSOCKET_MSG_MAX - c->msg_len) {
+        start_close(c, WEBSOCKET_CLOSE_TOO_BIG);
+        return false;
+    }
+    return true;
+}
+
+/* Код, который можно прислать в кадре close (RFC 6455, 7.4). 1005, 1006 и 1015 - только для API,
+ * 1004 и остальное до 3000 зарезервировано */
+static bool valid_close_code(uint16_t code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+/* Продолжаем проверку текста UTF-8 на очередном куске (RFC 3629): без слишком длинных форм,
+ * суррогатов и кодов больше U+10FFFF. false - недопустимая последовательность */
+static bool utf8_feed(ws_client_t *c, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b = p[i];
+        if (c->utf8_need) {
+            if (b < c->utf8_lo || b > c->utf8_hi) return false;
+            c->utf8_need--;
+            c->utf8_lo = 0x80;
+            c->utf8_hi = 0xBF;
+            continue;
+        }
+        if (b < 0x80) continue;
+        c->utf8_lo = 0x80;
+        c->utf8_hi = 0xBF;
+        if (b >= 0xC2 && b <= 0xDF) {
+            c->utf8_need = 1;
+        } else if (b >= 0xE0 && b <= 0xEF) {
+            c->utf8_need = 2;
+            if (b == 0xE0) c->utf8_lo = 0xA0;   // слишком длинная форма
+            if (b == 0xED) c->utf8_hi = 0x9F;   // суррогаты U+D800..U+DFFF
+        } else if (b >= 0xF0 && b <= 0xF4) {
+            c->utf8_need = 3;
+            if (b == 0xF0) c->utf8_lo = 0x90;
+            if (b == 0xF4) c->utf8_hi = 0x8F;   // больше U+10FFFF
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Кадр принят целиком */
+static bool frame_end(int id, ws_client_t *c) {
+    switch (c->opcode) {
+    case WS_OP_CLOSE: {
+        // Отвечаем тем же кодом; без кода - обычное закрытие. Один байт или недопустимый код - ошибка протокола
+        uint16_t code = c->payload_len >= 2 ? (c->ctrl[0] << 8) | c->ctrl[1] : WEBSOCKET_CLOSE_NORMAL;
+        if (c->payload_len == 1 || !valid_close_code(code)) code = WEBSOCKET_CLOSE_PROTOCOL;
+        start_close(c, code);
+        return false;
+    }
+    case WS_OP_PING:
+        send_locked(c, WS_OP_PONG, c->ctrl, c->payload_len);
+        return c->state == WS_OPEN;
+    case WS_OP_PONG:
+        return true;
+    }
+
+    // Недопустимый текст отвергаем на том фрагменте, где он встретился, а на последнем
+    // символ не должен обрываться
+    if (c->msg_opcode == WS_OP_TEXT &&
+        (!utf8_feed(c, c->msg + c->msg_len, c->payload_len) || (c->fin && c->utf8_need))) {
+        start_close(c, WEBSOCKET_CLOSE_INVALID_DATA);
+        return false;
+    }
+    c->msg_len += c->payload_len;
+    if (!c->fin) return true;
+    STAT_INC(messages_in);
+    if (s_message_cb) s_message_cb(id, c->msg, c->msg_len, c->msg_opcode == WS_OP_TEXT);
+    mem_pool_release(&s_msg_pool, c->msg);
+    c->msg = NULL;
+    c->msg_opcode = 0;
+    return true;
+}
+
+/* Принятые байты через разбор кадров. false - соединение закрывается */
+static bool feed(int id, ws_client_t *c, const uint8_t *data, size_t len) {
+    while (len) {
+        if (c->hdr_len < c->hdr_need) {
+            c->hdr[c->hdr_len++] = *data++;
+            len--;
+            if (c->hdr_len == 2) {
+                // Клиент обязан маскировать каждый кадр
+                if (!(c->hdr[1] & 0x80)) {
+                    start_close(c, WEBSOCKET_CLOSE_PROTOCOL);
+                    return false;
+                }
+                uint8_t len7 = c->hdr[1] & 0x7F;
+                c->hdr_need = 2 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0) + 4;
+            }
+            if (c->hdr_len < c->hdr_need) continue;
+            if (!frame_begin(c)) return false;
+        } else {
+            size_t n = MIN(len, (size_t)(c->payload_len - c->payload_pos));
+            uint8_t *dst = (c->opcode & 0x08) ? c->ctrl : c->msg + c->msg_len;
+            const uint8_t *mask = &c->hdr[c->hdr_need - 4];
+            for (size_t i = 0; i < n; i++) {
+                dst[c->payload_pos + i] = data[i] ^ mask[(c->payload_pos + i) & 3];
+            }
+            c->payload_pos += n;
+            data += n;
+            len -= n;
+        }
+        if (c->payload_pos == c->payload_len) {
+            parser_reset(c);
+            if (!frame_end(id, c)) return false;
+        }
+    }
+    return true;
+}
+
+/* Соединение готово к чтению */
+static void client_readable(int id, ws_client_t *c) {
+    int r = transport_recv(&c->tc, s_rx_buf, sizeof(s_rx_buf));
+    if (r <= 0) {
+        // 0 - клиент закрыл первым, TIME_WAIT у него
+        release(c, r == 0);
+        return;
+    }
+    STAT_ADD(bytes_in, r);
+    c->last_rx_us = esp_timer_get_time();
+    c->ping_us = 0;
+    // После close все, кроме закрытия TCP, выбрасываем
+    if (c->state == WS_OPEN) feed(id, c, s_rx_buf, r);
+}
+
+/* Простаивающих пингуем, не ответивших и не закрывших после close отключаем */
+static void client_timers(ws_client_t *c, int64_t now) {
+    if (c->state == WS_CLOSING) {
+        if (now >= c->close_deadline_us) release(c, false);
+        return;
+    }
+    if (c->ping_us) {
+        if (now - c->ping_us > WEBSOCKET_PONG_MS * 1000LL) {
+            STAT_INC(ping_timeouts);
+            release(c, false);
+        }
+    } else if (now - c->last_rx_us > WEBSOCKET_PING_MS * 1000LL) {
+        c->ping_us = now;
+        STAT_INC(pings);
+        send_locked(c, WS_OP_PING, NULL, 0);
+    }
+}
+
+/* Одна задача на все соединения: ждем в select, пока кто-нибудь что-нибудь пришлет */
+static void websocket_task(void *pv) {
+    while (1) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        int maxfd = -1;
+        // Слоты, которые открылись уже после select, ждут следующего круга
+        bool polled[WEBSOCKET_MAX_CLIENTS] = {};
+        xSemaphoreTake(s_lock, portMAX_DELAY);
+        for (int i = 0; i < WEBSOCKET_MAX_CLIENTS; i++) {
+            ws_state_t st = s_clients[i].state;
+            if (st != WS_OPEN && st != WS_CLOSING) continue;
+            polled[i] = true;
+            FD_SET(s_clients[i].tc.sock, &rfds);
+            maxfd = MAX(maxfd, s_clients[i].tc.sock);
+        }
+        xSemaphoreGive(s_lock);
+
+        if (maxfd < 0) {
+            vTaskDelay(pdMS_TO_TICKS(WEBSOCKET_POLL_MS));
+            continue;
+        }
+        // Новое соединение попадет в набор на следующем круге: не позже WEBSOCKET_POLL_MS
+        struct timeval tv = { 0, WEBSOCKET_POLL_MS * 1000 };
+        int n = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+        if (n < 0) {
+            ESP_LOGW(TAG, "select error");
+            vTaskDelay(pdMS_TO_TICKS(WEBSOCKET_POLL_MS));
+            continue;
+        }
+
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < WEBSOCKET_MAX_CLIENTS; i++) {
+            ws_client_t *c = &s_clients[i];
+            if (!polled[i] || c->state == WS_FREE) continue;
+            if (n > 0 && FD_ISSET(c->tc.sock, &rfds)) {
+                client_readable(i, c);
+                if (c->state == WS_FREE) continue;
+            }
+            client_timers(c, now);
+        }
+    }
+}
+
+esp_err_t websocket_init(void) {
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+    esp_err_t err = mem_pool_init(&s_msg_pool, "ws_msg", WEBSOCKET_MSG_MAX, WEBSOCKET_MSG_POOL_SIZE,
+                                  MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (err != ESP_OK) return err;
+    TaskHandle_t task = NULL;
+    if (xTaskCreate(websocket_task, "websocket", WEBSOCKET_TASK_STACK, NULL, 5, &task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    diag_register_task(task);
+    return ESP_OK;
+}
+
+esp_err_t websocket_accept(transport_conn_t *conn, const char *key, const char *version) {
+    // select есть только у сокетов
+    if (conn->kind != TRANSPORT_SOCKET || !s_lock) return ESP_ERR_NOT_SUPPORTED;
+    if (strcmp(version, "13") != 0) return ESP_ERR_INVALID_VERSION;
+    char accept[32];
+    if (strlen(key) != WS_KEY_LEN || !accept_key(key, accept, sizeof(accept))) return ESP_ERR_INVALID_ARG;
+
+    ws_client_t *c = NULL;
+    int id;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (id = 0; id < WEBSOCKET_MAX_CLIENTS; id++) {
+        if (s_clients[id].state == WS_FREE) {
+            c = &s_clients[id];
+            c->state = WS_OPENING;
+            break;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    if (!c) {
+        STAT_INC(rejected);
+        return ESP_ERR_NO_MEM;
+    }
+
+    char resp[160];
+    int n = snprintf(resp, sizeof(resp),
+                     "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if (!transport_send(conn, resp, n, false, false)) {
+        c->state = WS_FREE;
+        return ESP_FAIL;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    c->tc = *conn;
+    c->last_rx_us = esp_timer_get_time();
+    c->ping_us = 0;
+    c->msg = NULL;
+    c->msg_opcode = 0;
+    parser_reset(c);
+    c->state = WS_OPEN;
+    xSemaphoreGive(s_lock);
+
+    portENTER_CRITICAL(&s_stats_mux);
+    s_stats.opened++;
+    s_stats.clients++;
+    if (s_stats.clients > s_stats.peak) s_stats.peak = s_stats.clients;
+    portEXIT_CRITICAL(&s_stats_mux);
+    ESP_LOGI(TAG, "Client %d connected from %s", id, conn->addr);
+    return ESP_OK;
+}
+
+int websocket_broadcast(const void *data, size_t len, bool text) {
+    if (!s_lock) return 0;
+    int sent = 0;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    for (int i = 0; i < WEBSOCKET_MAX_CLIENTS; i++) {
+        if (s_clients[i].state == WS_OPEN &&
+            send_frame(&s_clients[i], text ? WS_OP_TEXT : WS_OP_BINARY, data, len)) {
+            sent++;
+        }
+    }
+    xSemaphoreGive(s_lock);
+    return sent;
+}
+
+esp_err_t websocket_send(int client, const void *data, size_t len, bool text) {
+    if (client < 0 || client >= WEBSOCKET_MAX_CLIENTS || !s_lock) return ESP_ERR_INVALID_ARG;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    ws_client_t *c = &s_clients[client];
+    if (c->state == WS_OPEN) {
+        err = send_frame(c, text ? WS_OP_TEXT : WS_OP_BINARY, data, len) ? ESP_OK : ESP_FAIL;
+    }
+    xSemaphoreGive(s_lock);
+    return err;
+}
+
+void websocket_set_message_cb(websocket_message_cb_t cb) {
+    s_message_cb = cb;
+}
+
+void websocket_get_stats(websocket_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_mux);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_mux);
+}
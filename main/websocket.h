@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#include "transport.h"
+
+/* WebSocket (RFC 6455) для push-уведомлений странице вместо опроса. После рукопожатия
+ * соединение уходит от воркера HTTP к одной задаче, которая ждет все такие соединения в select():
+ * простаивающий клиент не держит ни задачу, ни буферы */
+#define WEBSOCKET_PATH "/_ws"
+/* Одновременно открытых соединений. Каждому нужен сокет и PCB: см. CONFIG_LWIP_MAX_SOCKETS */
+#define WEBSOCKET_MAX_CLIENTS 24
+/* Самое длинное сообщение от клиента, включая склеенные фрагменты. Длиннее - закрываем с 1009 */
+#define WEBSOCKET_MSG_MAX 1024
+/* Буферы под сообщения, которые еще не дочитаны целиком. Берутся только на время приема */
+#define WEBSOCKET_MSG_POOL_SIZE 4
+/* Как часто select просыпается проверить новые соединения и таймауты */
+#define WEBSOCKET_POLL_MS 250
+/* Простаивающему клиенту шлем ping, после него ждем хоть какого-то кадра */
+#define WEBSOCKET_PING_MS 30000
+#define WEBSOCKET_PONG_MS 10000
+/* Сколько после кадра close ждем, что клиент закроет TCP первым */
+#define WEBSOCKET_CLOSE_MS 2000
+#define WEBSOCKET_TASK_STACK 4096
+
+/* Коды закрытия */
+#define WEBSOCKET_CLOSE_NORMAL 1000
+#define WEBSOCKET_CLOSE_GOING_AWAY 1001
+#define WEBSOCKET_CLOSE_PROTOCOL 1002
+#define WEBSOCKET_CLOSE_INVALID_DATA 1007   // текстовое сообщение не в UTF-8
+#define WEBSOCKET_CLOSE_TOO_BIG 1009
+#define WEBSOCKET_CLOSE_TRY_AGAIN 1013
+
+/* Сообщение от клиента `client`, собранное из всех фрагментов. Текст (`text`) уже проверен
+ * на UTF-8. Вызывается из задачи websocket */
+typedef void (*websocket_message_cb_t)(int client, const uint8_t *data, size_t len, bool text);
+
+typedef struct {
+    uint16_t clients;           // открыто сейчас
+    uint16_t peak;
+    uint32_t opened;
+    uint32_t rejected;          // не хватило места: 503 на рукопожатие
+    uint32_t closed;
+    uint32_t client_closes;     // клиент закрыл TCP первым
+    uint32_t messages_in;
+    uint32_t fragments_in;      // кадров-продолжений
+    uint32_t messages_out;      // сообщений, отправленных одному клиенту
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t pings;
+    uint32_t ping_timeouts;     // клиент не ответил на ping
+    uint32_t protocol_errors;   // в том числе текст не в UTF-8
+    uint32_t send_errors;       // сообщение не поместилось в буфер отправки: клиент закрыт
+} websocket_stats_t;
+
+esp_err_t websocket_init(void);
+
+/* Разбираем запрос на Upgrade, отвечаем 101 и забираем соединение себе: после ESP_OK вызывающий
+ * его больше не трогает. Ошибки - до ответа: ESP_ERR_NOT_SUPPORTED - транспорт без select (netconn),
+ * ESP_ERR_INVALID_VERSION - не версия 13, ESP_ERR_INVALID_ARG - нет ключа, ESP_ERR_NO_MEM - нет места */
+esp_err_t websocket_accept(transport_conn_t *conn, const char *key, const char *version);
+
+/* Сообщение всем открытым соединениям. Возвращает, скольким клиентам оно ушло. Отправка не ждет:
+ * сообщение (с заголовком кадра) должно целиком помещаться в буфер отправки сокета (TCP_SND_BUF),
+ * клиент, у которого для него не нашлось места, закрывается */
+int websocket_broadcast(const void *data, size_t len, bool text);
+
+/* Сообщение одному клиенту, с тем же ограничением на размер */
+esp_err_t websocket_send(int client, const void *data, size_t len, bool text);
+
+void websocket_set_message_cb(websocket_message_cb_t cb);
+
+void websocket_get_stats(websocket_stats_t *stats);
@@ -1,104 +1,271 @@
-#include <string.h>
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "freertos/event_groups.h"
-#include "esp_system.h"
-#include "esp_wifi.h"
-#include "esp_event.h"
-#include "esp_log.h"
-#include "nvs_flash.h"
-#include "wifi.h"
-#include "lwip/err.h"
-#include "lwip/sys.h"
-
-
-volatile bool wifi_conection_established = false;
-volatile bool wifi_conection_failed = false;
-
-/* FreeRTOS event group to signal when we are connected */
-static EventGroupHandle_t s_wifi_event_group;
-
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-
-// static const char *TAG = "WIFI";
-static int s_retry_num = 0;
-
-static void event_handler(void* arg, esp_event_base_t event_base,
-                         int32_t event_id, void* event_data)
-{
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        wifi_conection_established = false;
-        if (s_retry_num < MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
-            wifi_conection_failed = true;
-        }
-    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        wifi_conection_established = true;
-        s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
-    }
-}
-
-static void init_nvs() {
-  esp_err_t ret = nvs_flash_init();
-  if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-      ESP_ERROR_CHECK(nvs_flash_erase());
-      ret = nvs_flash_init();
-  }
-  ESP_ERROR_CHECK(ret);
-}
-
-void wifi_init_sta(void)
-{
-    init_nvs();
-    s_wifi_event_group = xEventGroupCreate();
-
-    ESP_ERROR_CHECK(esp_netif_init());
-
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    esp_netif_create_default_wifi_sta();
-
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                      ESP_EVENT_ANY_ID,
-                                                      &event_handler,
-                                                      NULL,
-                                                      &instance_any_id));
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
-                                                      IP_EVENT_STA_GOT_IP,
-                                                      &event_handler,
-                                                      NULL,
-                                                      &instance_got_ip));
-
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASSWORD,
-            .threshold = { .authmode = WIFI_AUTH_WPA2_PSK },
-        },
-    };
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
-    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
-
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-            pdFALSE,
-            pdFALSE,
-            portMAX_DELAY);
-}
\ No newline at end of file
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_system.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "nvs.h"
+#include "mbedtls/sha256.h"
+#include "wifi.h"
+#include "lwip/err.h"
+#include "lwip/sys.h"
+#include "lwip/opt.h"
+
+
+volatile bool wifi_conection_established = false;
+volatile bool wifi_conection_failed = false;
+
+/* FreeRTOS event group to signal when we are connected */
+static EventGroupHandle_t s_wifi_event_group;
+
+/* The event group allows multiple bits for each event, but we only care about two events:
+ * - we are connected to the AP with an IP
+ * - we failed to connect after the maximum amount of retries */
+#define WIFI_CONNECTED_BIT BIT0
+#define WIFI_FAIL_BIT      BIT1
+
+static const char *TAG = "WIFI";
+static int s_retry_num = 0;
+
+/* Last AP we successfully associated with, kept in NVS for fast scan on the next boot.
+ * Credentials are only compared, so a SHA-256 of SSID + password is enough: the password
+ * never lands in NVS in plaintext */
+typedef struct {
+    uint8_t credentials[32];
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_cached_ap_t;
+
+static esp_netif_t *s_sta_netif = NULL;
+static wifi_config_t s_wifi_config;
+static bool s_using_cached_ap = false;
+static esp_timer_handle_t s_reconnect_timer;
+static void (*s_ip_changed_cb)(void) = NULL;
+
+static wifi_stats_t s_stats;
+static int64_t s_disconnected_us = 0;
+
+static void credentials_hash(const wifi_config_t *config, uint8_t out[32]) {
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, config->sta.ssid, sizeof(config->sta.ssid));
+    mbedtls_sha256_update(&sha, config->sta.password, sizeof(config->sta.password));
+    mbedtls_sha256_finish(&sha, out);
+    mbedtls_sha256_free(&sha);
+}
+
+/* A blob in the old layout (plaintext credentials) has another size and is rewritten on the next connect */
+static bool load_cached_ap(wifi_cached_ap_t *ap) {
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return false;
+    size_t len = sizeof(*ap);
+    esp_err_t err = nvs_get_blob(nvs, WIFI_NVS_KEY, ap, &len);
+    nvs_close(nvs);
+    return err == ESP_OK && len == sizeof(*ap);
+}
+
+/* Only write when something changed: reconnects to the same AP must not wear flash */
+static void save_cached_ap(const wifi_event_sta_connected_t *event) {
+    wifi_cached_ap_t ap;
+    memset(&ap, 0, sizeof(ap));
+    credentials_hash(&s_wifi_config, ap.credentials);
+    memcpy(ap.bssid, event->bssid, sizeof(ap.bssid));
+    ap.channel = event->channel;
+
+    wifi_cached_ap_t old;
+    if (load_cached_ap(&old) && memcmp(&old, &ap, sizeof(ap)) == 0) return;
+
+    nvs_handle_t nvs;
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return;
+    if (nvs_set_blob(nvs, WIFI_NVS_KEY, &ap, sizeof(ap)) == ESP_OK) nvs_commit(nvs);
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "Cached AP channel %d", ap.channel);
+}
+
+/* Cached BSSID/channel did not work (AP moved or was replaced): go back to a full scan */
+static void drop_cached_ap(void) {
+    s_using_cached_ap = false;
+    s_wifi_config.sta.bssid_set = false;
+    s_wifi_config.sta.channel = 0;
+    s_wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config);
+}
+
+/* Exponential backoff with +-25% jitter, so devices that lost the AP together don't reconnect in lockstep */
+static uint32_t backoff_ms(int attempt) {
+    uint32_t delay = WIFI_BACKOFF_BASE_MS;
+    for (int i = 0; i < attempt && delay < WIFI_BACKOFF_MAX_MS; i++) delay *= 2;
+    if (delay > WIFI_BACKOFF_MAX_MS) delay = WIFI_BACKOFF_MAX_MS;
+    uint32_t jitter = delay / 4;
+    return delay - jitter + esp_random() % (2 * jitter + 1);
+}
+
+static void reconnect_timer_cb(void* arg)
+{
+    esp_wifi_connect();
+}
+
+static void event_handler(void* arg, esp_event_base_t event_base,
+                         int32_t event_id, void* event_data)
+{
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
+        esp_wifi_connect();
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        if (s_using_cached_ap) s_stats.fast_connects++;
+        save_cached_ap((wifi_event_sta_connected_t*) event_data);
+#if CONFIG_LWIP_IPV6
+        // Link-local address for IPv6 clients; global ones come from router advertisements
+        esp_netif_create_ip6_linklocal(s_sta_netif);
+#endif
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        // Reconnect time is counted from losing a working connection, not from boot
+        if (wifi_conection_established) s_disconnected_us = esp_timer_get_time();
+        wifi_conection_established = false;
+        if (s_using_cached_ap) drop_cached_ap();
+        // Never give up: the server keeps running and is reachable again once we are back.
+        // WIFI_FAIL_BIT only reports that the first MAXIMUM_RETRY attempts failed
+        if (++s_retry_num == MAXIMUM_RETRY) {
+            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+            wifi_conection_failed = true;
+        }
+        uint32_t delay = backoff_ms(s_retry_num - 1);
+        ESP_LOGW(TAG, "Disconnected, retry %d in %u ms", s_retry_num, (unsigned)delay);
+        esp_timer_start_once(s_reconnect_timer, (uint64_t)delay * 1000);
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
+        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
+        ESP_LOGI(TAG, "Got IP " IPSTR, IP2STR(&event->ip_info.ip));
+        if (s_disconnected_us) {
+            uint32_t ms = (uint32_t)((esp_timer_get_time() - s_disconnected_us) / 1000);
+            s_stats.reconnects++;
+            s_stats.last_reconnect_ms = ms;
+            if (ms > s_stats.max_reconnect_ms) s_stats.max_reconnect_ms = ms;
+            s_stats.total_reconnect_ms += ms;
+            s_disconnected_us = 0;
+        }
+        s_stats.connect_ms = (uint32_t)(esp_timer_get_time() / 1000);
+        wifi_conection_established = true;
+        wifi_conection_failed = false;
+        s_retry_num = 0;
+        xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        if (event->ip_changed && s_ip_changed_cb) s_ip_changed_cb();
+    } else if (event_base == IP_EVENT && event_id == IP_EVENT_GOT_IP6) {
+        ip_event_got_ip6_t* event = (ip_event_got_ip6_t*) event_data;
+        ESP_LOGI(TAG, "Got IPv6 " IPV6STR, IPV62STR(event->ip6_info.ip));
+    }
+}
+
+void init_nvs() {
+  esp_err_t ret = nvs_flash_init();
+  if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+      ESP_ERROR_CHECK(nvs_flash_erase());
+      ret = nvs_flash_init();
+  }
+  ESP_ERROR_CHECK(ret);
+}
+
+void wifi_set_ip_changed_cb(void (*cb)(void))
+{
+    s_ip_changed_cb = cb;
+}
+
+void wifi_get_stats(wifi_stats_t *stats)
+{
+    *stats = s_stats;
+}
+
+int wifi_get_ip6(esp_ip6_addr_t *addrs, int max)
+{
+#if CONFIG_LWIP_IPV6
+    if (!s_sta_netif) return 0;
+    esp_ip6_addr_t all[LWIP_IPV6_NUM_ADDRESSES];
+    int n = esp_netif_get_all_ip6(s_sta_netif, all);
+    if (n > max) n = max;
+    memcpy(addrs, all, n * sizeof(esp_ip6_addr_t));
+    return n;
+#else
+    return 0;
+#endif
+}
+
+void wifi_init_sta(void)
+{
+    s_wifi_event_group = xEventGroupCreate();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    s_sta_netif = esp_netif_create_default_wifi_sta();
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &reconnect_timer_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_reconnect",
+        .skip_unhandled_events = false,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_reconnect_timer));
+
+    esp_event_handler_instance_t instance_any_id;
+    esp_event_handler_instance_t instance_got_ip;
+    esp_event_handler_instance_t instance_got_ip6;
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
+                                                      ESP_EVENT_ANY_ID,
+                                                      &event_handler,
+                                                      NULL,
+                                                      &instance_any_id));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                      IP_EVENT_STA_GOT_IP,
+                                                      &event_handler,
+                                                      NULL,
+                                                      &instance_got_ip));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
+                                                      IP_EVENT_GOT_IP6,
+                                                      &event_handler,
+                                                      NULL,
+                                                      &instance_got_ip6));
+
+    wifi_config_t wifi_config = {
+        .sta = {
+            .ssid = WIFI_SSID,
+            .password = WIFI_PASSWORD,
+            .threshold = { .authmode = WIFI_AUTH_WPA2_PSK },
+        },
+    };
+    s_wifi_config = wifi_config;
+
+    // Same credentials as last time: skip the full scan and go straight to the known AP
+    wifi_cached_ap_t ap;
+    uint8_t credentials[32];
+    credentials_hash(&s_wifi_config, credentials);
+    if (load_cached_ap(&ap) && memcmp(ap.credentials, credentials, sizeof(credentials)) == 0) {
+        s_wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+        s_wifi_config.sta.bssid_set = true;
+        memcpy(s_wifi_config.sta.bssid, ap.bssid, sizeof(ap.bssid));
+        s_wifi_config.sta.channel = ap.channel;
+        s_using_cached_ap = true;
+        ESP_LOGI(TAG, "Fast connect on channel %d", ap.channel);
+    }
+
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_start());
+    // Idle baseline. While there is traffic wifi_ps switches to WIFI_PS_NONE
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MAX_MODEM));
+
+    // Reconnects are endless now, so only a successful connection ends the wait
+    xEventGroupWaitBits(s_wifi_event_group,
+            WIFI_CONNECTED_BIT,
+            pdFALSE,
+            pdFALSE,
+            portMAX_DELAY);
+}
@@ -1,27 +1,57 @@
-#include <string.h>
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "freertos/event_groups.h"
-#include "esp_system.h"
-#include "esp_wifi.h"
-#include "esp_event.h"
-#include "esp_log.h"
-#include "nvs_flash.h"
-
-#include "lwip/err.h"
-#include "lwip/sys.h"
-
-#define WIFI_SSID      "<SSID>"
-#define WIFI_PASSWORD  "<PASSWORD>"
-#define MAXIMUM_RETRY  5
-
-extern volatile bool wifi_conection_established;
-extern volatile bool wifi_conection_failed;
-
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
-#define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT      BIT1
-
-void wifi_init_sta(void);
\ No newline at end of file
+#pragma once
+
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_system.h"
+#include "esp_wifi.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "lwip/err.h"
+#include "lwip/sys.h"
+
+#define WIFI_SSID      "<SSID>"
+#define WIFI_PASSWORD  "<PASSWORD>"
+/* After this many failed attempts in a row `wifi_conection_failed` is raised.
+ * Reconnecting itself never stops */
+#define MAXIMUM_RETRY  5
+
+#define WIFI_NVS_NAMESPACE   "wifi"
+#define WIFI_NVS_KEY         "last_ap"
+#define WIFI_BACKOFF_BASE_MS 500
+#define WIFI_BACKOFF_MAX_MS  30000
+
+extern volatile bool wifi_conection_established;
+extern volatile bool wifi_conection_failed;
+
+/* The event group allows multiple bits for each event, but we only care about two events:
+ * - we are connected to the AP with an IP
+ * - we failed to connect after the maximum amount of retries */
+#define WIFI_CONNECTED_BIT BIT0
+#define WIFI_FAIL_BIT      BIT1
+
+typedef struct {
+    uint32_t connect_ms;         // uptime when the current connection got its IP
+    uint32_t reconnects;         // connections restored after a disconnect
+    uint32_t last_reconnect_ms;  // disconnect -> IP, for the last reconnect
+    uint32_t max_reconnect_ms;
+    uint32_t total_reconnect_ms;
+    uint32_t fast_connects;      // associations made with the cached channel/BSSID
+} wifi_stats_t;
+
+/* NVS нужна и Wi-Fi, и остальным модулям, поэтому инициализируется до всех них */
+void init_nvs(void);
+/* Blocks until the first IP is obtained */
+void wifi_init_sta(void);
+
+/* Called from the event loop when the station gets a different IP after a reconnect */
+void wifi_set_ip_changed_cb(void (*cb)(void));
+
+void wifi_get_stats(wifi_stats_t *stats);
+
+/* Current IPv6 addresses of the station (link-local and global), up to `max` */
+int wifi_get_ip6(esp_ip6_addr_t *addrs, int max);
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "wifi_ps.h"
+
+static const char *TAG = "wifi_ps";
+
+static const wifi_ps_ops_t s_default_ops = {
+    .set_ps = esp_wifi_set_ps,
+    .now_us = esp_timer_get_time,
+};
+
+static const wifi_ps_ops_t *s_ops;
+static SemaphoreHandle_t s_lock;
+static esp_timer_handle_t s_timer;
+
+static volatile wifi_ps_type_t s_mode;
+static volatile int64_t s_last_activity_us;
+static int64_t s_mode_since_us;
+static wifi_ps_stats_t s_stats;
+
+/* Переключаем режим и учитываем время в предыдущем. Под s_lock */
+static void switch_mode(wifi_ps_type_t mode) {
+    if (s_mode == mode) return;
+    if (s_ops->set_ps(mode) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to switch power save to %d", mode);
+        return;
+    }
+    int64_t now = s_ops->now_us();
+    s_stats.time_in_mode_us[s_mode] += now - s_mode_since_us;
+    s_mode_since_us = now;
+    s_mode = mode;
+    s_stats.switches++;
+}
+
+static void tick_timer_cb(void *arg) {
+    wifi_ps_tick();
+}
+
+esp_err_t wifi_ps_init(const wifi_ps_ops_t *ops, wifi_ps_type_t initial) {
+    s_ops = ops ? ops : &s_default_ops;
+    s_lock = xSemaphoreCreateMutex();
+    if (!s_lock) return ESP_ERR_NO_MEM;
+    s_mode = initial;
+    s_mode_since_us = s_last_activity_us = s_ops->now_us();
+    memset(&s_stats, 0, sizeof(s_stats));
+    if (ops) return ESP_OK;
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = &tick_timer_cb,
+        .arg = NULL,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_ps",
+        .skip_unhandled_events = true,
+    };
+    esp_err_t err = esp_timer_create(&timer_args, &s_timer);
+    if (err == ESP_OK) err = esp_timer_start_periodic(s_timer, WIFI_PS_CHECK_MS * 1000);
+    return err;
+}
+
+void wifi_ps_activity(void) {
+    s_last_activity_us = s_ops->now_us();
+    if (s_mode == WIFI_PS_NONE) return;
+    // Пока модем спит, каждый пакет к нам ждет DTIM: просыпаемся сразу, а не по таймеру
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (s_mode != WIFI_PS_NONE) {
+        s_stats.wakeups++;
+        switch_mode(WIFI_PS_NONE);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+void wifi_ps_tick(void) {
+    int64_t idle_us = s_ops->now_us() - s_last_activity_us;
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    if (idle_us >= (int64_t)WIFI_PS_DEEP_IDLE_MS * 1000) {
+        switch_mode(WIFI_PS_MAX_MODEM);
+    } else if (idle_us >= (int64_t)WIFI_PS_IDLE_MS * 1000 && s_mode == WIFI_PS_NONE) {
+        switch_mode(WIFI_PS_MIN_MODEM);
+    }
+    xSemaphoreGive(s_lock);
+}
+
+wifi_ps_type_t wifi_ps_mode(void) {
+    return s_mode;
+}
+
+void wifi_ps_note_first_byte(wifi_ps_type_t mode_at_accept, int64_t us) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    uint32_t n = ++s_stats.first_byte_samples[mode_at_accept];
+    // Скользящее среднее без хранения выборки
+    s_stats.first_byte_avg_us[mode_at_accept] += ((int64_t)us - s_stats.first_byte_avg_us[mode_at_accept]) / (int64_t)n;
+    xSemaphoreGive(s_lock);
+}
+
+void wifi_ps_get_stats(wifi_ps_stats_t *stats) {
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    *stats = s_stats;
+    stats->mode = s_mode;
+    stats->time_in_mode_us[s_mode] += s_ops->now_us() - s_mode_since_us;
+    xSemaphoreGive(s_lock);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_wifi.h"
+
+/* Через сколько без трафика уходим в легкий сон модема и через сколько в глубокий */
+#define WIFI_PS_IDLE_MS 1000
+#define WIFI_PS_DEEP_IDLE_MS 30000
+/* Как часто проверяем простой */
+#define WIFI_PS_CHECK_MS 250
+
+#define WIFI_PS_MODE_COUNT 3
+
+/* Всё, что контроллер трогает снаружи. Подменяется в тестах на хосте */
+typedef struct {
+    esp_err_t (*set_ps)(wifi_ps_type_t type);
+    int64_t (*now_us)(void);
+} wifi_ps_ops_t;
+
+typedef struct {
+    wifi_ps_type_t mode;                        // текущий режим
+    int64_t time_in_mode_us[WIFI_PS_MODE_COUNT];
+    uint32_t switches;
+    uint32_t wakeups;                           // трафик застал модем во сне
+    // Сколько в среднем ждали первый байт запроса после accept, в зависимости от режима на момент accept
+    uint32_t first_byte_avg_us[WIFI_PS_MODE_COUNT];
+    uint32_t first_byte_samples[WIFI_PS_MODE_COUNT];
+} wifi_ps_stats_t;
+
+/* `ops` = NULL: esp_wifi_set_ps и esp_timer. `initial` - режим, уже выставленный при старте Wi-Fi.
+ * С настоящими ops запускает периодическую проверку простоя */
+esp_err_t wifi_ps_init(const wifi_ps_ops_t *ops, wifi_ps_type_t initial);
+
+/* Есть трафик: модем должен бодрствовать. Дешево, вызывается на каждой отправке */
+void wifi_ps_activity(void);
+
+/* Проверка простоя, вызывается таймером раз в WIFI_PS_CHECK_MS */
+void wifi_ps_tick(void);
+
+wifi_ps_type_t wifi_ps_mode(void);
+
+/* Учитываем задержку до первого байта запроса для режима, который был на момент accept */
+void wifi_ps_note_first_byte(wifi_ps_type_t mode_at_accept, int64_t us);
+
+void wifi_ps_get_stats(wifi_ps_stats_t *stats);
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Синхронизация файлов сайта с устройством без перезаписи всего раздела.
+
+Сравнивает SHA-256 локальных файлов (по умолчанию main/data) с манифестом устройства
+(GET /_manifest), загружает только изменившиеся (PUT) и удаляет лишние (DELETE).
+
+    python tools/asset_sync.py 192.168.1.50 --token <HTTP_UPLOAD_TOKEN>
+    python tools/asset_sync.py 192.168.1.50 --data main/data --dry-run
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import sys
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+
+
+def local_files(root):
+    """Имя файла в ФС устройства -> (полный путь, sha256). Скрытые файлы сервер не отдает."""
+    files = {}
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames[:] = [d for d in dirnames if not d.startswith('.')]
+        for name in filenames:
+            if name.startswith('.'):
+                continue
+            path = os.path.join(dirpath, name)
+            with open(path, 'rb') as f:
+                digest = hashlib.sha256(f.read()).hexdigest()
+            files[os.path.relpath(path, root).replace(os.sep, '/')] = (path, digest)
+    return files
+
+
+def request(base, method, name, body=None, token=None, timeout=60):
+    url = base + '/' + urllib.parse.quote(name)
+    req = urllib.request.Request(url, data=body, method=method)
+    if token:
+        req.add_header('Authorization', 'Bearer ' + token)
+    try:
+        with urllib.request.urlopen(req, timeout=timeout) as resp:
+            return resp.status, resp.read()
+    except urllib.error.HTTPError as e:
+        return e.code, e.read()
+
+
+def plan(local, remote):
+    """Запросы (метод, имя) в порядке отправки. PUT и DELETE несжатого файла удаляют на устройстве
+    и его .gz, поэтому такой .gz, если он есть локально, загружается заново, даже если не менялся,
+    и всегда после них."""
+    upload = {name for name, (_, digest) in local.items() if remote.get(name) != digest}
+    for name in list(upload):
+        if not name.endswith('.gz') and name + '.gz' in local:
+            upload.add(name + '.gz')
+    delete = sorted(name for name in remote if name not in local)
+    # DELETE несжатого файла удаляет и его .gz
+    delete = [name for name in delete if not (name.endswith('.gz') and name[:-3] in delete)]
+    # Локально остался только .gz: он уйдет вместе с несжатым, поэтому загружается после удаления
+    restore = sorted(name + '.gz' for name in delete if not name.endswith('.gz') and name + '.gz' in local)
+    upload -= set(restore)
+    return ([('PUT', name) for name in sorted(upload, key=lambda n: (n.endswith('.gz'), n))] +
+            [('DELETE', name) for name in delete] +
+            [('PUT', name) for name in restore])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('host', help='адрес устройства, например 192.168.1.50 или 192.168.1.50:8080')
+    parser.add_argument('--data', default=os.path.join(os.path.dirname(__file__), '..', 'main', 'data'),
+                        help='каталог с файлами сайта (по умолчанию main/data)')
+    parser.add_argument('--token', default=os.environ.get('ASSET_SYNC_TOKEN'),
+                        help='токен HTTP_UPLOAD_TOKEN устройства (по умолчанию $ASSET_SYNC_TOKEN)')
+    parser.add_argument('--dry-run', action='store_true', help='только показать, что изменится')
+    args = parser.parse_args()
+
+    base = args.host if args.host.startswith('http') else 'http://' + args.host
+    base = base.rstrip('/')
+    started = time.time()
+
+    status, body = request(base, 'GET', '_manifest')
+    if status != 200:
+        sys.exit('GET /_manifest: HTTP %d' % status)
+    remote = json.loads(body)
+    local = local_files(args.data)
+    ops = plan(local, remote)
+    upload = [name for method, name in ops if method == 'PUT']
+
+    total = sum(os.path.getsize(path) for path, _ in local.values())
+    size = sum(os.path.getsize(local[name][0]) for name in upload)
+    print('%d files on device, %d local; upload %d (%d of %d bytes), delete %d'
+          % (len(remote), len(local), len(upload), size, total, len(ops) - len(upload)))
+    if args.dry_run:
+        for method, name in ops:
+            print(' ', method, name)
+        return
+
+    failed = 0
+    for method, name in ops:
+        if method == 'DELETE':
+            status, _ = request(base, 'DELETE', name, token=args.token)
+            # 404 - файл уже ушел вместе с несжатым
+            ok = status in (200, 404)
+            failed += not ok
+            print('  DELETE %s%s' % (name, '' if ok else ': HTTP %d' % status))
+            continue
+        with open(local[name][0], 'rb') as f:
+            data = f.read()
+        t0 = time.time()
+        status, body = request(base, 'PUT', name, data, args.token)
+        ok = status in (200, 201)
+        failed += not ok
+        print('  PUT %s: %d bytes, %.2f s%s' % (name, len(data), time.time() - t0, '' if ok else ', HTTP %d' % status))
+
+    print('Done in %.1f s%s' % (time.time() - started, ', %d failed' % failed if failed else ''))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Всплески загрузок страницы: проверяем, что у устройства не кончаются TCP PCB.
+
+Каждый всплеск - столько соединений сразу, сколько открыли бы несколько браузеров (по умолчанию
+3 x 6). Каждое соединение делает несколько запросов keep-alive, последний с "Connection: close",
+дочитывает ответ и закрывается. После всплеска из /_diag берутся tcp_active и tcp_time_wait:
+их сумма не должна доходить до tcp_pcb_max, а запросы не должны падать.
+
+    python tools/burst.py 192.168.1.50
+    python tools/burst.py 192.168.1.50 --bursts 20 --connections 24 --pause 0.5
+"""
+
+import argparse
+import collections
+import http.client
+import os
+import sys
+import threading
+import time
+import urllib.parse
+
+from stress import connect, delta, diag, expected_bodies
+
+
+def connection(host, paths, requests, timeout, counts, lock):
+    result = collections.Counter()
+    conn = connect(host, timeout)
+    try:
+        for i in range(requests):
+            path = paths[i % len(paths)]
+            last = i == requests - 1
+            headers = {'Connection': 'close'} if last else {}
+            conn.request('GET', urllib.parse.quote(path), headers=headers)
+            resp = conn.getresponse()
+            resp.read()
+            result['ok' if resp.status == 200 else 'HTTP %d' % resp.status] += 1
+            if resp.will_close and not last:
+                result['closed early'] += 1
+                break
+    except (OSError, http.client.HTTPException) as e:
+        result['error: %s' % type(e).__name__] += 1
+    finally:
+        conn.close()
+    with lock:
+        counts.update(result)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('host', help='адрес устройства, например 192.168.1.50 или 192.168.1.50:8080')
+    parser.add_argument('--data', default=os.path.join(os.path.dirname(__file__), '..', 'main', 'data'),
+                        help='каталог с файлами сайта (по умолчанию main/data)')
+    parser.add_argument('--bursts', type=int, default=10, help='сколько всплесков (по умолчанию 10)')
+    parser.add_argument('--connections', type=int, default=18, help='соединений во всплеске (по умолчанию 18)')
+    parser.add_argument('--requests', type=int, default=3, help='запросов на соединение (по умолчанию 3)')
+    parser.add_argument('--pause', type=float, default=1.0, help='пауза между всплесками, с')
+    parser.add_argument('--timeout', type=float, default=30, help='таймаут запроса, с')
+    args = parser.parse_args()
+
+    paths = sorted(expected_bodies(args.data))
+    if not paths:
+        sys.exit('no files in %s' % args.data)
+    before = diag(args.host, args.timeout)
+    pcb_max = before.get('http', {}).get('tcp_pcb_max')
+
+    counts = collections.Counter()
+    lock = threading.Lock()
+    peak = 0
+    exhausted = 0
+    for burst in range(args.bursts):
+        threads = [threading.Thread(target=connection,
+                                    args=(args.host, paths[i % len(paths):] + paths[:i % len(paths)],
+                                          args.requests, args.timeout, counts, lock))
+                   for i in range(args.connections)]
+        t0 = time.time()
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.time() - t0
+
+        http_stats = diag(args.host, args.timeout).get('http', {})
+        active = http_stats.get('tcp_active', 0)
+        time_wait = http_stats.get('tcp_time_wait', 0)
+        peak = max(peak, active + time_wait)
+        full = pcb_max is not None and active + time_wait >= pcb_max
+        exhausted += full
+        print('burst %2d: %.2f s, tcp_active %d, tcp_time_wait %d of %s%s'
+              % (burst + 1, elapsed, active, time_wait, pcb_max if pcb_max is not None else '?',
+                 ', PCB EXHAUSTED' if full else ''))
+        time.sleep(args.pause)
+
+    after = diag(args.host, args.timeout)
+    total = sum(counts.values())
+    for key, n in sorted(counts.items()):
+        print('  %-24s %d' % (key, n))
+    if after:
+        print('http: ' + delta(before, after, 'http', ('client_closes', 'drain_timeouts', 'idle_timeouts',
+                                                       'idle_yields', 'resets', 'shed', 'queue_sheds')))
+        print('peak tcp_active + tcp_time_wait: %d of %s' % (peak, pcb_max))
+
+    failed = total - counts['ok']
+    ok = not failed and not exhausted
+    print('OK' if ok else 'FAILED: %d of %d requests, %d bursts hit tcp_pcb_max' % (failed, total, exhausted))
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
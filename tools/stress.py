@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Нагрузка: N клиентов одновременно скачивают файлы сайта, каждый по своему keep-alive соединению.
+
+Каждый ответ сверяется с локальным файлом (по умолчанию main/data): статус 200 и те же байты после
+распаковки gzip. Отдельно считаются подмены на index.html (fallback), которых при нехватке
+дескрипторов быть не должно, и 503. В конце - изменения счетчиков file_pool и http из /_diag.
+
+    python tools/stress.py 192.168.1.50
+    python tools/stress.py 192.168.1.50 --clients 16 --rounds 20
+"""
+
+import argparse
+import collections
+import gzip
+import http.client
+import json
+import os
+import random
+import sys
+import threading
+import time
+import urllib.parse
+
+from asset_sync import local_files
+
+
+def expected_bodies(root):
+    """URL-путь -> ожидаемое тело без сжатия. Файл, который лежит только как .gz, сервер распаковывает сам."""
+    files = local_files(root)
+    bodies = {}
+    for name, (path, _) in files.items():
+        with open(path, 'rb') as f:
+            data = f.read()
+        if name.endswith('.gz'):
+            plain = name[:-3]
+            if plain in files:
+                continue
+            bodies['/' + plain] = gzip.decompress(data)
+        else:
+            bodies['/' + name] = data
+    return bodies
+
+
+def connect(host, timeout):
+    parsed = urllib.parse.urlsplit(host if '://' in host else 'http://' + host)
+    return http.client.HTTPConnection(parsed.hostname, parsed.port or 80, timeout=timeout)
+
+
+def get(conn, path, accept_gzip):
+    headers = {'Accept-Encoding': 'gzip'} if accept_gzip else {}
+    conn.request('GET', urllib.parse.quote(path), headers=headers)
+    resp = conn.getresponse()
+    body = resp.read()
+    if resp.getheader('Content-Encoding') == 'gzip':
+        body = gzip.decompress(body)
+    return resp.status, body, resp.will_close
+
+
+def diag(host, timeout):
+    conn = connect(host, timeout)
+    try:
+        status, body, _ = get(conn, '/_diag', False)
+        return json.loads(body) if status == 200 else {}
+    finally:
+        conn.close()
+
+
+def client(host, bodies, rounds, accept_gzip, timeout, results, lock):
+    index = bodies.get('/index.html')
+    counts = collections.Counter()
+    latencies = []
+    conn = connect(host, timeout)
+    for _ in range(rounds):
+        paths = list(bodies)
+        random.shuffle(paths)
+        for path in paths:
+            t0 = time.time()
+            try:
+                status, body, will_close = get(conn, path, accept_gzip)
+            except (OSError, http.client.HTTPException) as e:
+                counts['error: %s' % type(e).__name__] += 1
+                conn.close()
+                conn = connect(host, timeout)
+                continue
+            latencies.append(time.time() - t0)
+            if status != 200:
+                counts['HTTP %d' % status] += 1
+            elif body == bodies[path]:
+                counts['ok'] += 1
+            elif index is not None and body == index:
+                counts['fallback'] += 1
+            else:
+                counts['mismatch'] += 1
+            if will_close:
+                conn.close()
+                conn = connect(host, timeout)
+    conn.close()
+    with lock:
+        results['counts'].update(counts)
+        results['latencies'].extend(latencies)
+
+
+def delta(before, after, section, keys):
+    b, a = before.get(section, {}), after.get(section, {})
+    return ', '.join('%s +%d' % (k, a.get(k, 0) - b.get(k, 0)) for k in keys if k in a)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('host', help='адрес устройства, например 192.168.1.50 или 192.168.1.50:8080')
+    parser.add_argument('--data', default=os.path.join(os.path.dirname(__file__), '..', 'main', 'data'),
+                        help='каталог с файлами сайта (по умолчанию main/data)')
+    parser.add_argument('--clients', type=int, default=16, help='одновременных соединений (по умолчанию 16)')
+    parser.add_argument('--rounds', type=int, default=10, help='сколько раз каждый клиент скачивает все файлы')
+    parser.add_argument('--no-gzip', action='store_true', help='не слать Accept-Encoding: gzip')
+    parser.add_argument('--timeout', type=float, default=30, help='таймаут запроса, с')
+    args = parser.parse_args()
+
+    bodies = expected_bodies(args.data)
+    if not bodies:
+        sys.exit('no files in %s' % args.data)
+    before = diag(args.host, args.timeout)
+
+    results = {'counts': collections.Counter(), 'latencies': []}
+    lock = threading.Lock()
+    threads = [threading.Thread(target=client, args=(args.host, bodies, args.rounds, not args.no_gzip,
+                                                     args.timeout, results, lock))
+               for _ in range(args.clients)]
+    started = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.time() - started
+
+    after = diag(args.host, args.timeout)
+    counts = results['counts']
+    latencies = sorted(results['latencies'])
+    total = sum(counts.values())
+    print('%d clients x %d rounds x %d files: %d requests in %.1f s (%.0f req/s)'
+          % (args.clients, args.rounds, len(bodies), total, elapsed, total / elapsed if elapsed else 0))
+    if latencies:
+        print('latency: median %.0f ms, p95 %.0f ms, max %.0f ms'
+              % (latencies[len(latencies) // 2] * 1000, latencies[int(len(latencies) * 0.95)] * 1000,
+                 latencies[-1] * 1000))
+    for key, n in sorted(counts.items()):
+        print('  %-24s %d' % (key, n))
+    if after:
+        print('file_pool: ' + delta(before, after, 'file_pool', ('opens', 'hits', 'evictions', 'waits', 'timeouts')))
+        print('http: ' + delta(before, after, 'http', ('shed', 'queue_sheds', 'keepalive_reuses', 'idle_yields')))
+
+    failed = total - counts['ok']
+    print('OK' if not failed else 'FAILED: %d of %d requests' % (failed, total))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()